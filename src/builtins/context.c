@@ -9,12 +9,82 @@
 #include "../strings.h"
 #include "../interp.h"
 
+/* Cache of glob match results against the current context, which never
+ * changes during execution. This is an open-addressed hash table keyed by the
+ * glob text.
+ */
+static struct context_match {
+  string glob;
+  int matches;
+}* match_cache;
+static unsigned match_cache_size, match_cache_count;
+
+/* FNV-1a hash of the given glob. */
+static unsigned hash_glob(const byte* glob, unsigned len) {
+  unsigned hash = 2166136261u, i;
+
+  for (i = 0; i < len; ++i) {
+    hash ^= glob[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/* Returns the slot in match_cache for the given glob, which is either the one
+ * holding that glob or an empty one.
+ */
+static struct context_match* find_match_slot(struct context_match* table,
+                                             unsigned size,
+                                             const byte* glob, unsigned len) {
+  unsigned ix = hash_glob(glob, len) & (size-1);
+
+  while (table[ix].glob &&
+         (table[ix].glob->len != len ||
+          memcmp(string_data(table[ix].glob), glob, len)))
+    ix = (ix+1) & (size-1);
+
+  return table+ix;
+}
+
+int context_matches(const byte* glob, unsigned len) {
+  struct context_match* slot, * old;
+  unsigned old_size, i;
+  char* cglob;
+
+  if (match_cache) {
+    slot = find_match_slot(match_cache, match_cache_size, glob, len);
+    if (slot->glob) return slot->matches;
+  }
+
+  /* Keep the table at most half full. */
+  if (2*(match_cache_count+1) > match_cache_size) {
+    old = match_cache;
+    old_size = match_cache_size;
+    match_cache_size = old_size? old_size*2 : 32;
+    match_cache = tmalloc(match_cache_size * sizeof(struct context_match));
+    memset(match_cache, 0, match_cache_size * sizeof(struct context_match));
+    for (i = 0; i < old_size; ++i)
+      if (old[i].glob)
+        *find_match_slot(match_cache, match_cache_size,
+                         string_data(old[i].glob), old[i].glob->len) = old[i];
+    if (old) free(old);
+  }
+
+  slot = find_match_slot(match_cache, match_cache_size, glob, len);
+  slot->glob = create_string((byte*)glob, (byte*)glob+len);
+  cglob = string_to_cstr(slot->glob);
+  slot->matches = !fnmatch(cglob, current_context, 0);
+  free(cglob);
+  ++match_cache_count;
+  return slot->matches;
+}
+
 /* @builtin-decl int builtin_context(interpreter*) */
 /* @builtin-bind { '@', builtin_context }, */
 int builtin_context(interpreter* interp) {
   byte subcommand;
   unsigned begin;
-  char glob[256];
 
   int skip_match, negate_match;
 
@@ -80,19 +150,17 @@ int builtin_context(interpreter* interp) {
     return 0;
   }
 
-  if (interp->ip - begin >= sizeof(glob)) {
+  if (interp->ip - begin >= 256) {
     print_error("Glob string too long");
     return 0;
   }
 
   /* Do nothing more if skip_match is true. */
-  if (!skip_match) {
-    memcpy(glob, string_data(interp->code) + begin,
-           interp->ip - begin);
-    glob[interp->ip - begin] = 0;
+  if (!skip_match)
     /* Must check to see if it matches. */
-    interp->context_active = !fnmatch(glob, current_context, 0) ^ negate_match;
-  }
+    interp->context_active =
+      context_matches(string_data(interp->code) + begin,
+                      interp->ip - begin) ^ negate_match;
 
   /* Done */
   return 1;
@@ -7,6 +7,7 @@
 #include "../tgl.h"
 #include "../strings.h"
 #include "../interp.h"
+#include "../library.h"
 
 /* @builtin-decl int builtin_defun(interpreter*) */
 /* @builtin-bind { 'd', builtin_defun }, */
@@ -95,6 +96,7 @@ static int builtin_defunlibrary_common(interpreter* interp,
   char header[256], date[64];
   FILE* out;
   unsigned i;
+  long offset;
 
   if (!stack_pop_strings(interp, 2, &body, &name)) UNDERFLOW;
 
@@ -145,6 +147,14 @@ static int builtin_defunlibrary_common(interpreter* interp,
     free(code);
     return 0;
   }
+  /* Note where the code is being added for the library index. */
+  if (fseek(out, 0, SEEK_END) || -1 == (offset = ftell(out))) {
+    fprintf(stderr, "tgl: error seeking in %s: %s\n",
+            user_library_file, strerror(errno));
+    free(code);
+    fclose(out);
+    return 0;
+  }
   if (code->len !=
       fwrite(string_data(code), 1, code->len, out)) {
     fprintf(stderr, "tgl: error writing to %s: %s\n",
@@ -155,7 +165,13 @@ static int builtin_defunlibrary_common(interpreter* interp,
   }
 
   /* Success */
-  fclose(out);
+  if (fclose(out)) {
+    fprintf(stderr, "tgl: error writing to %s: %s\n",
+            user_library_file, strerror(errno));
+    free(code);
+    return 0;
+  }
+  library_note_append(code, offset);
   free(code);
   return 1;
 }
@@ -4,12 +4,15 @@
 
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <ctype.h>
 
 #include "../tgl.h"
 #include "../strings.h"
 #include "../interp.h"
+#include "../process.h"
+#include "../coprocess.h"
+#include "../sed.h"
+#include "../cmdcache.h"
 
 /* Invokes the specified command and arguments, all verbatim.
  *
@@ -17,7 +20,8 @@
  * standard input. Otherwise, the child process receives no input.
  *
  * The process's standard output is captured and accumulated into a
- * string. Standard error is inherited from Tgl.
+ * string. Standard error is inherited from Tgl. Nothing touches the
+ * filesystem; see process.h.
  *
  * If return_status is non-NULL, write the exit status of the child there
  * instead of considering a non-zero exit status to be an error. Abnormal
@@ -27,138 +31,275 @@
  * message is printed to standard error and NULL is returned.
  */
 static string invoke_external(char** argv, string input, int* return_status) {
-  FILE* output_file = NULL, * input_file = NULL;
-  int output_fd, input_fd;
-  string output;
-  long output_length;
-  unsigned output_off;
-  pid_t child;
-  int child_status;
-
-  /* I believe the most portable way to do this is to use tmpfile() to open two
-   * temporary files, one for input and one for output. Write the input to that
-   * file, then execute the child, then read its output back in once it dies.
-   *
-   * Of course, tmpfile() is broken on Windows, but then Windows doesn't have
-   * fork() either, so regardless this function must be rewritten for that
-   * platform.
-   */
-  input_file = tmpfile();
-  if (!input_file) {
-    fprintf(stderr, "tgl: error: creating temp input file: %s\n",
-            strerror(errno));
-    goto error;
-  }
+  process proc;
 
-  output_file = tmpfile();
-  if (!output_file) {
-    fprintf(stderr, "tgl: error: creating temp output file: %s\n",
-            strerror(errno));
-    goto error;
-  }
+  if (!process_start(&proc, argv, input, NULL))
+    return NULL;
+  return process_finish(&proc, return_status);
+}
 
-  if ((input_fd  = fileno(input_file )) == -1 ||
-      (output_fd = fileno(output_file)) == -1) {
-    fprintf(stderr, "tgl: unexpected error: %s\n", strerror(errno));
-    goto error;
+/* Like invoke_external(), but the child writes directly to our standard
+ * output; the returned output is always empty.
+ */
+static string invoke_passthrough(char** argv, string input,
+                                 int* return_status) {
+  process proc;
+
+  if (!process_start_passthrough(&proc, argv, input))
+    return NULL;
+  return process_finish(&proc, return_status);
+}
+
+/* Evaluates the given script with the given input in the helper for the given
+ * language if possible (see coprocess.h), with the same semantics as
+ * invoke_external() without return_status.
+ *
+ * Returns 1 if the script was handled, in which case *output holds the output
+ * or NULL on error. Returns 0 if the caller must run the script itself.
+ */
+static int invoke_helper(coprocess_language lang, const char* name,
+                         string script, string input, string* output) {
+  int status;
+
+  if (!coprocess_eval(lang, name, script, input, output, &status))
+    return 0;
+
+  if (status) {
+    if (status == -1)
+      fprintf(stderr, "tgl: error: child process %s terminated abnormally\n",
+              name);
+    else
+      fprintf(stderr, "tgl: error: child process %s exited with code %d\n",
+              name, status);
+    free(*output);
+    *output = NULL;
   }
+  return 1;
+}
 
-  /* File descriptors set up; now write input */
-  if (input && input->len) {
-    if (!fwrite(string_data(input), 1, input->len, input_file)) {
-      fprintf(stderr, "tgl: error: writing command input: %s\n",
-              strerror(errno));
-      goto error;
-    }
-    rewind(input_file);
+/* Determines the key under which the result of the given command should be
+ * cached, if any. The result is cached if tag_reg (a secondary argument) names
+ * a register, whose contents are then the version tag, or if all commands are
+ * being cached, in which case the tag is $TGL_CACHE_TAG.
+ *
+ * Returns 0 on error. Otherwise, *key is set to the new key, or to NULL if the
+ * result is not to be cached.
+ */
+static int get_cache_key(interpreter* interp, string tag_reg,
+                         char** argv, string input, string* key) {
+  byte reg;
+  string tag;
+
+  *key = NULL;
+  if (!secondary_arg_as_reg(tag_reg, &reg))
+    return 0;
+
+  if (tag_reg) {
+    tag = dupe_string(interp->registers[reg]);
+    touch_reg(interp, reg);
+  } else if (cache_all_commands) {
+    tag = convert_string(getenv("TGL_CACHE_TAG")? getenv("TGL_CACHE_TAG") : "");
+  } else {
+    return 1;
   }
 
-  /* Execute the child */
-  child = fork();
-  if (child == -1) {
-    fprintf(stderr, "tgl: error: fork: %s\n", strerror(errno));
-    goto error;
+  *key = cmdcache_key(argv, tag, input);
+  free(tag);
+  return 1;
+}
+
+/* Looks the given key (if non-NULL) up in the command cache.
+ *
+ * Returns 1 on a hit, in which case *output is set as invoke_external() would
+ * have with the same name and return_status. Returns 0 on a miss.
+ */
+static int get_cached_output(string key, const char* name, int* return_status,
+                             string* output) {
+  int status;
+
+  if (!key || !cmdcache_get(key, output, &status))
+    return 0;
+
+  if (return_status) {
+    *return_status = status;
+  } else if (status) {
+    fprintf(stderr, "tgl: error: child process %s exited with code %d\n",
+            name, status);
+    free(*output);
+    *output = NULL;
   }
+  return 1;
+}
 
-  if (!child) {
-    /* Child process */
-    if (-1 == dup2(input_fd, STDIN_FILENO) ||
-        -1 == dup2(output_fd, STDOUT_FILENO)) {
-      fprintf(stderr, "tgl: error: dup2: %s\n", strerror(errno));
-      exit(EXIT_IO_ERROR);
-    }
-    /* Close original FDs */
-    close(input_fd);
-    close(output_fd);
+/* An external command started by kb or kB. */
+typedef struct job {
+  /* Whether this slot is in use. */
+  int in_use;
+  /* Whether the job has been reaped, in which case output and status are
+   * valid. output is NULL if the job failed.
+   */
+  int done;
+  process proc;
+  /* A copy of the input, which must live as long as the process. */
+  string input;
+  /* The key under which to cache the result, or NULL. */
+  string cache_key;
+  string output;
+  int status;
+} job;
+
+/* All jobs; handles are indices into this array plus one. */
+static job* jobs;
+static unsigned num_jobs;
+
+/* If non-zero, b and B start jobs instead of waiting for the command. */
+static int start_jobs;
+/* If non-zero, b and B pass the output of the command through to our standard
+ * output, and push nothing.
+ */
+static int pass_through;
+
+/* Performs whatever I/O is possible with every running job, waiting at most
+ * timeout milliseconds (or indefinitely if negative).
+ *
+ * Returns the number of jobs with I/O outstanding, or -1 on error.
+ */
+static int pump_jobs(int timeout) {
+  process** procs;
+  unsigned i, n;
+  int ret;
+
+  procs = tmalloc(sizeof(process*) * (num_jobs+1));
+  for (i = n = 0; i < num_jobs; ++i)
+    if (jobs[i].in_use && !jobs[i].done)
+      procs[n++] = &jobs[i].proc;
+
+  ret = n? process_pump(procs, n, timeout) : 0;
+  free(procs);
+  return ret;
+}
+
+/* Reaps the given job, which must not be done, first pumping every running job
+ * until the given one has no more I/O outstanding, so that other jobs do not
+ * stall meanwhile.
+ */
+static void finish_job(job* j) {
+  while (j->proc.input_fd != -1 || j->proc.script_fd != -1 ||
+         j->proc.output_fd != -1)
+    if (-1 == pump_jobs(-1))
+      break;
 
-    /* Switch to new process */
-    execvp(argv[0], argv);
-    /* If we get here, execvp() failed */
-    fprintf(stderr, "tgl: error: execvp: %s\n", strerror(errno));
-    exit(EXIT_PLATFORM_ERROR);
+  j->output = process_finish(&j->proc, &j->status);
+  j->done = 1;
+  free(j->input);
+  j->input = NULL;
+
+  if (j->cache_key) {
+    if (j->output)
+      cmdcache_put(j->cache_key, j->output, j->status);
+    free(j->cache_key);
+    j->cache_key = NULL;
   }
+}
 
-  /* Parent process. Wait for child to die. */
-  if (-1 == waitpid(child, &child_status, 0)) {
-    fprintf(stderr, "tgl: error: waitpid: %s\n", strerror(errno));
-    goto error;
+/* Forgets the jobs inherited by a forked copy of TGL, without disturbing them,
+ * so that the copy neither reads their output nor accepts their handles.
+ */
+void forget_jobs(void) {
+  unsigned i;
+
+  for (i = 0; i < num_jobs; ++i) {
+    if (!jobs[i].in_use) continue;
+
+    if (!jobs[i].done) {
+      process_forget(&jobs[i].proc);
+      free(jobs[i].input);
+      if (jobs[i].cache_key) free(jobs[i].cache_key);
+    } else if (jobs[i].output) {
+      free(jobs[i].output);
+    }
+    jobs[i].in_use = 0;
   }
+}
 
-  /* Did the child exit successfully? */
-  if (!WIFEXITED(child_status)) {
-    fprintf(stderr, "tgl: error: child process %s terminated abnormally\n",
-            argv[0]);
-    goto error;
+/* Starts the given command as a job (with the same semantics as
+ * invoke_external()), returning its handle, or NULL on error.
+ *
+ * If cache_key is non-NULL, the job completes immediately if its result is
+ * cached, and otherwise its result is cached once it completes. Either way,
+ * the job takes ownership of the key.
+ */
+static string start_job(char** argv, string input, string cache_key) {
+  unsigned i;
+
+  /* Give existing jobs a chance to make progress. */
+  pump_jobs(0);
+
+  for (i = 0; i < num_jobs && jobs[i].in_use; ++i);
+  if (i == num_jobs) {
+    jobs = trealloc(jobs, sizeof(job) * ++num_jobs);
+    jobs[i].in_use = 0;
   }
-  if (return_status) {
-    *return_status = WEXITSTATUS(child_status);
-  } else if (WEXITSTATUS(child_status)) {
-    fprintf(stderr, "tgl: error: child process %s exited with code %d\n",
-            argv[0], (int)WEXITSTATUS(child_status));
-    goto error;
+
+  if (cache_key && cmdcache_get(cache_key, &jobs[i].output, &jobs[i].status)) {
+    free(cache_key);
+    jobs[i].in_use = 1;
+    jobs[i].done = 1;
+    jobs[i].input = NULL;
+    jobs[i].cache_key = NULL;
+    return int_to_string(i+1);
   }
 
-  /* OK, get output */
-  output_length = lseek(output_fd, 0, SEEK_END);
-  if (output_length == -1 || -1 == lseek(output_fd, 0, SEEK_SET)) {
-    fprintf(stderr, "tgl: error: lseek: %s\n", strerror(errno));
-    goto error;
+  jobs[i].input = input? dupe_string(input) : NULL;
+  if (!process_start(&jobs[i].proc, argv, jobs[i].input, NULL)) {
+    free(jobs[i].input);
+    if (cache_key) free(cache_key);
+    return NULL;
   }
-  output = tmalloc(sizeof(struct string) + output_length);
-  output->len = output_length;
-  for (output_off = 0; output_off < output->len && output_length >= 1;
-       output_off += output_length)
-    output_length = read(output_fd, string_data(output) + output_off,
-                         output->len - output_off);
 
-  if (output_length == -1) {
-    fprintf(stderr, "tgl: error: read: %s\n", strerror(errno));
-    free(output);
-    goto error;
+  jobs[i].in_use = 1;
+  jobs[i].done = 0;
+  jobs[i].cache_key = cache_key;
+  jobs[i].output = NULL;
+  return int_to_string(i+1);
+}
+
+/* Runs the given command as b and B do: as a job if start_jobs is set, passing
+ * its output through if pass_through is set, and otherwise with the semantics
+ * of invoke_external(). If cache_key is non-NULL, the result is taken from or
+ * stored into the command cache, except when passing output through. The key
+ * is freed.
+ */
+static string run_command(char** argv, string input, int* return_status,
+                          string cache_key) {
+  string output;
+
+  if (start_jobs)
+    return start_job(argv, input, cache_key);
+
+  if (pass_through) {
+    if (cache_key) free(cache_key);
+    return invoke_passthrough(argv, input, return_status);
   }
-  if (output_length == 0 && output_off < output->len) {
-    fprintf(stderr, "tgl: error: EOF in encountered earlier than expected\n");
-    fprintf(stderr, "tgl: This is likely a bug.\n");
-    fprintf(stderr, "tgl: %s:%d\n", __FILE__, __LINE__);
-    free(output);
-    goto error;
+
+  if (get_cached_output(cache_key, argv[0], return_status, &output)) {
+    free(cache_key);
+    return output;
   }
 
-  /* Done */
-  fclose(input_file);
-  fclose(output_file);
+  output = invoke_external(argv, input, return_status);
+  if (cache_key) {
+    if (output)
+      cmdcache_put(cache_key, output, return_status? *return_status : 0);
+    free(cache_key);
+  }
   return output;
-
-  error:
-  if (input_file) fclose(input_file);
-  if (output_file) fclose(output_file);
-  return NULL;
 }
 
 /* @builtin-decl int builtin_shell_script(interpreter*) */
 /* @builtin-bind { 'b', builtin_shell_script }, */
 int builtin_shell_script(interpreter* interp) {
-  string input, sscript, output;
+  string input, sscript, output, cache_key;
   char* script, *argv[4];
   byte status_reg;
   signed status_reg_value, * status_reg_ptr = NULL;
@@ -168,7 +309,7 @@ int builtin_shell_script(interpreter* interp) {
    */
   if (!secondary_arg_as_reg(interp->u[0], &status_reg))
     return 0;
-  if (interp->u[0]) status_reg_ptr = &status_reg_value;
+  if (interp->u[0] && !start_jobs) status_reg_ptr = &status_reg_value;
 
   if (!getenv("SHELL")) {
     print_error("$SHELL undefined");
@@ -184,7 +325,10 @@ int builtin_shell_script(interpreter* interp) {
   argv[1] = "-c";
   argv[2] = script;
   argv[3] = NULL;
-  output = invoke_external(argv, input, status_reg_ptr);
+  if (get_cache_key(interp, interp->u[1], argv, input, &cache_key))
+    output = run_command(argv, input, status_reg_ptr, cache_key);
+  else
+    output = NULL;
   free(script);
 
   /* If unsuccessful, restore the stack and we're done. */
@@ -204,7 +348,10 @@ int builtin_shell_script(interpreter* interp) {
   }
   free(input);
   free(sscript);
-  stack_push(interp, output);
+  if (pass_through)
+    free(output);
+  else
+    stack_push(interp, output);
   reset_secondary_args(interp);
   return 1;
 }
@@ -212,7 +359,7 @@ int builtin_shell_script(interpreter* interp) {
 /* @builtin-decl int builtin_shell_command(interpreter*) */
 /* @builtin-bind { 'B', builtin_shell_command }, */
 int builtin_shell_command(interpreter* interp) {
-  string* sargv=NULL, input=NULL, output, sargc=NULL;
+  string* sargv=NULL, input=NULL, output, sargc=NULL, cache_key;
   char** argv;
   signed argc;
   unsigned i, stack_height;
@@ -225,7 +372,7 @@ int builtin_shell_command(interpreter* interp) {
    */
   if (!secondary_arg_as_reg(interp->u[1], &status_reg))
     return 0;
-  if (interp->u[1]) status_reg_ptr = &status_reg_value;
+  if (interp->u[1] && !start_jobs) status_reg_ptr = &status_reg_value;
 
   if (interp->u[0]) {
     if (!secondary_arg_as_int(interp->u[0], &argc, 0)) return 0;
@@ -280,7 +427,10 @@ int builtin_shell_command(interpreter* interp) {
   argv[argc] = NULL;
 
   /* Run the command, then immediately free memory before checking for error. */
-  output = invoke_external(argv, input, status_reg_ptr);
+  if (get_cache_key(interp, interp->u[2], argv, input, &cache_key))
+    output = run_command(argv, input, status_reg_ptr, cache_key);
+  else
+    output = NULL;
   for (i = 0; i < argc; ++i)
     free(argv[i]);
   free(argv);
@@ -299,7 +449,10 @@ int builtin_shell_command(interpreter* interp) {
   if (sargc)
     free(sargc);
   free(input);
-  stack_push(interp, output);
+  if (pass_through)
+    free(output);
+  else
+    stack_push(interp, output);
   reset_secondary_args(interp);
   return 1;
 
@@ -383,14 +536,15 @@ int builtin_sed(interpreter* interp) {
    */
   --interp->ip;
 
-  /* Set argument vector up */
-  argv[0] = (getenv("TGL_SED")? getenv("TGL_SED") : "sed");
-  argv[1] = "-r";
-  argv[2] = script;
-  argv[3] = 0;
+  /* Simple scripts are run in-process; anything else goes to the real sed */
+  if (!sed_run(script, input, &output)) {
+    argv[0] = (getenv("TGL_SED")? getenv("TGL_SED") : "sed");
+    argv[1] = "-r";
+    argv[2] = script;
+    argv[3] = 0;
 
-  /* Execute and clean up */
-  output = invoke_external(argv, input, NULL);
+    output = invoke_external(argv, input, NULL);
+  }
   free(script);
 
   /* On error, restore stack and return failure */
@@ -412,7 +566,7 @@ int builtin_sed(interpreter* interp) {
 /* @builtin-decl int builtin_perl(interpreter*) */
 /* @builtin-bind { 'J', builtin_perl }, */
 int builtin_perl(interpreter* interp) {
-  string sscript, input, output;
+  string sscript, input, output, cache_key;
   char* script, *argv[4];
 
   if (!stack_pop_strings(interp, 2, &sscript, &input)) UNDERFLOW;
@@ -424,8 +578,19 @@ int builtin_perl(interpreter* interp) {
   argv[2] = script;
   argv[3] = NULL;
 
-  /* Invoke and clean up */
-  output = invoke_external(argv, input, NULL);
+  if (!get_cache_key(interp, interp->u[0], argv, input, &cache_key)) {
+    output = NULL;
+  } else if (!get_cached_output(cache_key, argv[0], NULL, &output)) {
+    /* Invoke */
+    if (!invoke_helper(COPROCESS_PERL, argv[0], sscript, input, &output))
+      output = invoke_external(argv, input, NULL);
+    if (cache_key && output)
+      cmdcache_put(cache_key, output, 0);
+  }
+
+  /* Clean up */
+  if (cache_key)
+    free(cache_key);
   free(script);
 
   if (!output) {
@@ -437,58 +602,227 @@ int builtin_perl(interpreter* interp) {
   stack_push(interp, output);
   free(input);
   free(sscript);
+  reset_secondary_args(interp);
   return 1;
 }
 
-/* @builtin-decl int builtin_tcl(interpreter*) */
-/* @builtin-bind { 't', builtin_tcl }, */
-int builtin_tcl(interpreter* interp) {
-  int tempfile = -1;
+/* Runs the given Tcl script with the given input, with the same semantics as
+ * invoke_external() without return_status.
+ */
+static string run_tcl(char* tclsh, string script, string input) {
+  int tempfile;
   char tempname[] = "tgltclXXXXXX", *argv[3];
-  string script, input, output;
+  string output;
+  process proc;
 
-  if (!stack_pop_strings(interp, 2, &script, &input)) UNDERFLOW;
+  argv[0] = tclsh;
+  argv[2] = NULL;
+
+  if (invoke_helper(COPROCESS_TCL, argv[0], script, input, &output))
+    return output;
 
   /* Tclsh is a bit odd in that it has no option to take its commands from the
    * command line. We would use its stdin, except that that is already used by
-   * the user-supplied input. Therefore, write to a temporary file and invoke
-   * tclsh on it.
+   * the user-supplied input. Therefore, feed it the script through another
+   * pipe and have it read that via /dev/fd where possible, and otherwise write
+   * to a temporary file and invoke tclsh on it.
    */
+  if (!access("/dev/fd", X_OK)) {
+    argv[1] = "/dev/fd/3";
+    if (!process_start(&proc, argv, input, script))
+      return NULL;
+    return process_finish(&proc, NULL);
+  }
+
   tempfile = mkstemp(tempname);
   if (tempfile == -1) {
     fprintf(stderr, "tgl: error: mkstemp: %s\n", strerror(errno));
-    goto error;
+    return NULL;
   }
 
   if (script->len != write(tempfile, string_data(script), script->len)) {
     fprintf(stderr, "tgl: error: writing Tcl script: %s\n", strerror(errno));
-    goto error;
+    close(tempfile);
+    unlink(tempname);
+    return NULL;
   }
 
   close(tempfile);
-  tempfile = -1;
 
   /* Set argument vector up and invoke */
-  argv[0] = (getenv("TGL_TCL")? getenv("TGL_TCL") : "tclsh");
   argv[1] = tempname;
-  argv[2] = NULL;
   output = invoke_external(argv, input, NULL);
 
   if (unlink(tempname))
     fprintf(stderr, "tgl: warning: could not delete Tcl script %s: %s\n",
             tempname, strerror(errno));
 
-  if (!output) goto error;
+  return output;
+}
+
+/* @builtin-decl int builtin_tcl(interpreter*) */
+/* @builtin-bind { 't', builtin_tcl }, */
+int builtin_tcl(interpreter* interp) {
+  string script, input, output, cache_key;
+  char* argv[3];
+
+  if (!stack_pop_strings(interp, 2, &script, &input)) UNDERFLOW;
+
+  /* The cache key treats the script as an argument, however it is actually
+   * passed.
+   */
+  argv[0] = (getenv("TGL_TCL")? getenv("TGL_TCL") : "tclsh");
+  argv[1] = string_to_cstr(script);
+  argv[2] = NULL;
+
+  if (!get_cache_key(interp, interp->u[0], argv, input, &cache_key)) {
+    output = NULL;
+  } else if (!get_cached_output(cache_key, argv[0], NULL, &output)) {
+    output = run_tcl(argv[0], script, input);
+    if (cache_key && output)
+      cmdcache_put(cache_key, output, 0);
+  }
+
+  if (cache_key)
+    free(cache_key);
+  free(argv[1]);
+
+  if (!output) {
+    stack_push(interp, input);
+    stack_push(interp, script);
+    return 0;
+  }
 
   free(script);
   free(input);
   stack_push(interp, output);
+  reset_secondary_args(interp);
   return 1;
+}
 
-  error:
-  stack_push(interp, input);
-  stack_push(interp, script);
-  if (tempfile != -1)
-    close(tempfile);
+/* Starts b as a job. */
+static int job_shell_script(interpreter* interp) {
+  int ret;
+
+  start_jobs = 1;
+  ret = builtin_shell_script(interp);
+  start_jobs = 0;
+  return ret;
+}
+
+/* Starts B as a job. */
+static int job_shell_command(interpreter* interp) {
+  int ret;
+
+  start_jobs = 1;
+  ret = builtin_shell_command(interp);
+  start_jobs = 0;
+  return ret;
+}
+
+/* Runs b, passing its output through. */
+static int passthrough_shell_script(interpreter* interp) {
+  int ret;
+
+  pass_through = 1;
+  ret = builtin_shell_script(interp);
+  pass_through = 0;
+  return ret;
+}
+
+/* Runs B, passing its output through. */
+static int passthrough_shell_command(interpreter* interp) {
+  int ret;
+
+  pass_through = 1;
+  ret = builtin_shell_command(interp);
+  pass_through = 0;
+  return ret;
+}
+
+/* Waits for the job whose handle is on the stack, and pushes its output and
+ * exit status.
+ */
+static int job_join(interpreter* interp) {
+  string handle;
+  signed id;
+  job* j;
+
+  if (!(handle = stack_pop(interp))) UNDERFLOW;
+  if (!string_to_int(handle, &id) || id <= 0 || (unsigned)id > num_jobs ||
+      !jobs[id-1].in_use) {
+    print_error_s("Invalid job", handle);
+    stack_push(interp, handle);
+    return 0;
+  }
+
+  j = &jobs[id-1];
+  if (!j->done)
+    finish_job(j);
+  /* The job is over either way, and its slot free for reuse, so the handle is
+   * consumed even on failure.
+   */
+  j->in_use = 0;
+  free(handle);
+
+  if (!j->output) {
+    print_error("Job failed");
+    return 0;
+  }
+
+  stack_push(interp, j->output);
+  stack_push(interp, int_to_string(j->status));
+  j->output = NULL;
+  return 1;
+}
+
+/* Waits for all running jobs, so that joining them will not block. */
+static int job_wait_all(interpreter* interp) {
+  unsigned i;
+  int ok = 1;
+
+  (void)interp;
+  while (pump_jobs(-1) > 0);
+  for (i = 0; i < num_jobs; ++i) {
+    if (jobs[i].in_use && !jobs[i].done) {
+      finish_job(&jobs[i]);
+      if (!jobs[i].output) ok = 0;
+    }
+  }
+
+  if (!ok)
+    print_error("Job failed");
+  return ok;
+}
+
+static struct {
+  byte name;
+  native_command command;
+} job_subcommands[] = {
+  { 'b', job_shell_script },
+  { 'B', job_shell_command },
+  { 'p', passthrough_shell_script },
+  { 'P', passthrough_shell_command },
+  { 'w', job_join },
+  { 'W', job_wait_all },
+  { 0, 0 },
+};
+
+/* @builtin-decl int builtin_job(interpreter*) */
+/* @builtin-bind { 'k', builtin_job }, */
+int builtin_job(interpreter* interp) {
+  unsigned i;
+
+  ++interp->ip;
+  if (!is_ip_valid(interp)) {
+    print_error("Subcommand expected");
+    return 0;
+  }
+
+  for (i = 0; job_subcommands[i].command; ++i)
+    if (job_subcommands[i].name == curr(interp))
+      return job_subcommands[i].command(interp);
+
+  print_error("Unrecognised subcommand");
   return 0;
 }
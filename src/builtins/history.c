@@ -5,11 +5,13 @@
 #include "../tgl.h"
 #include "../strings.h"
 #include "../interp.h"
+#include "../histlog.h"
 
 /* @builtin-decl int builtin_history(interpreter*) */
 /* @builtin-bind { 'h', builtin_history }, */
 int builtin_history(interpreter* interp) {
   signed off = 0;
+  string entry;
 
   if (interp->u[0])
     if (!secondary_arg_as_int(interp->u[0], &off, 1))
@@ -17,7 +19,7 @@ int builtin_history(interpreter* interp) {
 
   off += interp->history_offset;
 
-  if (off < 0 || off >= 0x20) {
+  if (off < 0 || (unsigned)off >= history_depth) {
     if (interp->u[0])
       print_error_s("Invalid history offset", interp->u[0]);
     else
@@ -25,8 +27,9 @@ int builtin_history(interpreter* interp) {
     return 0;
   }
 
-  /* OK */
-  stack_push(interp, dupe_string(interp->registers[off]));
+  /* OK; entries which have not been written yet are empty. */
+  entry = histlog_get(off);
+  stack_push(interp, entry? entry : empty_string());
   reset_secondary_args(interp);
   ++interp->history_offset;
   return 1;
@@ -45,10 +45,7 @@ int builtin_long_command(interpreter* interp) {
   }
 
   /* Execute, clean up, and return */
-  if (curr->cmd.is_native)
-    result = curr->cmd.cmd.native(interp);
-  else
-    result = exec_code(interp, curr->cmd.cmd.user);
+  result = exec_command(interp, &curr->cmd);
 
   return result;
 }
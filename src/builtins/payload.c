@@ -4,53 +4,135 @@
 
 #include <ctype.h>
 #include <glob.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <regex.h>
 
 #include "../tgl.h"
 #include "../strings.h"
 #include "../interp.h"
+#include "../process.h"
+#include "../scan.h"
+#include "../csv.h"
+#include "../cmdcache.h"
+#include "../coprocess.h"
 #include "payload.h"
 
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
 static void set_payload(interpreter* interp, string data);
 
 void payload_data_init(payload_data* p) {
   p->data = p->data_base = p->global_code = NULL;
+  p->data_map = NULL;
   p->data_start_delim = convert_string(",$");
   p->value_delim = PAYLOAD_WS_DELIM;
   p->output_v_delim = convert_string(", ");
   p->output_kv_delim = convert_string(", ");
   p->output_kvs_delim = convert_string("\n");
+  p->borrowed_delims = 0;
   p->balance_paren = p->balance_brack = p->balance_brace = 1;
   p->trim_paren = p->trim_brack = p->trim_brace = 1;
   p->balance_angle = p->trim_angle = 0;
   p->trim_space = 1;
+  p->index = p->row_fields = p->fields = NULL;
+  p->num_indexed = p->index_cap = 0;
+  p->num_fields = p->fields_cap = 0;
+  p->index_valid = 0;
+  p->kv_table = p->kv_next = NULL;
+  p->kv_table_size = 0;
+  p->kv_valid = 0;
+  p->brackets = p->bracket_stack = NULL;
+  p->num_brackets = p->bracket_first = p->brackets_cap = 0;
+  p->bracket_depth = p->bracket_stack_cap = 0;
+  p->brackets_valid = 0;
+  p->json.values = NULL;
+  p->json.num_values = p->json.cap = 0;
+  p->json_valid = 0;
+}
+
+/* Frees or unmaps the data of the given payload, if any. */
+static void release_data(payload_data* p) {
+  if (!p->data) return;
+
+  if (p->data_map)
+    munmap(p->data_map, p->data_map_size);
+  else
+    free(p->data_base);
+}
+
+/* Releases the whole pages of a mapped payload lying between from and to, so
+ * that data which has been consumed no longer occupies memory. Since the
+ * mapping is private, pages which were written to revert to the file's
+ * contents, so the range must not cover the current string header.
+ *
+ * Returns to rounded down to a page boundary.
+ */
+static byte* release_pages(payload_data* p, byte* from, byte* to) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  byte* region = p->data_map;
+
+  if (!region) return to;
+
+  from = region + (from - region + page - 1) / page * page;
+  to = region + (to - region) / page * page;
+  if (to > from)
+    madvise(from, to - from, MADV_DONTNEED);
+  return to;
+}
+
+/* Frees the given delimiter of the given payload, unless it is special or
+ * borrowed (as indicated by the given PAYLOAD_BORROWED_* bit), in preparation
+ * for replacing it with one the payload owns.
+ */
+static void release_delim(payload_data* p, string delim, unsigned bit) {
+  if (delim > PAYLOAD_TSV_DELIM && !(p->borrowed_delims & bit))
+    free(delim);
+  p->borrowed_delims &= ~bit;
 }
 
 void payload_data_destroy(payload_data* p) {
-  if (p->data) free(p->data_base);
-  if (p->data_start_delim > PAYLOAD_LINE_DELIM)
-    free(p->data_start_delim);
-  if (p->value_delim > PAYLOAD_LINE_DELIM)
-    free(p->value_delim);
-  free(p->output_v_delim);
-  free(p->output_kv_delim);
-  free(p->output_kvs_delim);
+  release_data(p);
+  release_delim(p, p->data_start_delim, PAYLOAD_BORROWED_START);
+  release_delim(p, p->value_delim, PAYLOAD_BORROWED_VALUE);
+  release_delim(p, p->output_v_delim, PAYLOAD_BORROWED_OUTPUT_V);
+  release_delim(p, p->output_kv_delim, PAYLOAD_BORROWED_OUTPUT_KV);
+  release_delim(p, p->output_kvs_delim, PAYLOAD_BORROWED_OUTPUT_KVS);
+  if (p->index) free(p->index);
+  if (p->row_fields) free(p->row_fields);
+  if (p->fields) free(p->fields);
+  if (p->kv_table) free(p->kv_table);
+  if (p->kv_next) free(p->kv_next);
+  if (p->brackets) free(p->brackets);
+  if (p->bracket_stack) free(p->bracket_stack);
+  if (p->json.values) free(p->json.values);
 }
 
 string payload_extract_prefix(string code, interpreter*interp) {
   unsigned prefixEnd, delimLen=0, i, j;
+  byte* bar;
   string new_code;
 
-  for (i = 0; i < code->len; ++i) {
-    if (string_data(code)[i] == '|') {
-      for (j = i+1; j < code->len && string_data(code)[j] == '|'; ++j);
-      /* Advance the prefix if the length exceeds the longest found so far */
-      if (j-i > delimLen) {
-        prefixEnd = i;
-        delimLen = j-i;
-      }
+  for (i = 0; i < code->len; i = j) {
+    if (!(bar = memchr(string_data(code)+i, '|', code->len - i)))
+      break;
 
-      /* Move past the |s */
-      i = j-1;
+    i = bar - string_data(code);
+    for (j = i+1; j < code->len && string_data(code)[j] == '|'; ++j);
+    /* Advance the prefix if the length exceeds the longest found so far */
+    if (j-i > delimLen) {
+      prefixEnd = i;
+      delimLen = j-i;
     }
   }
 
@@ -68,86 +150,251 @@ string payload_extract_prefix(string code, interpreter*interp) {
   return new_code;
 }
 
-/* If the character at *ix is an opening parenthesis character and that type is
- * set to be balanced according to the given payload, advance the index to the
- * matching closing character or to the end of string and return 1. Otherwise,
- * return 0.
+/* Returns the closing character for the given character if it is an opening
+ * bracket of a type the given payload balances, or 0 otherwise.
  */
-static int balance_parens(unsigned* ix, string str, payload_data* payload) {
-  byte curr, closing;
-  if (*ix >= str->len) return 0;
-
-  curr = string_data(str)[*ix];
-  switch (curr) {
-  case '{':
-    if (!payload->balance_brace) return 0;
-    closing = '}';
-    break;
+static byte closing_bracket(byte ch, const payload_data* payload) {
+  switch (ch) {
+  case '{': return payload->balance_brace? '}' : 0;
+  case '(': return payload->balance_paren? ')' : 0;
+  case '[': return payload->balance_brack? ']' : 0;
+  case '<': return payload->balance_angle? '>' : 0;
+  default:  return 0;
+  }
+}
 
-  case '(':
-    if (!payload->balance_paren) return 0;
-    closing = ')';
-    break;
+/* The kinds of scan_set returned by stop_set(). */
+typedef enum stop_kind {
+  /* Whitespace and opening brackets */
+  STOP_SPACE = 0,
+  /* Line endings and opening brackets */
+  STOP_LINE,
+  /* Opening brackets */
+  STOP_OPEN,
+  /* Opening and closing brackets */
+  STOP_BRACKET,
+  /* Whitespace alone */
+  STOP_ONLY_SPACE,
+  NUM_STOP_KINDS
+} stop_kind;
+
+/* Returns the set of bytes of the given kind, for the bracket types balanced
+ * by the given payload. Only brackets which the payload balances count.
+ */
+static const scan_set* stop_set(stop_kind kind, const payload_data* payload) {
+  static scan_set sets[NUM_STOP_KINDS][16];
+  static byte ready[NUM_STOP_KINDS][16];
+  static const byte brackets[] = "([{<";
+  scan_set* set;
+  unsigned flags, i;
+
+  flags = kind == STOP_ONLY_SPACE? 0 :
+    (payload->balance_paren? 1 : 0) | (payload->balance_brack? 2 : 0) |
+    (payload->balance_brace? 4 : 0) | (payload->balance_angle? 8 : 0);
+  set = &sets[kind][flags];
+  if (ready[kind][flags]) return set;
+
+  scan_set_init(set);
+  if (kind == STOP_SPACE || kind == STOP_ONLY_SPACE)
+    scan_set_add_space(set);
+  if (kind == STOP_LINE) {
+    scan_set_add(set, '\n');
+    scan_set_add(set, '\r');
+  }
+  if (kind != STOP_ONLY_SPACE) {
+    for (i = 0; i < 4; ++i) {
+      if (flags & (1 << i)) {
+        scan_set_add(set, brackets[i]);
+        if (kind == STOP_BRACKET)
+          scan_set_add(set, closing_bracket(brackets[i], payload));
+      }
+    }
+  }
 
-  case '[':
-    if (!payload->balance_brack) return 0;
-    closing = ']';
-    break;
+  ready[kind][flags] = 1;
+  return set;
+}
 
-  case '<':
-    if (!payload->balance_angle) return 0;
-    closing = '>';
-    break;
+/* Extends the bracket table of the given payload by scanning up to offset
+ * until from bracket_origin, or to the end of the string.
+ */
+static void scan_brackets(payload_data* p, unsigned until) {
+  unsigned len = p->bracket_end - p->bracket_origin, pos, n, * entry;
+  const scan_set* interesting = stop_set(STOP_BRACKET, p);
+  byte ch, closing;
+
+  if (until > len) until = len;
+  for (pos = p->bracket_scanned; pos < until; ++pos) {
+    pos += scan_for(interesting, p->bracket_origin + pos, until - pos);
+    if (pos == until) break;
+
+    ch = p->bracket_origin[pos];
+    if (p->bracket_depth && ch == p->bracket_stack[2*p->bracket_depth-1]) {
+      /* Closes the innermost open bracket */
+      n = p->bracket_stack[2*--p->bracket_depth];
+      if (n >= p->bracket_first) {
+        entry = p->brackets + 3*(n - p->bracket_first);
+        entry[1] = pos;
+        entry[2] = p->num_brackets;
+      }
+    } else if ((closing = closing_bracket(ch, p))) {
+      if (p->num_brackets - p->bracket_first == p->brackets_cap) {
+        p->brackets_cap = p->brackets_cap? p->brackets_cap*2 : 64;
+        p->brackets = trealloc(p->brackets,
+                               3 * sizeof(unsigned) * p->brackets_cap);
+      }
+      entry = p->brackets + 3*(p->num_brackets - p->bracket_first);
+      entry[0] = pos;
+      entry[1] = entry[2] = ~0u;
+
+      if (p->bracket_depth == p->bracket_stack_cap) {
+        p->bracket_stack_cap = p->bracket_stack_cap?
+          p->bracket_stack_cap*2 : 16;
+        p->bracket_stack = trealloc(p->bracket_stack,
+                                    2 * sizeof(unsigned) *
+                                    p->bracket_stack_cap);
+      }
+      p->bracket_stack[2*p->bracket_depth] = p->num_brackets++;
+      p->bracket_stack[2*p->bracket_depth+1] = closing;
+      ++p->bracket_depth;
+    }
+  }
+  p->bracket_scanned = pos;
+
+  /* Anything still open at the end is never closed. */
+  if (pos == len) {
+    while (p->bracket_depth) {
+      n = p->bracket_stack[2*--p->bracket_depth];
+      if (n >= p->bracket_first) {
+        entry = p->brackets + 3*(n - p->bracket_first);
+        entry[1] = len;
+        entry[2] = p->num_brackets;
+      }
+    }
+  }
+}
 
-  default:
-    /* Not a paren-char */
-    return 0;
+/* Returns the offset within str of the character matching the opening bracket
+ * at offset ix, or str->len if there is none, consulting and extending the
+ * bracket table of the given payload.
+ */
+static unsigned match_bracket(string str, unsigned ix, payload_data* p) {
+  unsigned delta, pos, live, lo, hi, mid, n;
+
+  if (!p->brackets_valid ||
+      string_data(str) + str->len != p->bracket_end ||
+      string_data(str) < p->bracket_origin) {
+    p->bracket_origin = string_data(str);
+    p->bracket_end = string_data(str) + str->len;
+    p->num_brackets = p->bracket_first = p->bracket_hint = 0;
+    p->bracket_depth = p->bracket_scanned = 0;
+    p->brackets_valid = 1;
+  }
+
+  delta = string_data(str) - p->bracket_origin;
+  pos = ix + delta;
+
+  /* Discard the older half of the table once it lies before the string. */
+  live = p->num_brackets - p->bracket_first;
+  if (live >= 1024 && p->brackets[3*(live/2)] < delta) {
+    memmove(p->brackets, p->brackets + 3*(live/2),
+            3 * sizeof(unsigned) * (live - live/2));
+    p->bracket_first += live/2;
+  }
+
+  /* Searches usually proceed from one bracket to the first after it. */
+  n = p->bracket_hint;
+  if (n < p->bracket_first || n >= p->num_brackets ||
+      p->brackets[3*(n - p->bracket_first)] != pos) {
+    if (pos >= p->bracket_scanned) {
+      scan_brackets(p, pos+1);
+      n = p->num_brackets - 1;
+    } else {
+      lo = p->bracket_first;
+      hi = p->num_brackets;
+      while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (p->brackets[3*(mid - p->bracket_first)] < pos) lo = mid+1;
+        else hi = mid;
+      }
+      n = lo;
+    }
+
+    if (n < p->bracket_first || n >= p->num_brackets ||
+        p->brackets[3*(n - p->bracket_first)] != pos) {
+      /* Not a bracket we have seen; start over from here. */
+      p->brackets_valid = 0;
+      return match_bracket(str, ix, p);
+    }
   }
 
-  /* If we get here, we must balance. */
-  for (++*ix; *ix < str->len && string_data(str)[*ix] != closing; ++*ix)
-    balance_parens(ix, str, payload);
+  while (~0u == p->brackets[3*(n - p->bracket_first)+1])
+    scan_brackets(p, p->bracket_scanned + 65536);
+
+  p->bracket_hint = p->brackets[3*(n - p->bracket_first)+2];
+  return p->brackets[3*(n - p->bracket_first)+1] - delta;
+}
+
+/* If the character at *ix is an opening parenthesis character and that type is
+ * set to be balanced according to the given payload, advance the index to the
+ * matching closing character or to the end of string and return 1. Otherwise,
+ * return 0.
+ */
+static int balance_parens(unsigned* ix, string str, payload_data* payload) {
+  if (*ix >= str->len || !closing_bracket(string_data(str)[*ix], payload))
+    return 0;
 
+  *ix = match_bracket(str, *ix, payload);
   return 1;
 }
 
-/* Trims extraneous characters from the given string, returning a possibly new
- * string with the characters removed. The old string is destroyed or returned.
+/* Narrows [*begin,*end) within data to exclude the characters that
+ * payload_trim() would remove.
  */
-static string payload_trim(string orig_str, payload_data* payload) {
-  string s = orig_str;
-  unsigned i;
-  byte start, end;
+static void payload_trim_bounds(const byte* data, unsigned* begin,
+                                unsigned* end, payload_data* payload) {
+  byte start, last;
 
   /* Whitespace */
   if (payload->trim_space) {
     /* Trailing */
-    while (s->len > 0 && isspace(string_data(s)[s->len-1]))
-      --s->len;
+    while (*end > *begin && isspace(data[*end-1]))
+      --*end;
     /* Leading */
-    for (i = 0; i < s->len && isspace(string_data(s)[i]); ++i);
-    s = string_advance(s, i);
+    *begin += scan_past(stop_set(STOP_ONLY_SPACE, payload),
+                        data + *begin, *end - *begin);
   }
 
   /* Parens */
-  if (s->len >= 2) {
-    start = string_data(s)[0];
-    end = string_data(s)[s->len - 1];
-    if (payload->trim_brace && start == '{' && end == '}' ||
-        payload->trim_brack && start == '[' && end == ']' ||
-        payload->trim_paren && start == '(' && end == ')' ||
-        payload->trim_angle && start == '<' && end == '>') {
-      --s->len;
-      s = string_advance(s, 1);
+  if (*end - *begin >= 2) {
+    start = data[*begin];
+    last = data[*end - 1];
+    if (payload->trim_brace && start == '{' && last == '}' ||
+        payload->trim_brack && start == '[' && last == ']' ||
+        payload->trim_paren && start == '(' && last == ')' ||
+        payload->trim_angle && start == '<' && last == '>') {
+      ++*begin;
+      --*end;
     }
   }
+}
+
+/* Trims extraneous characters from the given string, returning a possibly new
+ * string with the characters removed. The old string is destroyed or returned.
+ */
+static string payload_trim(string orig_str, payload_data* payload) {
+  string s;
+  unsigned begin = 0, end = orig_str->len;
 
-  if (s != orig_str) {
-    /* Head not preserved, must return duplicate. */
-    s = dupe_string(s);
-    free(orig_str);
+  payload_trim_bounds(string_data(orig_str), &begin, &end, payload);
+  if (!begin) {
+    /* Head preserved, can just shorten. */
+    orig_str->len = end;
+    return orig_str;
   }
 
+  s = create_string(string_data(orig_str)+begin, string_data(orig_str)+end);
+  free(orig_str);
   return s;
 }
 
@@ -160,12 +407,22 @@ static int find_delimiter_from(string delim, string haystack,
                                unsigned starting_index,
                                unsigned* left, unsigned* right,
                                payload_data* payload) {
-  unsigned i, j;
+  const byte* data = string_data(haystack);
+  const scan_set* stops;
+  scan_needle needle;
+  unsigned i, j, at = 0;
+
   if (delim == PAYLOAD_WS_DELIM) {
-    for (i = starting_index;
-         i < haystack->len && !isspace(string_data(haystack)[i]); ++i)
+    stops = stop_set(STOP_SPACE, payload);
+    for (i = starting_index; i < haystack->len; ++i) {
+      i += scan_for(stops, data+i, haystack->len - i);
+      if (i == haystack->len || isspace(data[i])) break;
       balance_parens(&i, haystack, payload);
-    for (j = i; j < haystack->len &&  isspace(string_data(haystack)[j]); ++j);
+    }
+    j = i;
+    if (j < haystack->len)
+      j += scan_past(stop_set(STOP_ONLY_SPACE, payload),
+                     data+j, haystack->len - j);
     if (i == j)
       /* No delimiter found */
       return 0;
@@ -175,29 +432,51 @@ static int find_delimiter_from(string delim, string haystack,
     *right = j;
     return 1;
   } else if (delim == PAYLOAD_LINE_DELIM) {
-    for (i = starting_index;
-         i < haystack->len && string_data(haystack)[i] != '\n' &&
-           string_data(haystack)[i] != '\r'; ++i)
+    stops = stop_set(STOP_LINE, payload);
+    for (i = starting_index; i < haystack->len; ++i) {
+      i += scan_for(stops, data+i, haystack->len - i);
+      if (i == haystack->len || data[i] == '\n' || data[i] == '\r') break;
       balance_parens(&i, haystack, payload);
-    if (i == haystack->len) return 0;
+    }
+    if (i >= haystack->len) return 0;
+
+    /* OK */
+    *left = i;
+    *right = (i+1 < haystack->len && data[i] == '\r' &&
+              data[i+1] == '\n'? i+2 : i+1);
+    return 1;
+  } else if (delim == PAYLOAD_CSV_DELIM || delim == PAYLOAD_TSV_DELIM) {
+    if (!csv_scan_record(data, haystack->len, starting_index,
+                         PAYLOAD_SEPARATOR(delim), &i, &j, NULL, NULL, NULL))
+      return 0;
 
     /* OK */
     *left = i;
-    *right = (i+1 < haystack->len && string_data(haystack)[i] == '\r' &&
-              string_data(haystack)[i+1] == '\n'? i+2 : i+1);
+    *right = j;
     return 1;
   } else {
-    /* Why can't there be memmem() like strstr()? */
-    for (i = starting_index; i <= haystack->len - delim->len; ++i) {
-      if (balance_parens(&i, haystack, payload)) continue;
-      for (j = 0; j < delim->len &&
-             string_data(haystack)[i+j] == string_data(delim)[j]; ++j);
-      if (j == delim->len) {
+    /* Find the next occurrence of the delimiter; if an opening bracket comes
+     * first, skip to the end of the brackets and try again. The occurrence
+     * stays valid if it lies beyond the brackets.
+     */
+    stops = stop_set(STOP_OPEN, payload);
+    scan_needle_init(&needle, string_data(delim), delim->len);
+    for (i = starting_index; i + delim->len <= haystack->len; ++i) {
+      if (i == starting_index || at < i) {
+        if (!scan_needle_find(&needle, data+i, haystack->len - i, &at))
+          return 0;
+        at += i;
+      }
+
+      i += scan_for(stops, data+i, at < haystack->len? at - i + 1 : at - i);
+      if (i > at || i == haystack->len) {
         /* Matches */
-        *left = i;
-        *right = i+j;
+        *left = at;
+        *right = at + delim->len;
         return 1;
       }
+
+      balance_parens(&i, haystack, payload);
     }
 
     /* Not found */
@@ -292,6 +571,20 @@ static int payload_curr(interpreter* interp) {
   return 1;
 }
 
+/* Drops the first amt bytes of the payload, releasing any whole pages of a
+ * mapped payload which are thereby consumed.
+ */
+static void payload_consume(interpreter* interp, unsigned amt) {
+  DATA = string_advance(DATA, amt);
+
+  /* Everything before the new string header is gone for good. */
+  if (interp->payload.data_map &&
+      (byte*)DATA > interp->payload.data_map_released)
+    interp->payload.data_map_released =
+      release_pages(&interp->payload, interp->payload.data_map_released,
+                    (byte*)DATA);
+}
+
 static int payload_next(interpreter* interp) {
   unsigned begin;
   signed cnt;
@@ -308,7 +601,7 @@ static int payload_next(interpreter* interp) {
   do {
     find_opt_delim(interp->payload.value_delim, DATA, NULL, &begin,
                  &interp->payload);
-    DATA = string_advance(DATA, begin);
+    payload_consume(interp, begin);
     --cnt;
   } while (cnt && DATA->len);
 
@@ -317,28 +610,209 @@ static int payload_next(interpreter* interp) {
   return 1;
 }
 
-extern int builtin_print(interpreter* interp);
-static int payload_print(interpreter* interp) {
-  unsigned cnt;
-  if (!secondary_arg_as_int(interp->u[0], (signed*)&cnt, 0))
+/* Output waiting to be written to standard output with writev(). Spans are
+ * referenced where they lie, except for short ones, which are copied into the
+ * staging buffer so that runs of small items don't each cost an iovec.
+ */
+#define OUTPUT_IOVECS 256
+#define OUTPUT_STAGING 16384
+#define OUTPUT_COPY_MAX 64
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+typedef struct output_batch {
+  struct iovec iov[OUTPUT_IOVECS];
+  unsigned num_iov, staged;
+  byte staging[OUTPUT_STAGING];
+} output_batch;
+
+/* Writes everything queued on the given batch and empties it.
+ *
+ * Returns 1 on success, 0 on error (in which case a diagnostic is printed).
+ */
+static int output_flush(output_batch* out) {
+  struct iovec* iov = out->iov;
+  unsigned num = out->num_iov;
+  ssize_t amt;
+
+  out->num_iov = out->staged = 0;
+  while (num) {
+    amt = writev(STDOUT_FILENO, iov, num < IOV_MAX? num : IOV_MAX);
+    if (amt == -1) {
+      if (errno == EINTR) continue;
+      print_error(strerror(errno));
+      return 0;
+    }
+
+    total_bytes_written += amt;
+    /* Skip whatever was written; the kernel may have stopped part-way. */
+    while (num && (size_t)amt >= iov->iov_len) {
+      amt -= iov->iov_len;
+      ++iov;
+      --num;
+    }
+    if (num) {
+      iov->iov_base = (byte*)iov->iov_base + amt;
+      iov->iov_len -= amt;
+    }
+  }
+
+  return 1;
+}
+
+/* Queues the given span for output on the given batch. The span must remain
+ * valid until the batch is flushed.
+ *
+ * Returns 1 on success, 0 on error (in which case a diagnostic is printed).
+ */
+static int output_queue(output_batch* out, const byte* data, unsigned len) {
+  struct iovec* last = out->num_iov? out->iov + out->num_iov - 1 : NULL;
+
+  if (!len) return 1;
+
+  /* Contiguous with the last span, as when items keep their delimiters. */
+  if (last && (const byte*)last->iov_base + last->iov_len == data &&
+      ((byte*)last->iov_base < out->staging ||
+       (byte*)last->iov_base >= out->staging + OUTPUT_STAGING)) {
+    last->iov_len += len;
+    return 1;
+  }
+
+  if (len <= OUTPUT_COPY_MAX) {
+    /* Joins the last span if that ends with the staged data; otherwise needs
+     * a new one. Either way, any flush must come before the copy, since it
+     * empties the staging buffer.
+     */
+    if (!(last && (byte*)last->iov_base + last->iov_len ==
+          out->staging + out->staged))
+      last = NULL;
+    if (out->staged + len > OUTPUT_STAGING ||
+        (!last && out->num_iov == OUTPUT_IOVECS)) {
+      if (!output_flush(out)) return 0;
+      last = NULL;
+    }
+
+    memcpy(out->staging + out->staged, data, len);
+    out->staged += len;
+    if (last) {
+      last->iov_len += len;
+      return 1;
+    }
+
+    data = out->staging + out->staged - len;
+  } else if (out->num_iov == OUTPUT_IOVECS && !output_flush(out)) {
     return 0;
-  reset_secondary_args(interp);
+  }
+
+  out->iov[out->num_iov].iov_base = (byte*)data;
+  out->iov[out->num_iov].iov_len = len;
+  ++out->num_iov;
+  return 1;
+}
+
+/* How far a mapped payload is consumed between flushes while printing, so
+ * that the pages already written can be released.
+ */
+#define PRINT_RELEASE_CHUNK (16*1024*1024)
+
+/* Queues up to cnt items (all if zero) of the payload starting at offset *pos
+ * within it, separated by the given delimiter, and moves *pos past them, as
+ * payload_curr and payload_next would.
+ *
+ * Returns 1 on success, 0 on error (in which case a diagnostic is printed).
+ */
+static int print_items(interpreter* interp, output_batch* out, unsigned* pos,
+                       unsigned cnt, string sep) {
+  payload_data* p = &interp->payload;
+  const byte* data;
+  unsigned begin, end, next;
+
+  if (*pos == DATA->len) {
+    print_error("No current item");
+    return 0;
+  }
 
   do {
-    if (!payload_curr(interp) ||
-        !builtin_print(interp) ||
-        !payload_next(interp)) return 0;
+    if (*pos >= PRINT_RELEASE_CHUNK && p->data_map) {
+      if (!output_flush(out)) return 0;
+      payload_consume(interp, *pos);
+      *pos = 0;
+    }
+
+    data = string_data(DATA);
+    end = next = DATA->len;
+    find_delimiter_from(p->value_delim, DATA, *pos, &end, &next, p);
+    begin = *pos;
+    *pos = next;
+    payload_trim_bounds(data, &begin, &end, p);
+    if (!output_queue(out, data+begin, end-begin)) return 0;
+
     --cnt;
-    /* If not the last item, add the separator */
-    if (cnt > 0 && DATA->len) {
-      stack_push(interp, dupe_string(interp->payload.output_v_delim));
-      if (!builtin_print(interp)) return 0;
+    /* If not the last item, add the separator; take it from the payload if
+     * that is where it already lies, so that the spans join up.
+     */
+    if (cnt > 0 && next < DATA->len) {
+      if (next - end == sep->len &&
+          !memcmp(data+end, string_data(sep), sep->len)) {
+        if (!output_queue(out, data+end, sep->len)) return 0;
+      } else {
+        if (!output_queue(out, string_data(sep), sep->len)) return 0;
+      }
     }
-  } while (cnt && DATA->len);
+  } while (cnt && *pos < DATA->len);
 
   return 1;
 }
 
+/* Prints items of the payload, writing them straight from the payload; pairs
+ * if kv is non-zero. */
+static int payload_print_items(interpreter* interp, int kv) {
+  output_batch out;
+  payload_data* p = &interp->payload;
+  unsigned cnt, pos = 0;
+  int ok;
+
+  if (!secondary_arg_as_int(interp->u[0], (signed*)&cnt, 0))
+    return 0;
+  reset_secondary_args(interp);
+
+  AUTO;
+
+  /* Anything buffered must come first. */
+  fflush(stdout);
+  out.num_iov = out.staged = 0;
+
+  if (!kv) {
+    ok = print_items(interp, &out, &pos, cnt, p->output_v_delim);
+  } else {
+    do {
+      ok = print_items(interp, &out, &pos, 1, p->output_v_delim) &&
+           output_queue(&out, string_data(p->output_kv_delim),
+                        p->output_kv_delim->len) &&
+           print_items(interp, &out, &pos, 1, p->output_v_delim);
+      if (!ok) break;
+
+      --cnt;
+      /* If this isn't the last, print separator */
+      if (cnt && pos < DATA->len &&
+          !(ok = output_queue(&out, string_data(p->output_kvs_delim),
+                              p->output_kvs_delim->len)))
+        break;
+    } while (cnt && pos < DATA->len);
+  }
+
+  /* Whatever was queued before any error still goes out, and the payload
+   * moves past it.
+   */
+  ok = output_flush(&out) && ok;
+  payload_consume(interp, pos);
+  return ok;
+}
+
+static int payload_print(interpreter* interp) {
+  return payload_print_items(interp, 0);
+}
+
 static int payload_next_kv(interpreter* interp) {
   signed cnt;
   if (!secondary_arg_as_int(interp->u[0], &cnt, 0)) return 0;
@@ -353,28 +827,7 @@ static int payload_next_kv(interpreter* interp) {
 }
 
 static int payload_print_kv(interpreter* interp) {
-  unsigned cnt;
-
-  if (!secondary_arg_as_int(interp->u[0], (signed*)&cnt, 0))
-    return 0;
-  reset_secondary_args(interp);
-
-  do {
-    if (!payload_print(interp)) return 0;
-    stack_push(interp, dupe_string(interp->payload.output_kv_delim));
-    if (!builtin_print(interp)) return 0;
-    if (!payload_print(interp)) return 0;
-
-    --cnt;
-    /* If this isn't the last, print separator */
-    if (cnt && DATA->len) {
-      stack_push(interp, dupe_string(interp->payload.output_kvs_delim));
-      if (!builtin_print(interp))
-        return 0;
-    }
-  } while (cnt && DATA->len);
-
-  return 1;
+  return payload_print_items(interp, 1);
 }
 
 static int payload_read(interpreter* interp) {
@@ -393,28 +846,47 @@ static int payload_write(interpreter* interp) {
   return 1;
 }
 
-static int payload_recurse(interpreter* interp) {
+/* Runs code with new_payload as the payload, restoring the current payload
+ * afterwards, and frees code. If json_root is not -1, new_payload is the text
+ * of that value on the current payload's JSON tape, which is carried over so
+ * that the subordinate payload need not be parsed again.
+ *
+ * Returns the status of code.
+ */
+static int run_subordinate(interpreter* interp, string new_payload,
+                           string code, signed json_root) {
   int status;
-  string new_payload, code;
   payload_data backup;
 
-  if (!(stack_pop_strings(interp, 2, &code, &new_payload)))
-    UNDERFLOW;
-
-  /* Preserve old payload */
+  /* Preserve old payload. The subordinate borrows its delimiters, which stay
+   * owned by the backup.
+   */
   memcpy(&backup, &interp->payload, sizeof(payload_data));
-  /* Dupe strings that can't be shared */
-  if (backup.data_start_delim > PAYLOAD_LINE_DELIM)
-    backup.data_start_delim = dupe_string(backup.data_start_delim);
-  if (backup.value_delim > PAYLOAD_LINE_DELIM)
-    backup.value_delim = dupe_string(backup.value_delim);
-  backup.output_kv_delim = dupe_string(backup.output_kv_delim);
-  backup.output_v_delim = dupe_string(backup.output_v_delim);
-  backup.output_kvs_delim = dupe_string(backup.output_kvs_delim);
-
-  /* Swap subordinate payload in */
+  interp->payload.borrowed_delims = PAYLOAD_BORROWED_ALL;
+
+  /* Swap subordinate payload in; the index stays with the backup. */
   interp->payload.data = interp->payload.data_base = NULL;
+  interp->payload.data_map = NULL;
+  interp->payload.index = NULL;
+  interp->payload.row_fields = interp->payload.fields = NULL;
+  interp->payload.num_indexed = interp->payload.index_cap = 0;
+  interp->payload.num_fields = interp->payload.fields_cap = 0;
+  interp->payload.index_valid = 0;
+  interp->payload.kv_table = interp->payload.kv_next = NULL;
+  interp->payload.kv_table_size = 0;
+  interp->payload.kv_valid = 0;
+  interp->payload.brackets = interp->payload.bracket_stack = NULL;
+  interp->payload.brackets_cap = interp->payload.bracket_stack_cap = 0;
+  interp->payload.brackets_valid = 0;
+  interp->payload.json.values = NULL;
+  interp->payload.json.num_values = interp->payload.json.cap = 0;
+  if (json_root != -1) {
+    json_extract(&interp->payload.json, &backup.json, json_root);
+    interp->payload.json_origin = string_data(new_payload);
+    interp->payload.json_len = new_payload->len;
+  }
   set_payload(interp, new_payload);
+  interp->payload.json_valid = json_root != -1;
   /* Run subordinate code */
   status = exec_code(interp, code);
   /* Restore old payload data */
@@ -426,10 +898,20 @@ static int payload_recurse(interpreter* interp) {
   return status;
 }
 
+static int payload_recurse(interpreter* interp) {
+  string new_payload, code;
+
+  if (!(stack_pop_strings(interp, 2, &code, &new_payload)))
+    UNDERFLOW;
+
+  return run_subordinate(interp, new_payload, code, -1);
+}
+
 static int payload_set_property(interpreter* interp) {
   byte pa, pb;
   string value;
   string* delim;
+  unsigned bit;
 
   ++interp->ip;
   if (!is_ip_valid(interp)) {
@@ -453,58 +935,77 @@ static int payload_set_property(interpreter* interp) {
   switch (S(pa,pb)) {
   case S('p','s'):
     delim = &interp->payload.data_start_delim;
+    bit = PAYLOAD_BORROWED_START;
     goto set_delim;
 
   case S('v','d'):
     delim = &interp->payload.value_delim;
+    bit = PAYLOAD_BORROWED_VALUE;
+    interp->payload.index_valid = 0;
     goto set_delim;
 
   case S('o','k'):
     delim = &interp->payload.output_kv_delim;
+    bit = PAYLOAD_BORROWED_OUTPUT_KV;
     goto set_delim;
 
   case S('o','v'):
     delim = &interp->payload.output_v_delim;
+    bit = PAYLOAD_BORROWED_OUTPUT_V;
     goto set_delim;
 
   case S('o','s'):
     delim = &interp->payload.output_kvs_delim;
+    bit = PAYLOAD_BORROWED_OUTPUT_KVS;
     goto set_delim;
 
   case S('b','('):
     interp->payload.balance_paren = string_to_bool_free(value);
+    interp->payload.index_valid = 0;
+    interp->payload.brackets_valid = 0;
     break;
 
   case S('b','['):
     interp->payload.balance_brack = string_to_bool_free(value);
+    interp->payload.index_valid = 0;
+    interp->payload.brackets_valid = 0;
     break;
 
   case S('b','{'):
     interp->payload.balance_brace = string_to_bool_free(value);
+    interp->payload.index_valid = 0;
+    interp->payload.brackets_valid = 0;
     break;
 
   case S('b','<'):
     interp->payload.balance_angle = string_to_bool_free(value);
+    interp->payload.index_valid = 0;
+    interp->payload.brackets_valid = 0;
     break;
 
   case S('t','('):
     interp->payload.trim_paren = string_to_bool_free(value);
+    interp->payload.kv_valid = 0;
     break;
 
   case S('t','['):
     interp->payload.trim_brack = string_to_bool_free(value);
+    interp->payload.kv_valid = 0;
     break;
 
   case S('t','{'):
     interp->payload.trim_brace = string_to_bool_free(value);
+    interp->payload.kv_valid = 0;
     break;
 
   case S('t','<'):
     interp->payload.trim_angle = string_to_bool_free(value);
+    interp->payload.kv_valid = 0;
     break;
 
   case S('t','s'):
     interp->payload.trim_space = string_to_bool_free(value);
+    interp->payload.kv_valid = 0;
     break;
 
   default:
@@ -517,8 +1018,7 @@ static int payload_set_property(interpreter* interp) {
   return 1;
 
   set_delim:
-  if (*delim > PAYLOAD_LINE_DELIM)
-    free(*delim);
+  release_delim(&interp->payload, *delim, bit);
 
   if (value->len == 2 &&
       !memcmp("ws", string_data(value), 2)) {
@@ -528,6 +1028,14 @@ static int payload_set_property(interpreter* interp) {
              !memcmp("lf", string_data(value), 2)) {
     free(value);
     value = PAYLOAD_LINE_DELIM;
+  } else if (value->len == 3 &&
+             !memcmp("csv", string_data(value), 3)) {
+    free(value);
+    value = PAYLOAD_CSV_DELIM;
+  } else if (value->len == 3 &&
+             !memcmp("tsv", string_data(value), 3)) {
+    free(value);
+    value = PAYLOAD_TSV_DELIM;
   }
 
   *delim = value;
@@ -621,6 +1129,10 @@ static int payload_get_property(interpreter* interp) {
     delim = convert_string("ws");
   else if (delim == PAYLOAD_LINE_DELIM)
     delim = convert_string("lf");
+  else if (delim == PAYLOAD_CSV_DELIM)
+    delim = convert_string("csv");
+  else if (delim == PAYLOAD_TSV_DELIM)
+    delim = convert_string("tsv");
   else
     delim = dupe_string(delim);
   stack_push(interp, delim);
@@ -638,29 +1150,94 @@ static int payload_length_bytes(interpreter* interp) {
   return 1;
 }
 
-static int payload_num_indices(interpreter* interp) {
-  unsigned off, ignore, cnt;
-  AUTO;
+/* Returns the item index of the current payload (see payload_data), building
+ * it first if it is not valid for DATA. *first is set to the entry number of
+ * the first item of DATA, and *count to the number of items in DATA.
+ */
+static unsigned* payload_index(interpreter* interp,
+                               unsigned* first, unsigned* count) {
+  payload_data* p = &interp->payload;
+  unsigned off, end, next, lo, hi, mid;
+  int csv;
+
+  *first = *count = 0;
+  if (!DATA->len) return p->index;
+
+  /* Usable if DATA is the tail of the indexed data beginning at an item. */
+  if (p->index_valid && string_data(DATA) + DATA->len == p->index_end &&
+      string_data(DATA) >= p->index_origin) {
+    off = string_data(DATA) - p->index_origin;
+    lo = 0;
+    hi = p->num_indexed;
+    while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (p->index[2*mid] < off) lo = mid+1;
+      else hi = mid;
+    }
+    if (lo < p->num_indexed && p->index[2*lo] == off) {
+      *first = lo;
+      *count = p->num_indexed - lo;
+      return p->index;
+    }
+  }
 
+  /* (Re)build the index */
+  p->kv_valid = 0;
+  p->index_origin = string_data(DATA);
+  p->index_end = string_data(DATA) + DATA->len;
+  p->num_indexed = p->num_fields = 0;
+  csv = p->value_delim == PAYLOAD_CSV_DELIM ||
+        p->value_delim == PAYLOAD_TSV_DELIM;
   off = 0;
-  cnt = 0;
-  while (find_delimiter_from(interp->payload.value_delim,
-                             DATA, off,
-                             &ignore, &off, &interp->payload))
-    ++cnt;
+  while (off < DATA->len) {
+    if (p->num_indexed == p->index_cap) {
+      p->index_cap = p->index_cap? p->index_cap*2 : 64;
+      p->index = trealloc(p->index, 2 * sizeof(unsigned) * p->index_cap);
+      p->row_fields = trealloc(p->row_fields,
+                               sizeof(unsigned) * (p->index_cap+1));
+    }
 
-  /* If off is not at EOS, there is one more datum following. */
-  if (off < DATA->len) ++cnt;
+    /* Set end and next to EOS in case there is no delimiter. */
+    end = next = DATA->len;
+    if (csv) {
+      /* Records are split into fields in the same pass. */
+      p->row_fields[p->num_indexed] = p->num_fields;
+      csv_scan_record(string_data(DATA), DATA->len, off,
+                      PAYLOAD_SEPARATOR(p->value_delim), &end, &next,
+                      &p->fields, &p->num_fields, &p->fields_cap);
+    } else {
+      find_delimiter_from(p->value_delim, DATA, off, &end, &next, p);
+    }
 
-  /* Done */
+    p->index[2*p->num_indexed] = off;
+    p->index[2*p->num_indexed+1] = end;
+    ++p->num_indexed;
+    /* An empty delimiter matches without moving on; nothing past it can be
+     * reached, so it ends the index.
+     */
+    off = next > off? next : DATA->len;
+  }
+  if (csv && p->row_fields)
+    p->row_fields[p->num_indexed] = p->num_fields;
+  p->index_valid = 1;
+
+  *count = p->num_indexed;
+  return p->index;
+}
+
+static int payload_num_indices(interpreter* interp) {
+  unsigned first, cnt;
+  AUTO;
+
+  payload_index(interp, &first, &cnt);
   stack_push(interp, int_to_string(cnt));
   return 1;
 }
 
 static int payload_datum_at_index(interpreter* interp) {
-  string six, scnt;
-  signed ix, cnt;
-  unsigned off, next, ignore;
+  string six;
+  signed ix;
+  unsigned first, cnt, * index;
 
   AUTO;
 
@@ -671,107 +1248,145 @@ static int payload_datum_at_index(interpreter* interp) {
     return 0;
   }
 
-  /* If the index is negative, count how many items are left and add the count
-   * to the index.
-   */
-  if (ix < 0) {
-    payload_num_indices(interp);
-    scnt = stack_pop(interp);
-    string_to_int(scnt, &cnt);
-    free(scnt);
-    ix += cnt;
-  }
+  index = payload_index(interp, &first, &cnt);
 
-  /* Bounds check.
-   * The upper bound can't be determined till we fall off the end.
-   */
-  if (ix < 0) {
-    print_error_s("Index out of range", six);
-    stack_push(interp, six);
-    return 0;
-  }
+  /* If the index is negative, count from the end. */
+  if (ix < 0)
+    ix += cnt;
 
-  off = 0;
-  while (off < DATA->len && ix > 0 &&
-         find_delimiter_from(interp->payload.value_delim,
-                             DATA, off,
-                             &ignore, &off, &interp->payload))
-    --ix;
-
-  /* If ix > 0 or off == DATA->len, there is no item at this index.
-   * Otherwise, the datum begins at off and ends at the next delimiter or EOS.
-   */
-  if (ix > 0 || off >= DATA->len) {
+  if (ix < 0 || (unsigned)ix >= cnt) {
     print_error_s("Index out of range", six);
     stack_push(interp, six);
     return 0;
   }
 
-  /* Set to EOS in case there is no next delimiter. */
-  next = DATA->len;
-  /* If there is a next delimiter, move next there; otherwise, leave it at
-   * EOS. */
-  find_delimiter_from(interp->payload.value_delim, DATA, off,
-                      &next, &ignore, &interp->payload);
-
   /* Extract datum and return success. */
+  ix += first;
   stack_push(interp,
-             payload_trim(create_string(string_data(DATA)+off,
-                                        string_data(DATA)+next),
+             payload_trim(create_string(interp->payload.index_origin +
+                                          index[2*ix],
+                                        interp->payload.index_origin +
+                                          index[2*ix+1]),
                           &interp->payload));
   free(six);
   return 1;
 }
 
+/* FNV-1a hash of the given bytes. */
+static unsigned hash_key(const byte* data, unsigned len) {
+  unsigned hash = 2166136261u, i;
+
+  for (i = 0; i < len; ++i) {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/* Returns whether the trimmed key of index entry item equals the given
+ * bytes.
+ */
+static int key_equals(payload_data* p, unsigned item,
+                      const byte* key, unsigned len) {
+  unsigned begin = p->index[2*item], end = p->index[2*item+1];
+
+  payload_trim_bounds(p->index_origin, &begin, &end, p);
+  return end - begin == len && !memcmp(p->index_origin + begin, key, len);
+}
+
+/* Builds the key table (see payload_data) for the pairs beginning at index
+ * entry base.
+ */
+static void build_key_table(payload_data* p, unsigned base) {
+  unsigned item, begin, end, slot, * last = NULL;
+
+  p->kv_table_size = 32;
+  while (p->kv_table_size < p->num_indexed - base)
+    p->kv_table_size *= 2;
+  p->kv_table = trealloc(p->kv_table, sizeof(unsigned) * p->kv_table_size);
+  memset(p->kv_table, 0, sizeof(unsigned) * p->kv_table_size);
+  p->kv_next = trealloc(p->kv_next, sizeof(unsigned) * (p->num_indexed+1));
+  /* Most recent item seen with the key in each slot, for chaining. */
+  last = tmalloc(sizeof(unsigned) * p->kv_table_size);
+
+  /* A key only counts if a delimiter follows it. */
+  for (item = base; item < p->num_indexed &&
+         p->index_origin + p->index[2*item+1] < p->index_end; item += 2) {
+    p->kv_next[item] = p->num_indexed;
+    begin = p->index[2*item];
+    end = p->index[2*item+1];
+    payload_trim_bounds(p->index_origin, &begin, &end, p);
+
+    slot = hash_key(p->index_origin + begin, end - begin) &
+           (p->kv_table_size-1);
+    while (p->kv_table[slot] &&
+           !key_equals(p, p->kv_table[slot]-1,
+                       p->index_origin + begin, end - begin))
+      slot = (slot+1) & (p->kv_table_size-1);
+
+    if (p->kv_table[slot])
+      p->kv_next[last[slot]] = item;
+    else
+      p->kv_table[slot] = item+1;
+    last[slot] = item;
+  }
+
+  free(last);
+  p->kv_base = base;
+  p->kv_valid = 1;
+}
+
 static int payload_datum_at_key(interpreter* interp) {
-  string s, key;
-  unsigned off, end, next;
+  string s;
+  unsigned first, cnt, slot, item, begin, end;
+  payload_data* p = &interp->payload;
 
   AUTO;
 
   if (!(s = stack_pop(interp))) UNDERFLOW;
 
-  off = 0;
-  /* We don't need to handle the case of the last item here (that is, an item
-   * with no delim before EOS) since that would be an isolated key anyway.
-   */
-  while (off < DATA->len &&
-         find_delimiter_from(interp->payload.value_delim,
-                             DATA, off,
-                             &end, &next, &interp->payload)) {
-    key = payload_trim(create_string(string_data(DATA)+off,
-                                     string_data(DATA)+end),
-                       &interp->payload);
-    off = next;
-    if (!find_delimiter_from(interp->payload.value_delim,
-                             DATA, off,
-                             &end, &next, &interp->payload))
-      end = next = DATA->len;
+  payload_index(interp, &first, &cnt);
+  if (cnt) {
+    /* Pairing depends on where the current item is relative to the table. */
+    if (!p->kv_valid || first < p->kv_base || (first - p->kv_base) % 2)
+      build_key_table(p, first);
+
+    slot = hash_key(string_data(s), s->len) & (p->kv_table_size-1);
+    while (p->kv_table[slot] &&
+           !key_equals(p, p->kv_table[slot]-1, string_data(s), s->len))
+      slot = (slot+1) & (p->kv_table_size-1);
+
+    /* First match at or after the current item wins. */
+    for (item = p->kv_table[slot]? p->kv_table[slot]-1 : p->num_indexed;
+         item < first; item = p->kv_next[item]);
+
+    if (item < p->num_indexed) {
+      /* The value is the following item, or empty if there is none. */
+      if (item+1 < p->num_indexed) {
+        begin = p->index[2*item+2];
+        end = p->index[2*item+3];
+      } else {
+        begin = end = p->index_end - p->index_origin;
+      }
 
-    if (string_equals(s, key)) {
-      /* Found */
       free(s);
-      free(key);
       stack_push(interp,
-                 payload_trim(create_string(string_data(DATA)+off,
-                                            string_data(DATA)+end),
-                              &interp->payload));
+                 payload_trim(create_string(p->index_origin + begin,
+                                            p->index_origin + end),
+                              p));
       return 1;
     }
-
-    off = next;
-    free(key);
   }
 
-  /* The loop only ends if the key is not found. */
   print_error_s("Key not found", s);
   stack_push(interp, s);
   return 0;
 }
 
 static int payload_space_delimited(interpreter* interp) {
-  if (interp->payload.value_delim > PAYLOAD_LINE_DELIM)
-    free(interp->payload.value_delim);
+  release_delim(&interp->payload, interp->payload.value_delim,
+                PAYLOAD_BORROWED_VALUE);
 
   interp->payload.value_delim = PAYLOAD_WS_DELIM;
   interp->payload.balance_paren =
@@ -782,12 +1397,13 @@ static int payload_space_delimited(interpreter* interp) {
     interp->payload.trim_brace =
     interp->payload.trim_space = 1;
   interp->payload.balance_angle = interp->payload.trim_angle = 0;
+  interp->payload.index_valid = interp->payload.brackets_valid = 0;
   return 1;
 }
 
 static int payload_line_delimited(interpreter* interp) {
-  if (interp->payload.value_delim > PAYLOAD_LINE_DELIM)
-    free(interp->payload.value_delim);
+  release_delim(&interp->payload, interp->payload.value_delim,
+                PAYLOAD_BORROWED_VALUE);
 
   interp->payload.value_delim = PAYLOAD_LINE_DELIM;
   interp->payload.balance_paren =
@@ -798,14 +1414,15 @@ static int payload_line_delimited(interpreter* interp) {
     interp->payload.trim_brace = 0;
   interp->payload.trim_space = 1;
   interp->payload.balance_angle = interp->payload.trim_angle = 0;
+  interp->payload.index_valid = interp->payload.brackets_valid = 0;
   return 1;
 }
 
 static int payload_nul_delimited(interpreter* interp) {
   byte nul = 0;
 
-  if (interp->payload.value_delim > PAYLOAD_LINE_DELIM)
-    free(interp->payload.value_delim);
+  release_delim(&interp->payload, interp->payload.value_delim,
+                PAYLOAD_BORROWED_VALUE);
 
   interp->payload.value_delim = create_string(&nul, (&nul)+1);
   interp->payload.balance_paren =
@@ -817,105 +1434,1511 @@ static int payload_nul_delimited(interpreter* interp) {
     interp->payload.trim_space =
     interp->payload.balance_angle =
     interp->payload.trim_angle = 0;
+  interp->payload.index_valid = interp->payload.brackets_valid = 0;
   return 1;
 }
 
-static int payload_each(interpreter* interp) {
-  string body;
-  int status;
-  unsigned off, end, next;
-  byte reg = 'p';
-
-  AUTO;
-
-  if (!secondary_arg_as_reg(interp->u[0], &reg))
-    return 0;
+/* Sets the payload to be separated by the given special delimiter, for ,v and
+ * ,V.
+ */
+static int payload_separated(interpreter* interp, string delim) {
+  release_delim(&interp->payload, interp->payload.value_delim,
+                PAYLOAD_BORROWED_VALUE);
 
+  interp->payload.value_delim = delim;
+  interp->payload.balance_paren =
+    interp->payload.balance_brack =
+    interp->payload.balance_brace =
+    interp->payload.balance_angle =
+    interp->payload.trim_paren =
+    interp->payload.trim_brack =
+    interp->payload.trim_brace =
+    interp->payload.trim_angle =
+    interp->payload.trim_space = 0;
+  interp->payload.index_valid = interp->payload.brackets_valid = 0;
+  return 1;
+}
+
+static int payload_csv_delimited(interpreter* interp) {
+  return payload_separated(interp, PAYLOAD_CSV_DELIM);
+}
+
+static int payload_tsv_delimited(interpreter* interp) {
+  return payload_separated(interp, PAYLOAD_TSV_DELIM);
+}
+
+/* Checks that the payload is comma- or tab-separated, for the commands which
+ * access fields.
+ *
+ * Returns 1 if so; otherwise prints a diagnostic and returns 0.
+ */
+static int require_fields(interpreter* interp) {
+  if (interp->payload.value_delim == PAYLOAD_CSV_DELIM ||
+      interp->payload.value_delim == PAYLOAD_TSV_DELIM)
+    return 1;
+
+  print_error("Payload is not comma- or tab-separated");
+  return 0;
+}
+
+/* Returns the value of the given field number of the index of the payload. */
+static string field_value(payload_data* p, unsigned field) {
+  return csv_field_value(p->index_origin + p->fields[2*field],
+                         p->index_origin + p->fields[2*field+1]);
+}
+
+static int payload_field(interpreter* interp) {
+  signed row, col;
+  unsigned first, cnt, field, num_fields;
+
+  AUTO;
+  if (!require_fields(interp)) return 0;
+
+  if (!stack_pop_ints(interp, 2, &col, &row)) return 0;
+
+  payload_index(interp, &first, &cnt);
+  /* If the record is negative, count from the end. */
+  if (row < 0)
+    row += cnt;
+  if (row < 0 || (unsigned)row >= cnt) {
+    print_error("Record out of range");
+    goto error;
+  }
+
+  field = interp->payload.row_fields[first+row];
+  num_fields = interp->payload.row_fields[first+row+1] - field;
+  /* Likewise for the field */
+  if (col < 0)
+    col += num_fields;
+  if (col < 0 || (unsigned)col >= num_fields) {
+    print_error("Field out of range");
+    goto error;
+  }
+
+  stack_push(interp, field_value(&interp->payload, field+col));
+  return 1;
+
+  error:
+  stack_push(interp, int_to_string(row));
+  stack_push(interp, int_to_string(col));
+  return 0;
+}
+
+static int payload_column(interpreter* interp) {
+  string name, value;
+  unsigned first, cnt, field, end;
+
+  AUTO;
+  if (!require_fields(interp)) return 0;
+
+  if (!(name = stack_pop(interp))) UNDERFLOW;
+
+  payload_index(interp, &first, &cnt);
+  if (cnt) {
+    end = interp->payload.row_fields[first+1];
+    for (field = interp->payload.row_fields[first]; field < end; ++field) {
+      value = field_value(&interp->payload, field);
+      if (value->len == name->len &&
+          !memcmp(string_data(value), string_data(name), name->len)) {
+        free(value);
+        free(name);
+        stack_push(interp,
+                   int_to_string(field - interp->payload.row_fields[first]));
+        return 1;
+      }
+      free(value);
+    }
+  }
+
+  print_error_s("No such column", name);
+  stack_push(interp, name);
+  return 0;
+}
+
+static int payload_each_record(interpreter* interp) {
+  string body, regs;
+  int status = 1;
+  unsigned first, cnt, row, field, num_fields, i;
+  byte reg;
+
+  AUTO;
+  if (!require_fields(interp)) return 0;
+
+  regs = interp->u[0]?
+    dupe_string(interp->u[0]) : convert_string("0123456789");
+  reset_secondary_args(interp);
+
+  if (!(body = stack_pop(interp))) {
+    free(regs);
+    UNDERFLOW;
+  }
+
+  for (row = 0; status; ++row) {
+    /* The body may have used the index itself, so look the record up afresh
+     * each time.
+     */
+    if (!require_fields(interp)) {
+      status = 0;
+      break;
+    }
+    payload_index(interp, &first, &cnt);
+    if (row >= cnt) break;
+
+    /* Only the fields with registers are extracted. */
+    field = interp->payload.row_fields[first+row];
+    num_fields = interp->payload.row_fields[first+row+1] - field;
+    for (i = 0; i < regs->len; ++i) {
+      reg = string_data(regs)[i];
+      if (reg == ' ') continue;
+
+      free(interp->registers[reg]);
+      interp->registers[reg] = i < num_fields?
+        field_value(&interp->payload, field+i) : empty_string();
+      touch_reg(interp, reg);
+    }
+
+    status = exec_code(interp, body);
+  }
+
+  free(body);
+  free(regs);
+  return status;
+}
+
+/* Finds the value of the given item number of the index of the payload, for
+ * ,a and ,A: the trimmed item, or in CSV and TSV payloads field number field
+ * of the record (empty if it has no such field). Stores its bounds in *begin
+ * and *len.
+ *
+ * Returns NULL if the value lies within the payload data; otherwise (if it had
+ * to be unquoted) returns a new string holding it, to which *begin points.
+ */
+static string aggregate_value(payload_data* p, unsigned item, signed field,
+                              const byte** begin, unsigned* len) {
+  unsigned b, e, num_fields;
+  string unquoted;
+
+  if (p->value_delim == PAYLOAD_CSV_DELIM ||
+      p->value_delim == PAYLOAD_TSV_DELIM) {
+    num_fields = p->row_fields[item+1] - p->row_fields[item];
+    if (field < 0) field += num_fields;
+    if (field < 0 || (unsigned)field >= num_fields) {
+      *begin = p->index_origin;
+      *len = 0;
+      return NULL;
+    }
+
+    b = p->fields[2*(p->row_fields[item]+field)];
+    e = p->fields[2*(p->row_fields[item]+field)+1];
+    if (e > b && p->index_origin[b] == '"') {
+      unquoted = csv_field_value(p->index_origin+b, p->index_origin+e);
+      *begin = string_data(unquoted);
+      *len = unquoted->len;
+      return unquoted;
+    }
+  } else {
+    b = p->index[2*item];
+    e = p->index[2*item+1];
+    payload_trim_bounds(p->index_origin, &b, &e, p);
+  }
+
+  *begin = p->index_origin + b;
+  *len = e - b;
+  return NULL;
+}
+
+/* Implements ,a (step 1, start 0) and ,A (step 2, start 1). */
+static int payload_aggregate(interpreter* interp, unsigned start,
+                             unsigned step) {
+  byte op;
+  signed field = 0, value, extreme = 0;
+  unsigned long long sum = 0;
+  unsigned first, cnt, item, n = 0, matching = 0;
+  const byte* begin;
+  unsigned len;
+  string match = NULL, unquoted, result;
+  /* For histograms, the distinct values in order of appearance and their
+   * counts, and a hash table from value to index in values plus one.
+   */
+  string* values = NULL;
+  unsigned* counts = NULL, * table = NULL;
+  unsigned num_values = 0, values_cap = 0, table_size = 0, slot, i;
+
+  ++interp->ip;
+  if (!is_ip_valid(interp)) {
+    print_error("Missing operation following aggregate command");
+    return 0;
+  }
+  op = curr(interp);
+  if (!op || !strchr("+<>/=h", op)) {
+    print_error("Unknown aggregate operation");
+    return 0;
+  }
+
+  if (interp->u[0] && !secondary_arg_as_int(interp->u[0], &field, 1))
+    return 0;
+  reset_secondary_args(interp);
+
+  AUTO;
+
+  if (op == '=' && !(match = stack_pop(interp))) UNDERFLOW;
+
+  payload_index(interp, &first, &cnt);
+  for (item = first+start; item < first+cnt; item += step) {
+    unquoted = aggregate_value(&interp->payload, item, field, &begin, &len);
+
+    switch (op) {
+    case '=':
+      if (len == match->len && !memcmp(begin, string_data(match), len))
+        ++matching;
+      break;
+
+    case 'h':
+      if (2 * num_values >= table_size) {
+        /* Grow the table and rehash */
+        table_size = table_size? table_size*2 : 64;
+        free(table);
+        table = tmalloc(table_size * sizeof(unsigned));
+        memset(table, 0, table_size * sizeof(unsigned));
+        for (i = 0; i < num_values; ++i) {
+          slot = hash_key(string_data(values[i]), values[i]->len);
+          while (table[slot & (table_size-1)]) ++slot;
+          table[slot & (table_size-1)] = i+1;
+        }
+      }
+
+      for (slot = hash_key(begin, len); table[slot & (table_size-1)]; ++slot) {
+        i = table[slot & (table_size-1)] - 1;
+        if (values[i]->len == len &&
+            !memcmp(string_data(values[i]), begin, len))
+          break;
+      }
+
+      if (table[slot & (table_size-1)]) {
+        ++counts[i];
+      } else {
+        if (num_values == values_cap) {
+          values_cap = values_cap? values_cap*2 : 32;
+          values = trealloc(values, values_cap * sizeof(string));
+          counts = trealloc(counts, values_cap * sizeof(unsigned));
+        }
+        values[num_values] = create_string((void*)begin, (void*)(begin+len));
+        counts[num_values] = 1;
+        table[slot & (table_size-1)] = ++num_values;
+      }
+      break;
+
+    default:
+      if (!data_to_int(begin, len, &value)) {
+        result = create_string((void*)begin, (void*)(begin+len));
+        print_error_s("Bad integer", result);
+        free(result);
+        if (unquoted) free(unquoted);
+        return 0;
+      }
+
+      if (!n ||
+          (op == '<' && value < extreme) ||
+          (op == '>' && value > extreme))
+        extreme = value;
+      sum += (unsigned long long)(long long)value;
+      ++n;
+      break;
+    }
+
+    if (unquoted) free(unquoted);
+  }
+
+  switch (op) {
+  case '=':
+    free(match);
+    result = int_to_string(matching);
+    break;
+
+  case 'h':
+    /* Format the counts first, so that the result is allocated once. */
+    len = 0;
+    for (i = 0; i < num_values; ++i) {
+      values[i] = append_string(values[i], interp->payload.output_kv_delim);
+      unquoted = int_to_string(counts[i]);
+      values[i] = append_string(values[i], unquoted);
+      free(unquoted);
+      len += values[i]->len +
+        (i? interp->payload.output_kvs_delim->len : 0);
+    }
+
+    result = tmalloc(sizeof(struct string) + len);
+    result->len = 0;
+    for (i = 0; i < num_values; ++i) {
+      if (i) {
+        memcpy(string_data(result) + result->len,
+               string_data(interp->payload.output_kvs_delim),
+               interp->payload.output_kvs_delim->len);
+        result->len += interp->payload.output_kvs_delim->len;
+      }
+      memcpy(string_data(result) + result->len,
+             string_data(values[i]), values[i]->len);
+      result->len += values[i]->len;
+      free(values[i]);
+    }
+    if (values) free(values);
+    if (counts) free(counts);
+    if (table) free(table);
+    break;
+
+  case '+':
+    result = int_to_string((signed)(unsigned)sum);
+    break;
+
+  default:
+    if (!n) {
+      print_error("No items to aggregate");
+      return 0;
+    }
+    result = int_to_string(op == '/'? (signed)((long long)sum / n) : extreme);
+    break;
+  }
+
+  stack_push(interp, result);
+  return 1;
+}
+
+static int payload_aggregate_items(interpreter* interp) {
+  return payload_aggregate(interp, 0, 1);
+}
+
+static int payload_aggregate_values(interpreter* interp) {
+  return payload_aggregate(interp, 1, 2);
+}
+
+/* Returns whether the JSON tape of the given payload describes its data. */
+static int json_current(const payload_data* p) {
+  return p->json_valid && p->json_origin == string_data(p->data) &&
+    p->json_len == p->data->len;
+}
+
+/* Finds the value at the given path in the payload parsed as JSON, parsing it
+ * first if needed, and stores its position on the tape in *value.
+ *
+ * Returns 1 if found; otherwise prints a diagnostic and returns 0.
+ */
+static int json_lookup(interpreter* interp, string path, unsigned* value) {
+  payload_data* p = &interp->payload;
+  const char* error;
+  unsigned error_at;
+
+  if (!json_current(p)) {
+    p->json_valid = 0;
+    if (!json_parse(&p->json, string_data(DATA), DATA->len,
+                    &error, &error_at)) {
+      fprintf(stderr, "tgl: error: Invalid JSON at offset %u: %s\n",
+              error_at, error);
+      return 0;
+    }
+    p->json_origin = string_data(DATA);
+    p->json_len = DATA->len;
+    p->json_valid = 1;
+  }
+
+  if (!json_resolve(&p->json, string_data(DATA), 0,
+                    string_data(path), path->len, value, &error)) {
+    print_error_s((char*)error, path);
+    return 0;
+  }
+
+  return 1;
+}
+
+static int payload_json_path(interpreter* interp) {
+  string path;
+  unsigned value;
+
+  AUTO;
+
+  if (!(path = stack_pop(interp))) UNDERFLOW;
+
+  if (!json_lookup(interp, path, &value)) {
+    stack_push(interp, path);
+    return 0;
+  }
+
+  stack_push(interp, json_value_string(string_data(DATA),
+                                       interp->payload.json.values + value));
+  free(path);
+  return 1;
+}
+
+static int payload_json_each(interpreter* interp) {
+  string body, path;
+  int status = 1;
+  unsigned container = 0, child, n, i;
+  const json_value* values;
+  byte kreg = 'k', vreg = 'v';
+
+  AUTO;
+
+  if (!secondary_arg_as_reg(interp->u[0], &kreg))
+    return 0;
+  if (!secondary_arg_as_reg(interp->u[1], &vreg))
+    return 0;
+  reset_secondary_args(interp);
+
+  if (!stack_pop_strings(interp, 2, &body, &path)) UNDERFLOW;
+
+  for (n = 0, child = 0; status; ++n) {
+    /* The body may have changed the payload, in which case the container is
+     * found afresh, and the position within it again.
+     */
+    if (!n || !json_current(&interp->payload)) {
+      if (!json_lookup(interp, path, &container)) {
+        status = 0;
+        break;
+      }
+      values = interp->payload.json.values;
+      if (values[container].type != JSON_ARRAY &&
+          values[container].type != JSON_OBJECT) {
+        print_error_s("Not an array or object", path);
+        status = 0;
+        break;
+      }
+
+      for (child = container+1, i = 0;
+           i < n && child < values[container].next; ++i)
+        child = values[container].type == JSON_OBJECT?
+          values[child+1].next : values[child].next;
+    }
+
+    values = interp->payload.json.values;
+    if (child >= values[container].next) break;
+
+    free(interp->registers[kreg]);
+    free(interp->registers[vreg]);
+    if (values[container].type == JSON_OBJECT) {
+      interp->registers[kreg] =
+        json_string_value(string_data(DATA), values + child);
+      ++child;
+    } else {
+      interp->registers[kreg] = int_to_string(n);
+    }
+    interp->registers[vreg] =
+      json_value_string(string_data(DATA), values + child);
+    touch_reg(interp, kreg);
+    touch_reg(interp, vreg);
+    child = values[child].next;
+
+    status = exec_code(interp, body);
+  }
+
+  free(body);
+  free(path);
+  return status;
+}
+
+static int payload_json_recurse(interpreter* interp) {
+  string path, code;
+  unsigned value;
+  const json_value* values;
+
+  AUTO;
+
+  if (!stack_pop_strings(interp, 2, &code, &path)) UNDERFLOW;
+
+  if (!json_lookup(interp, path, &value)) {
+    stack_push(interp, path);
+    stack_push(interp, code);
+    return 0;
+  }
+
+  free(path);
+  values = interp->payload.json.values;
+  return run_subordinate(interp,
+                         create_string(string_data(DATA) + values[value].begin,
+                                       string_data(DATA) + values[value].end),
+                         code, value);
+}
+
+/* Runs body with reg set to each item of DATA from offset off (the start of
+ * an item) up to stop, for ,e. The second register is unused.
+ *
+ * Returns the status of the last execution of body.
+ */
+static int each_item(interpreter* interp, string body, byte reg, byte unused,
+                     unsigned off, unsigned stop) {
+  int status = 1;
+  unsigned end, next;
+  byte* released = NULL;
+
+  (void)unused;
+  while (off < stop && status) {
+    /* Items already visited needn't stay in memory; they are reread from the
+     * file if needed again.
+     */
+    if (interp->payload.data_map)
+      released = release_pages(&interp->payload,
+                               released && released > string_data(DATA)?
+                               released : string_data(DATA),
+                               string_data(DATA)+off);
+
+    /* Set end and next to EOS in case there is no delimiter. */
+    end = next = DATA->len;
+    find_delimiter_from(interp->payload.value_delim,
+                        DATA, off, &end, &next, &interp->payload);
+
+    /* Set register */
+    free(interp->registers[reg]);
+    interp->registers[reg] =
+      payload_trim(create_string(string_data(DATA)+off,
+                                 string_data(DATA)+end),
+                   &interp->payload);
+    touch_reg(interp, reg);
+
+    /* Execute body and move to next item */
+    status = exec_code(interp, body);
+    off = next;
+  }
+
+  return status;
+}
+
+/* Like each_item(), but sets kreg and vreg to each pair of items, for ,E. */
+static int each_pair(interpreter* interp, string body, byte kreg, byte vreg,
+                     unsigned off, unsigned stop) {
+  int status = 1;
+  unsigned end, next;
+  byte* released = NULL;
+
+  while (off < stop && status) {
+    /* As with ,e */
+    if (interp->payload.data_map)
+      released = release_pages(&interp->payload,
+                               released && released > string_data(DATA)?
+                               released : string_data(DATA),
+                               string_data(DATA)+off);
+
+    /* Extract and set key register */
+    end = next = DATA->len;
+    find_delimiter_from(interp->payload.value_delim,
+                        DATA, off, &end, &next, &interp->payload);
+    free(interp->registers[kreg]);
+    interp->registers[kreg] =
+      payload_trim(create_string(string_data(DATA)+off,
+                                 string_data(DATA)+end),
+                   &interp->payload);
+    touch_reg(interp, kreg);
+    off = next;
+
+    /* Stop now if no value remains */
+    if (off >= DATA->len) break;
+
+    /* Extract and set value register */
+    end = next = DATA->len;
+    find_delimiter_from(interp->payload.value_delim,
+                        DATA, off, &end, &next, &interp->payload);
+    free(interp->registers[vreg]);
+    interp->registers[vreg] =
+      payload_trim(create_string(string_data(DATA)+off,
+                                 string_data(DATA)+end),
+                   &interp->payload);
+    touch_reg(interp, vreg);
+    off = next;
+
+    /* Run body */
+    status = exec_code(interp, body);
+  }
+
+  return status;
+}
+
+typedef int (*each_function)(interpreter*, string, byte, byte,
+                             unsigned, unsigned);
+
+extern void forget_jobs(void);
+/* Prepares a forked worker to run on its own: the helpers and jobs it
+ * inherited belong to the parent, whose conversations with them it must not
+ * join.
+ */
+static void become_worker(void) {
+  coprocess_forget();
+  forget_jobs();
+}
+
+/* The body of a worker for each_parallel(), run in the forked child. Runs fn
+ * over its share of the payload, then writes the values it pushed onto the
+ * stack, bottom first, to standard output after everything the body printed.
+ * Each value is preceded by its length; the whole is followed by its total
+ * length, so that the parent can find it at the end.
+ *
+ * Returns the exit status for the child.
+ */
+static int each_worker(interpreter* interp, string body, byte a, byte b,
+                       unsigned off, unsigned stop, each_function fn) {
+  stack_elt* bottom = interp->stack, * elt;
+  string results = empty_string(), * values;
+  unsigned num_values = 0, i;
+  int status;
+
+  status = fn(interp, body, a, b, off, stop);
+
+  for (elt = interp->stack; elt && elt != bottom; elt = elt->next)
+    ++num_values;
+  if (elt != bottom) {
+    if (status)
+      print_error("Parallel body consumed values from the stack");
+    status = 0;
+    num_values = 0;
+  }
+
+  values = tmalloc(sizeof(string) * (num_values+1));
+  for (i = num_values, elt = interp->stack; i; --i, elt = elt->next)
+    values[i-1] = elt->value;
+  for (i = 0; i < num_values; ++i) {
+    results = append_data(results, &values[i]->len, (&values[i]->len)+1);
+    results = append_string(results, values[i]);
+  }
+  i = results->len;
+  results = append_data(results, &i, (&i)+1);
+
+  fflush(stdout);
+  fwrite(string_data(results), 1, results->len, stdout);
+  fflush(stdout);
+  return status? 0 : 1;
+}
+
+/* Runs fn (each_item() or each_pair()) over DATA split between the given
+ * number of forked workers, each of which is given a contiguous run of steps
+ * of step items. The output and pushed values of the workers are then taken in
+ * order, as if fn had been run over the whole payload here, stopping after the
+ * first worker whose body failed. Changes to registers, the payload and
+ * anything else made by the workers are lost.
+ *
+ * Returns whether all workers succeeded.
+ */
+static int each_parallel(interpreter* interp, string body, byte a, byte b,
+                         unsigned workers, unsigned step, each_function fn) {
+  unsigned* index, first, count, steps, from, to, base, i, len, off, end;
+  process* procs;
+  process** pending;
+  string output, value;
+  int status = 1, exit_status, ret;
+
+  index = payload_index(interp, &first, &count);
+  steps = (count + step - 1) / step;
+  if (workers > steps) workers = steps;
+  if (workers <= 1)
+    return fn(interp, body, a, b, 0, DATA->len);
+
+  base = index[2*first];
+  procs = tmalloc(sizeof(process) * workers);
+  pending = tmalloc(sizeof(process*) * workers);
+  for (i = 0; i < workers; ++i) {
+    from = first + (unsigned)((unsigned long long)steps * i / workers) * step;
+    to = first + (unsigned)((unsigned long long)steps * (i+1) / workers)*step;
+    pending[i] = &procs[i];
+
+    switch (process_fork(&procs[i], "payload worker")) {
+    case -1:
+      workers = i;
+      status = 0;
+      goto abandon;
+
+    case 0:
+      become_worker();
+      _exit(each_worker(interp, body, a, b, index[2*from] - base,
+                        to < first+count? index[2*to] - base : DATA->len,
+                        fn));
+    }
+  }
+
+  while ((ret = process_pump(pending, workers, -1)) > 0);
+  if (ret == -1) {
+    status = 0;
+    goto abandon;
+  }
+
+  for (i = 0; i < workers && status; ++i) {
+    if (!(output = process_finish(&procs[i], &exit_status))) {
+      status = 0;
+      break;
+    }
+
+    /* Split the results from the end of the output */
+    if (output->len >= sizeof(unsigned))
+      memcpy(&len, string_data(output) + output->len - sizeof(unsigned),
+             sizeof(unsigned));
+    if (output->len < sizeof(unsigned) ||
+        len > output->len - sizeof(unsigned)) {
+      print_error("Payload worker produced no results");
+      free(output);
+      status = 0;
+      break;
+    }
+    end = output->len - sizeof(unsigned);
+    off = end - len;
+    fwrite(string_data(output), 1, off, stdout);
+    while (off < end) {
+      memcpy(&len, string_data(output) + off, sizeof(unsigned));
+      off += sizeof(unsigned);
+      value = create_string(string_data(output) + off,
+                            string_data(output) + off + len);
+      stack_push(interp, value);
+      off += len;
+    }
+
+    free(output);
+    status = !exit_status;
+  }
+
+  abandon:
+  for (i = 0; i < workers; ++i)
+    process_abandon(&procs[i]);
+  free(pending);
+  free(procs);
+  return status;
+}
+
+/* Returns the number of processors online, or 1 if unknown. */
+static unsigned num_processors(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return cpus > 0? cpus : 1;
+}
+
+/* Reads the worker count for ,e or ,E from the given secondary argument, where
+ * 0 means one per processor.
+ *
+ * Returns whether successful.
+ */
+static int get_workers(string arg, unsigned* workers) {
+  signed n;
+
+  if (!secondary_arg_as_int(arg, &n, 0))
+    return 0;
+
+  /* n is known to be non-negative here. */
+  *workers = n? (unsigned)n : num_processors();
+  return 1;
+}
+
+static int payload_each(interpreter* interp) {
+  string body;
+  int status;
+  unsigned workers;
+  byte reg = 'p';
+
+  AUTO;
+
+  if (!secondary_arg_as_reg(interp->u[0], &reg))
+    return 0;
+  if (!get_workers(interp->u[1], &workers))
+    return 0;
+
+  reset_secondary_args(interp);
+
+  if (!(body = stack_pop(interp))) UNDERFLOW;
+
+  if (workers > 1)
+    status = each_parallel(interp, body, reg, 0, workers, 1, each_item);
+  else
+    status = each_item(interp, body, reg, 0, 0, DATA->len);
+
+  free(body);
+  return status;
+}
+
+static int payload_each_kv(interpreter* interp) {
+  string body;
+  int status;
+  unsigned workers;
+  byte kreg = 'k', vreg = 'v';
+
+  AUTO;
+
+  if (!secondary_arg_as_reg(interp->u[0], &kreg))
+    return 0;
+  if (!secondary_arg_as_reg(interp->u[1], &vreg))
+    return 0;
+  if (!get_workers(interp->u[2], &workers))
+    return 0;
+  reset_secondary_args(interp);
+
+  if (!(body = stack_pop(interp))) UNDERFLOW;
+
+  if (workers > 1)
+    status = each_parallel(interp, body, kreg, vreg, workers, 2, each_pair);
+  else
+    status = each_pair(interp, body, kreg, vreg, 0, DATA->len);
+
+  free(body);
+  return status;
+}
+
+/* An item, or key/value pair, being sorted by ,o or ,O. begin and end bound
+ * the item or key, trimmed as by ,c, relative to index_origin; they are only
+ * used for comparison, the untrimmed item (and value, which is the next item,
+ * if any) being written back from the index.
+ */
+typedef struct sort_entry {
+  unsigned begin, end;
+  /* The index entry of the item or key */
+  unsigned item;
+  /* The item or key as an integer, for numeric sorting */
+  signed number;
+  /* The first eight bytes of the item or key, big-endian and padded with
+   * zeroes, which decide most comparisons without touching the data.
+   */
+  unsigned long long prefix;
+} sort_entry;
+
+/* How entries are ordered. */
+typedef struct sort_order {
+  const byte* origin;
+  int numeric, reverse;
+} sort_order;
+
+/* Runs shorter than this are sorted by insertion before merging. */
+#define SORT_RUN 16
+/* Sorts with fewer entries than this are not worth splitting among workers. */
+#define SORT_PARALLEL_MIN 262144
+
+/* Compares two entries, returning a negative number, zero or a positive number
+ * as a is ordered before, with, or after b.
+ */
+static int compare_entries(const sort_entry* a, const sort_entry* b,
+                           const sort_order* order) {
+  unsigned alen = a->end - a->begin, blen = b->end - b->begin;
+  int cmp;
+
+  if (order->numeric)
+    cmp = (a->number > b->number) - (a->number < b->number);
+  else if (a->prefix != b->prefix)
+    cmp = a->prefix > b->prefix? 1 : -1;
+  else if (!(cmp = memcmp(order->origin + a->begin, order->origin + b->begin,
+                          alen < blen? alen : blen)))
+    cmp = (alen > blen) - (alen < blen);
+
+  return order->reverse? -cmp : cmp;
+}
+
+/* Merges the sorted runs a and b, of lengths na and nb, into dst. Entries of
+ * a come first among equal entries.
+ */
+static void merge_runs(sort_entry* dst, const sort_entry* a, unsigned na,
+                       const sort_entry* b, unsigned nb,
+                       const sort_order* order) {
+  const sort_entry* aend = a + na, * bend = b + nb;
+
+  while (a < aend && b < bend)
+    *dst++ = compare_entries(b, a, order) < 0? *b++ : *a++;
+  memcpy(dst, a, (aend - a) * sizeof(sort_entry));
+  dst += aend - a;
+  memcpy(dst, b, (bend - b) * sizeof(sort_entry));
+}
+
+/* Merges the adjacent sorted runs of entries, of which there are num_runs,
+ * beginning at the offsets in bounds (which has a final entry for the end of
+ * the last), into one. temp must have room for as many entries.
+ */
+static void merge_all(sort_entry* entries, sort_entry* temp,
+                      unsigned* bounds, unsigned num_runs,
+                      const sort_order* order) {
+  sort_entry* src = entries, * dst = temp, * swap;
+  unsigned i, n = bounds[num_runs];
+
+  while (num_runs > 1) {
+    for (i = 0; i+1 < num_runs; i += 2) {
+      merge_runs(dst + bounds[i], src + bounds[i], bounds[i+1] - bounds[i],
+                 src + bounds[i+1], bounds[i+2] - bounds[i+1], order);
+      bounds[i/2] = bounds[i];
+    }
+    if (i < num_runs) {
+      memcpy(dst + bounds[i], src + bounds[i],
+             (bounds[i+1] - bounds[i]) * sizeof(sort_entry));
+      bounds[i/2] = bounds[i];
+    }
+    num_runs = (num_runs+1) / 2;
+    bounds[num_runs] = n;
+
+    swap = src;
+    src = dst;
+    dst = swap;
+  }
+
+  if (src != entries)
+    memcpy(entries, src, n * sizeof(sort_entry));
+}
+
+/* Stably sorts the given n entries, using temp, which has room for as many. */
+static void sort_entries(sort_entry* entries, sort_entry* temp, unsigned n,
+                         const sort_order* order) {
+  sort_entry* src = entries, * dst = temp, * swap, e;
+  unsigned width, lo, mid, hi, i, j;
+
+  /* Insertion sort each short run */
+  for (lo = 0; lo < n; lo += SORT_RUN) {
+    hi = lo + SORT_RUN < n? lo + SORT_RUN : n;
+    for (i = lo+1; i < hi; ++i) {
+      e = entries[i];
+      for (j = i; j > lo && compare_entries(&e, entries+j-1, order) < 0; --j)
+        entries[j] = entries[j-1];
+      entries[j] = e;
+    }
+  }
+
+  /* Merge runs of doubling width, alternating between the buffers */
+  for (width = SORT_RUN; width < n; width *= 2) {
+    for (lo = 0; lo < n; lo += 2*width) {
+      mid = lo + width < n? lo + width : n;
+      hi = lo + 2*width < n? lo + 2*width : n;
+      merge_runs(dst+lo, src+lo, mid-lo, src+mid, hi-mid, order);
+    }
+
+    swap = src;
+    src = dst;
+    dst = swap;
+  }
+
+  if (src != entries)
+    memcpy(entries, src, n * sizeof(sort_entry));
+}
+
+/* Sorts the given n entries, splitting the work among up to the given number
+ * of forked workers, each of which sorts a contiguous part and writes it back
+ * through its output, the parts then being merged.
+ *
+ * Returns whether successful.
+ */
+static int sort_parallel(sort_entry* entries, unsigned n, unsigned workers,
+                         const sort_order* order) {
+  sort_entry* temp = tmalloc(n * sizeof(sort_entry) + 1);
+  unsigned* bounds;
+  process* procs;
+  process** pending;
+  string output;
+  int status = 1, exit_status, ret;
+  unsigned i;
+
+  if (n < SORT_PARALLEL_MIN || workers <= 1) {
+    sort_entries(entries, temp, n, order);
+    free(temp);
+    return 1;
+  }
+
+  bounds = tmalloc(sizeof(unsigned) * (workers+1));
+  procs = tmalloc(sizeof(process) * workers);
+  pending = tmalloc(sizeof(process*) * workers);
+  for (i = 0; i <= workers; ++i)
+    bounds[i] = (unsigned)((unsigned long long)n * i / workers);
+
+  for (i = 0; i < workers; ++i) {
+    pending[i] = &procs[i];
+    switch (process_fork(&procs[i], "sort worker")) {
+    case -1:
+      workers = i;
+      status = 0;
+      goto abandon;
+
+    case 0:
+      become_worker();
+      sort_entries(entries + bounds[i], temp + bounds[i],
+                   bounds[i+1] - bounds[i], order);
+      fwrite(entries + bounds[i], sizeof(sort_entry),
+             bounds[i+1] - bounds[i], stdout);
+      fflush(stdout);
+      _exit(0);
+    }
+  }
+
+  while ((ret = process_pump(pending, workers, -1)) > 0);
+  if (ret == -1) {
+    status = 0;
+    goto abandon;
+  }
+
+  for (i = 0; i < workers && status; ++i) {
+    if (!(output = process_finish(&procs[i], &exit_status))) {
+      status = 0;
+      break;
+    }
+
+    if (exit_status ||
+        output->len != (bounds[i+1] - bounds[i]) * sizeof(sort_entry)) {
+      print_error("Sort worker failed");
+      status = 0;
+    } else {
+      memcpy(entries + bounds[i], string_data(output), output->len);
+    }
+    free(output);
+  }
+
+  if (status)
+    merge_all(entries, temp, bounds, workers, order);
+
+  abandon:
+  for (i = 0; i < workers; ++i)
+    process_abandon(&procs[i]);
+  free(pending);
+  free(procs);
+  free(bounds);
+  free(temp);
+  return status;
+}
+
+/* Implements ,o (pairs false) and ,O (pairs true). */
+static int payload_sort(interpreter* interp, int pairs) {
+  payload_data* p = &interp->payload;
+  string flags, item, result;
+  sort_order order;
+  sort_entry* entries;
+  unsigned workers, first, cnt, num_entries = 0, i, k, len;
+  int unique = 0;
+
+  AUTO;
+
+  order.numeric = order.reverse = 0;
+  if ((flags = interp->u[0])) {
+    for (i = 0; i < flags->len; ++i) {
+      switch (string_data(flags)[i]) {
+      case 'n': order.numeric = 1; break;
+      case 'r': order.reverse = 1; break;
+      case 'u': unique = 1; break;
+      default:
+        print_error_s("Unknown sort flag", flags);
+        return 0;
+      }
+    }
+  }
+  /* Large sorts use every processor unless told otherwise. */
+  workers = num_processors();
+  if (interp->u[1] && !get_workers(interp->u[1], &workers))
+    return 0;
   reset_secondary_args(interp);
 
-  if (!(body = stack_pop(interp))) UNDERFLOW;
+  payload_index(interp, &first, &cnt);
+  order.origin = p->index_origin;
+  entries = tmalloc(sizeof(sort_entry) * (cnt+1));
+  for (i = first; i < first+cnt; ++i) {
+    sort_entry* e = entries + num_entries++;
+
+    e->item = i;
+    e->begin = p->index[2*i];
+    e->end = p->index[2*i+1];
+    payload_trim_bounds(p->index_origin, &e->begin, &e->end, p);
+    e->number = 0;
+    for (e->prefix = 0, k = 0; k < 8; ++k)
+      e->prefix = e->prefix << 8 |
+        (e->begin + k < e->end? p->index_origin[e->begin + k] : 0);
+    if (order.numeric &&
+        !data_to_int(p->index_origin + e->begin, e->end - e->begin,
+                     &e->number)) {
+      item = create_string(p->index_origin + e->begin,
+                           p->index_origin + e->end);
+      print_error_s("Bad integer", item);
+      free(item);
+      free(entries);
+      return 0;
+    }
 
-  off = 0;
-  status = 1;
-  while (off < DATA->len && status) {
-    /* Set end and next to EOS in case there is no delimiter. */
-    end = next = DATA->len;
-    find_delimiter_from(interp->payload.value_delim,
-                        DATA, off, &end, &next, &interp->payload);
+    /* Values go along with their keys */
+    if (pairs) ++i;
+  }
 
-    /* Set register */
-    free(interp->registers[reg]);
-    interp->registers[reg] =
-      payload_trim(create_string(string_data(DATA)+off,
-                                 string_data(DATA)+end),
-                   &interp->payload);
-    touch_reg(interp, reg);
+  if (!sort_parallel(entries, num_entries, workers, &order)) {
+    free(entries);
+    return 0;
+  }
 
-    /* Execute body and move to next item */
-    status = exec_code(interp, body);
-    off = next;
+  /* Drop duplicates, which are now adjacent, keeping the first */
+  if (unique && num_entries) {
+    for (i = k = 1; i < num_entries; ++i)
+      if (compare_entries(entries+k-1, entries+i, &order))
+        entries[k++] = entries[i];
+    num_entries = k;
   }
 
-  free(body);
-  return status;
+  /* Serialise with the output delimiters */
+#define SPAN(item) (p->index[2*(item)+1] - p->index[2*(item)])
+#define HAS_VALUE(e) (pairs && (e)->item+1 < first+cnt)
+  len = 0;
+  for (i = 0; i < num_entries; ++i) {
+    len += SPAN(entries[i].item);
+    if (i)
+      len += (pairs? p->output_kvs_delim : p->output_v_delim)->len;
+    if (HAS_VALUE(entries+i))
+      len += p->output_kv_delim->len + SPAN(entries[i].item+1);
+  }
+
+  result = tmalloc(sizeof(struct string) + len);
+  result->len = 0;
+#define PUT(begin,n) (memcpy(string_data(result) + result->len, (begin), (n)), \
+                      result->len += (n))
+  for (i = 0; i < num_entries; ++i) {
+    k = entries[i].item;
+    if (i && pairs)
+      PUT(string_data(p->output_kvs_delim), p->output_kvs_delim->len);
+    else if (i)
+      PUT(string_data(p->output_v_delim), p->output_v_delim->len);
+    PUT(p->index_origin + p->index[2*k], SPAN(k));
+    if (HAS_VALUE(entries+i)) {
+      PUT(string_data(p->output_kv_delim), p->output_kv_delim->len);
+      PUT(p->index_origin + p->index[2*k+2], SPAN(k+1));
+    }
+  }
+#undef HAS_VALUE
+#undef SPAN
+#undef PUT
+
+  free(entries);
+  set_payload(interp, result);
+  return 1;
 }
 
-static int payload_each_kv(interpreter* interp) {
-  string body;
+static int payload_sort_items(interpreter* interp) {
+  return payload_sort(interp, 0);
+}
+
+static int payload_sort_kv(interpreter* interp) {
+  return payload_sort(interp, 1);
+}
+
+/* A new payload being assembled from parts of the current one, joined with
+ * the output delimiters.
+ */
+typedef struct payload_builder {
+  string result;
+  unsigned cap, num;
+} payload_builder;
+
+static void builder_init(payload_builder* b) {
+  b->cap = 256;
+  b->result = tmalloc(sizeof(struct string) + b->cap);
+  b->result->len = 0;
+  b->num = 0;
+}
+
+static void builder_put(payload_builder* b, const byte* data, unsigned len) {
+  if (b->result->len + len > b->cap) {
+    while (b->result->len + len > b->cap) b->cap *= 2;
+    b->result = trealloc(b->result, sizeof(struct string) + b->cap);
+  }
+
+  memcpy(string_data(b->result) + b->result->len, data, len);
+  b->result->len += len;
+}
+
+/* Adds the item [begin,end) of the payload to the builder; or, if pairs is
+ * non-zero, the key [begin,end) and the value [value_begin,value_end), unless
+ * value_begin is ~0u, indicating that the key has no value.
+ */
+static void builder_add(payload_builder* b, payload_data* p, int pairs,
+                        unsigned begin, unsigned end,
+                        unsigned value_begin, unsigned value_end) {
+  string delim = pairs? p->output_kvs_delim : p->output_v_delim;
+  const byte* data = string_data(p->data);
+
+  if (b->num++)
+    builder_put(b, string_data(delim), delim->len);
+  builder_put(b, data + begin, end - begin);
+  if (pairs && value_begin != ~0u) {
+    builder_put(b, string_data(p->output_kv_delim), p->output_kv_delim->len);
+    builder_put(b, data + value_begin, value_end - value_begin);
+  }
+}
+
+/* Moves *pos past the item of the payload beginning there, storing its
+ * untrimmed bounds in *begin and *end. As with payload_index(), an empty
+ * delimiter ends the payload.
+ */
+static void next_item(payload_data* p, unsigned* pos,
+                      unsigned* begin, unsigned* end) {
+  unsigned next;
+
+  *end = next = p->data->len;
+  find_delimiter_from(p->value_delim, p->data, *pos, end, &next, p);
+  *begin = *pos;
+  *pos = next > *pos? next : p->data->len;
+}
+
+/* A predicate on items for payload_filter(). */
+typedef struct item_filter {
+  /* = for equality, s for substrings, g for globs, r for regular
+   * expressions.
+   */
+  byte kind;
+  string pattern;
+  /* The pattern, NUL-terminated, for globs. */
+  char* cpattern;
+  scan_needle needle;
+  regex_t regex;
+  /* The item being tested, NUL-terminated, for fnmatch() and regexec(). */
+  char* scratch;
+  unsigned scratch_cap;
+} item_filter;
+
+/* Prepares the given filter to match items against pattern, which it
+ * borrows.
+ *
+ * Returns 1 on success, 0 on error (in which case a diagnostic is printed).
+ */
+static int item_filter_init(item_filter* f, byte kind, string pattern) {
+  char* cpattern;
   int status;
-  unsigned off, end, next;
-  byte kreg = 'k', vreg = 'v';
 
-  AUTO;
+  f->kind = kind;
+  f->pattern = pattern;
+  f->cpattern = NULL;
+  f->scratch = NULL;
+  f->scratch_cap = 0;
+
+  if (kind == 's') {
+    scan_needle_init(&f->needle, string_data(pattern), pattern->len);
+  } else if (kind == 'g') {
+    f->cpattern = string_to_cstr(pattern);
+  } else if (kind == 'r') {
+    cpattern = string_to_cstr(pattern);
+    status = regcomp(&f->regex, cpattern, REG_EXTENDED|REG_NOSUB);
+    free(cpattern);
+    if (status) {
+      print_error_s("Invalid regular expression", pattern);
+      return 0;
+    }
+  }
 
-  if (!secondary_arg_as_reg(interp->u[0], &kreg))
+  return 1;
+}
+
+static void item_filter_destroy(item_filter* f) {
+  if (f->kind == 'r') regfree(&f->regex);
+  if (f->cpattern) free(f->cpattern);
+  if (f->scratch) free(f->scratch);
+}
+
+/* Returns a NUL-terminated copy of the given item in the filter's scratch
+ * space.
+ */
+static char* item_filter_cstr(item_filter* f, const byte* data, unsigned len) {
+  if (len >= f->scratch_cap) {
+    if (f->scratch) free(f->scratch);
+    f->scratch_cap = len+1 > 256? len+1 : 256;
+    f->scratch = tmalloc(f->scratch_cap);
+  }
+
+  memcpy(f->scratch, data, len);
+  f->scratch[len] = 0;
+  return f->scratch;
+}
+
+/* Returns whether the given item satisfies the given filter. */
+static int item_filter_matches(item_filter* f, const byte* data,
+                               unsigned len) {
+  unsigned at;
+#ifdef REG_STARTEND
+  regmatch_t match;
+#endif
+
+  switch (f->kind) {
+  case '=':
+    return len == f->pattern->len &&
+      !memcmp(data, string_data(f->pattern), len);
+
+  case 's':
+    return !f->pattern->len || scan_needle_find(&f->needle, data, len, &at);
+
+  case 'g':
+    return !fnmatch(f->cpattern, item_filter_cstr(f, data, len), 0);
+
+  default:
+#ifdef REG_STARTEND
+    match.rm_so = 0;
+    match.rm_eo = len;
+    return !regexec(&f->regex, (const char*)data, 1, &match, REG_STARTEND);
+#else
+    return !regexec(&f->regex, item_filter_cstr(f, data, len), 0, NULL, 0);
+#endif
+  }
+}
+
+/* Keeps the items of the payload which match (or, with the secondary
+ * argument, those which don't) the pattern on the stack, in the way named by
+ * the character following the command; if pairs is non-zero, the pairs whose
+ * keys match.
+ */
+static int payload_filter(interpreter* interp, int pairs) {
+  payload_data* p = &interp->payload;
+  payload_builder b;
+  item_filter f;
+  string pattern;
+  byte kind;
+  unsigned pos = 0, begin, end, value_begin, value_end, key_begin, key_end;
+  int drop = 0;
+
+  ++interp->ip;
+  if (!is_ip_valid(interp)) {
+    print_error("Missing match kind following filter command");
     return 0;
-  if (!secondary_arg_as_reg(interp->u[1], &vreg))
+  }
+  kind = curr(interp);
+  if (!kind || !strchr("=sgr", kind)) {
+    print_error("Unknown match kind");
     return 0;
+  }
+
+  if (interp->u[0])
+    drop = string_to_bool(interp->u[0]);
   reset_secondary_args(interp);
 
-  if (!(body = stack_pop(interp))) UNDERFLOW;
+  AUTO;
 
-  off = 0;
-  status = 1;
-  while (off < DATA->len && status) {
-    /* Extract and set key register */
-    end = next = DATA->len;
-    find_delimiter_from(interp->payload.value_delim,
-                        DATA, off, &end, &next, &interp->payload);
-    free(interp->registers[kreg]);
-    interp->registers[kreg] =
-      payload_trim(create_string(string_data(DATA)+off,
-                                 string_data(DATA)+end),
-                   &interp->payload);
-    touch_reg(interp, kreg);
-    off = next;
+  if (!(pattern = stack_pop(interp))) UNDERFLOW;
+  if (!item_filter_init(&f, kind, pattern)) {
+    stack_push(interp, pattern);
+    return 0;
+  }
 
-    /* Stop now if no value remains */
-    if (off >= DATA->len) break;
+  builder_init(&b);
+  while (pos < DATA->len) {
+    next_item(p, &pos, &begin, &end);
+    value_begin = value_end = ~0u;
+    if (pairs && pos < DATA->len)
+      next_item(p, &pos, &value_begin, &value_end);
+
+    /* Matched as by ,c, but kept as they are */
+    key_begin = begin;
+    key_end = end;
+    payload_trim_bounds(string_data(DATA), &key_begin, &key_end, p);
+    if (item_filter_matches(&f, string_data(DATA) + key_begin,
+                            key_end - key_begin) != drop)
+      builder_add(&b, p, pairs, begin, end, value_begin, value_end);
+  }
 
-    /* Extract and set value register */
-    end = next = DATA->len;
-    find_delimiter_from(interp->payload.value_delim,
-                        DATA, off, &end, &next, &interp->payload);
-    free(interp->registers[vreg]);
-    interp->registers[vreg] =
-      payload_trim(create_string(string_data(DATA)+off,
-                                 string_data(DATA)+end),
-                   &interp->payload);
-    touch_reg(interp, vreg);
-    off = next;
+  item_filter_destroy(&f);
+  free(pattern);
+  set_payload(interp, b.result);
+  return 1;
+}
 
-    /* Run body */
-    status = exec_code(interp, body);
+static int payload_filter_items(interpreter* interp) {
+  return payload_filter(interp, 0);
+}
+
+static int payload_filter_kv(interpreter* interp) {
+  return payload_filter(interp, 1);
+}
+
+/* Replaces the payload, taken as pairs, with just their keys, or just their
+ * values if values is non-zero.
+ */
+static int payload_project(interpreter* interp, int values) {
+  payload_data* p = &interp->payload;
+  payload_builder b;
+  unsigned pos = 0, begin, end, value_begin, value_end;
+
+  AUTO;
+
+  builder_init(&b);
+  while (pos < DATA->len) {
+    next_item(p, &pos, &begin, &end);
+    if (pos < DATA->len) {
+      next_item(p, &pos, &value_begin, &value_end);
+      if (values)
+        builder_add(&b, p, 0, value_begin, value_end, 0, 0);
+    }
+    if (!values)
+      builder_add(&b, p, 0, begin, end, 0, 0);
   }
 
-  free(body);
-  return status;
+  set_payload(interp, b.result);
+  return 1;
+}
+
+static int payload_keys(interpreter* interp) {
+  return payload_project(interp, 0);
+}
+
+static int payload_values(interpreter* interp) {
+  return payload_project(interp, 1);
+}
+
+/* Replaces the payload with its first n items, n being popped from the
+ * stack, or with all but them if skip is non-zero.
+ */
+static int payload_take(interpreter* interp, int skip) {
+  payload_data* p = &interp->payload;
+  payload_builder b;
+  string scnt;
+  signed cnt;
+  unsigned pos = 0, begin, end;
+
+  AUTO;
+
+  if (!(scnt = stack_pop(interp))) UNDERFLOW;
+  if (!string_to_int(scnt, &cnt) || cnt < 0) {
+    print_error_s("Invalid count", scnt);
+    stack_push(interp, scnt);
+    return 0;
+  }
+  free(scnt);
+
+  builder_init(&b);
+  while (pos < DATA->len && (skip || cnt)) {
+    next_item(p, &pos, &begin, &end);
+    if (skip && cnt) {
+      --cnt;
+    } else {
+      builder_add(&b, p, 0, begin, end, 0, 0);
+      if (!skip) --cnt;
+    }
+  }
+
+  set_payload(interp, b.result);
+  return 1;
+}
+
+static int payload_take_items(interpreter* interp) {
+  return payload_take(interp, 0);
+}
+
+static int payload_skip_items(interpreter* interp) {
+  return payload_take(interp, 1);
+}
+
+/* Maps the given regular file, of the given non-zero size, for use as payload
+ * (see payload_data), storing the region in *map and *map_size.
+ *
+ * Returns a string whose data is the contents of the file, or NULL if the
+ * file could not be mapped.
+ */
+static string map_file(int fd, size_t size, void** map, size_t* map_size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  byte* region;
+  string str;
+
+  *map_size = page + size;
+  region = mmap(NULL, *map_size, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED)
+    return NULL;
+
+  /* Writable so that string_advance() can move the header through it. */
+  if (MAP_FAILED == mmap(region + page, size, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_FIXED, fd, 0)) {
+    munmap(region, *map_size);
+    return NULL;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise(region + page, size, MADV_SEQUENTIAL);
+#endif
+
+  str = (string)(region + page - sizeof(struct string));
+  str->len = size;
+  *map = region;
+  return str;
 }
 
 static int payload_from_file(interpreter* interp) {
   string payload;
+  struct stat st;
+  void* map;
+  size_t map_size;
   byte buffer[4096];
   unsigned cnt;
   FILE* file;
@@ -940,12 +2963,36 @@ static int payload_from_file(interpreter* interp) {
     return 0;
   }
 
+  /* Regular files are mapped rather than read, so that they needn't fit in
+   * memory.
+   */
+  if (!fstat(fileno(file), &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+    if (st.st_size > UINT_MAX) {
+      print_error_s("File too large", sfilename);
+      stack_push(interp, sfilename);
+      fclose(file);
+      return 0;
+    }
+
+    if ((payload = map_file(fileno(file), st.st_size, &map, &map_size))) {
+      total_bytes_read += st.st_size;
+      fclose(file);
+      free(sfilename);
+      set_payload(interp, payload);
+      interp->payload.data_map = map;
+      interp->payload.data_map_size = map_size;
+      interp->payload.data_map_released = (byte*)map + (map_size - st.st_size);
+      return 1;
+    }
+  }
+
   /* Read the file in and store in string */
   payload = empty_string();
   while (!feof(file) && !ferror(file)) {
     cnt = fread(buffer, 1, sizeof(buffer), file);
     if (cnt)
       payload = append_data(payload, buffer, buffer+cnt);
+    total_bytes_read += cnt;
   }
 
   /* Did an error occur? */
@@ -965,12 +3012,132 @@ static int payload_from_file(interpreter* interp) {
   return 1;
 }
 
+#ifdef GLOB_ALTDIRFUNC
+/* While a glob whose result is to be cached runs, the directories it
+ * examines, as a sequence of records for glob_cache_valid(), and the last
+ * directory recorded (to skip immediate repeats). glob_cacheable is cleared if
+ * any directory was modified so recently that a later modification might not
+ * change its time.
+ */
+static string glob_dirs, glob_last_dir;
+static int glob_cacheable;
+static time_t glob_started;
+
+/* Records the directory of the given length at dir as examined. Each record
+ * is the modification time and inode number of the directory in decimal (or
+ * -1 and 0 if it does not exist), each followed by a space, then the path and
+ * a NUL.
+ */
+static void glob_note_dir(const char* dir, unsigned len) {
+  struct stat st;
+  char header[64];
+
+  if (glob_last_dir && glob_last_dir->len == len &&
+      !memcmp(string_data(glob_last_dir), dir, len))
+    return;
+
+  free(glob_last_dir);
+  glob_last_dir = create_string((void*)dir, (void*)(dir+len));
+  glob_last_dir = append_data(glob_last_dir, "", ((char*)"")+1);
+
+  if (stat((char*)string_data(glob_last_dir), &st)) {
+    strcpy(header, "-1 0 ");
+  } else {
+    sprintf(header, "%ld %lu ", (long)st.st_mtime, (unsigned long)st.st_ino);
+    if (st.st_mtime >= glob_started - 1)
+      glob_cacheable = 0;
+  }
+
+  glob_dirs = append_cstr(glob_dirs, header);
+  glob_dirs = append_string(glob_dirs, glob_last_dir);
+  --glob_last_dir->len;
+}
+
+/* Records the directory containing the given path, whose contents determine
+ * whether it exists.
+ */
+static void glob_note_parent(const char* path) {
+  const char* slash = strrchr(path, '/');
+
+  if (!slash)
+    glob_note_dir(".", 1);
+  else if (slash == path)
+    glob_note_dir("/", 1);
+  else
+    glob_note_dir(path, slash - path);
+}
+
+static void* glob_opendir(const char* dir) {
+  glob_note_dir(dir, strlen(dir));
+  return opendir(dir);
+}
+
+static int glob_lstat(const char* path, struct stat* st) {
+  glob_note_parent(path);
+  return lstat(path, st);
+}
+
+static int glob_stat(const char* path, struct stat* st) {
+  glob_note_parent(path);
+  return stat(path, st);
+}
+
+/* Checks a cached glob result, as written by payload_from_glob(): the records
+ * of the directories examined (see glob_note_dir()), an empty record, then the
+ * payload.
+ *
+ * Returns whether every directory is unchanged, storing the offset of the
+ * payload in *payload if so.
+ */
+static int glob_cache_valid(string cached, unsigned* payload) {
+  const byte* data = string_data(cached), * end;
+  unsigned off = 0;
+  long mtime;
+  unsigned long ino;
+  int consumed;
+  struct stat st;
+
+  while (off < cached->len) {
+    if (!(end = memchr(data+off, 0, cached->len - off)))
+      return 0;
+    if (end == data+off) {
+      *payload = off+1;
+      return 1;
+    }
+
+    if (2 != sscanf((const char*)data+off, "%ld %lu %n", &mtime, &ino,
+                    &consumed))
+      return 0;
+
+    if (stat((const char*)data+off+consumed, &st)) {
+      if (mtime != -1) return 0;
+    } else {
+      if (mtime != (long)st.st_mtime || ino != (unsigned long)st.st_ino)
+        return 0;
+    }
+
+    off = end+1 - data;
+  }
+
+  return 0;
+}
+#endif /* GLOB_ALTDIRFUNC */
+
 static int payload_from_glob(interpreter* interp) {
-  string sglob, payload;
+  string sglob, payload, key = NULL;
   char cglob[1024];
-  glob_t result = {0,0,0};
-  int status;
-  unsigned i;
+#ifdef GLOB_ALTDIRFUNC
+  string cached;
+  char cwd[1024];
+  char* argv[4];
+#endif
+  glob_t result;
+  int status, flags, cache = 0;
+  unsigned i, len;
+
+  if (interp->u[0])
+    cache = string_to_bool(interp->u[0]);
+  reset_secondary_args(interp);
 
   if (!(sglob = stack_pop(interp))) UNDERFLOW;
 
@@ -984,36 +3151,88 @@ static int payload_from_glob(interpreter* interp) {
   memcpy(cglob, string_data(sglob), sglob->len);
   cglob[sglob->len] = 0;
 
-  status = glob(cglob, 0
-                #ifdef GLOB_BRACE
-                | GLOB_BRACE
-                #endif
-                #ifdef GLOB_TILDE
-                | GLOB_TILDE
-                #endif
-                , NULL, &result);
+  memset(&result, 0, sizeof(result));
+  flags = 0
+#ifdef GLOB_BRACE
+    | GLOB_BRACE
+#endif
+#ifdef GLOB_TILDE
+    | GLOB_TILDE
+#endif
+    ;
+
+#ifdef GLOB_ALTDIRFUNC
+  /* The expansion is keyed by the pattern and the directory it is relative
+   * to, and is valid while none of the directories it examined change.
+   */
+  if (cache && getcwd(cwd, sizeof(cwd))) {
+    argv[0] = "glob";
+    argv[1] = cwd;
+    argv[2] = cglob;
+    argv[3] = NULL;
+    cached = empty_string();
+    key = cmdcache_key(argv, cached, NULL);
+    free(cached);
+
+    if (cmdcache_get(key, &cached, &status)) {
+      if (glob_cache_valid(cached, &i)) {
+        payload = create_string(string_data(cached) + i,
+                                string_data(cached) + cached->len);
+        free(cached);
+        free(key);
+        free(sglob);
+        set_payload(interp, payload);
+        payload_nul_delimited(interp);
+        return 1;
+      }
+      free(cached);
+    }
+
+    glob_dirs = empty_string();
+    glob_last_dir = NULL;
+    glob_cacheable = 1;
+    glob_started = time(NULL);
+    result.gl_opendir = glob_opendir;
+    result.gl_readdir = (void*)readdir;
+    result.gl_closedir = (void*)closedir;
+    result.gl_lstat = glob_lstat;
+    result.gl_stat = glob_stat;
+    flags |= GLOB_ALTDIRFUNC;
+  }
+#endif
+
+  status = glob(cglob, flags, NULL, &result);
 
   switch (status) {
   case GLOB_NOSPACE:
     print_error("Insufficient memory for glob results");
-    stack_push(interp, sglob);
-    return 0;
+    break;
 
   case GLOB_ABORTED:
     print_error("Read error while globbing");
-    stack_push(interp, sglob);
-    return 0;
+    break;
 
   case GLOB_NOMATCH:
     print_error_s("No matches for pattern", sglob);
-    stack_push(interp, sglob);
-    return 0;
+    break;
 
   case 0: break;
 
   default:
     fprintf(stderr, "tgl: error: glob: unexpected return code %d: %s\n",
             errno, strerror(errno));
+    break;
+  }
+
+  if (status) {
+#ifdef GLOB_ALTDIRFUNC
+    if (key) {
+      free(glob_dirs);
+      if (glob_last_dir) free(glob_last_dir);
+      free(key);
+    }
+#endif
+    globfree(&result);
     stack_push(interp, sglob);
     return 0;
   }
@@ -1021,17 +3240,34 @@ static int payload_from_glob(interpreter* interp) {
   /* Success */
   free(sglob);
 
-  payload = empty_string();
-
-  for (i = 0; i < result.gl_pathc; ++i)
-    /* Append the string as well as its term NUL */
-    payload = append_data(payload,
-                          result.gl_pathv[i],
-                          result.gl_pathv[i]+1+strlen(result.gl_pathv[i]));
+  /* Concatenate the names, separated by NULs, into one allocation */
+  for (i = 0, len = 0; i < result.gl_pathc; ++i)
+    len += strlen(result.gl_pathv[i]) + 1;
+  payload = tmalloc(sizeof(struct string) + len);
+  payload->len = 0;
+  for (i = 0; i < result.gl_pathc; ++i) {
+    len = strlen(result.gl_pathv[i]) + 1;
+    memcpy(string_data(payload) + payload->len, result.gl_pathv[i], len);
+    payload->len += len;
+  }
+  globfree(&result);
 
   /* Decrement length to remove any trailing NUL */
   if (payload->len) --payload->len;
 
+#ifdef GLOB_ALTDIRFUNC
+  if (key) {
+    if (glob_cacheable) {
+      glob_dirs = append_data(glob_dirs, "", ((char*)"")+1);
+      glob_dirs = append_string(glob_dirs, payload);
+      cmdcache_put(key, glob_dirs, 0);
+    }
+    free(glob_dirs);
+    if (glob_last_dir) free(glob_last_dir);
+    free(key);
+  }
+#endif
+
   /* Done */
   set_payload(interp, payload);
   payload_nul_delimited(interp);
@@ -1042,10 +3278,12 @@ static int payload_from_glob(interpreter* interp) {
  * implicit skipping needed.
  */
 static void set_payload(interpreter* interp, string payload) {
-  if (DATA)
-    free(interp->payload.data_base);
+  release_data(&interp->payload);
 
   interp->payload.data = interp->payload.data_base = payload;
+  interp->payload.data_map = NULL;
+  interp->payload.index_valid = interp->payload.brackets_valid = 0;
+  interp->payload.json_valid = 0;
   /* Implicit skipping */
   if (DATA->len) {
     if ((isspace(string_data(DATA)[0]) &&
@@ -1083,6 +3321,24 @@ static struct {
   { 'E', payload_each_kv },
   { 'f', payload_from_file },
   { 'F', payload_from_glob },
+  { 'v', payload_csv_delimited },
+  { 'V', payload_tsv_delimited },
+  { 'g', payload_field },
+  { 'G', payload_column },
+  { 'w', payload_each_record },
+  { 'j', payload_json_path },
+  { 'J', payload_json_each },
+  { 'X', payload_json_recurse },
+  { 'a', payload_aggregate_items },
+  { 'A', payload_aggregate_values },
+  { 'o', payload_sort_items },
+  { 'O', payload_sort_kv },
+  { 'm', payload_filter_items },
+  { 'M', payload_filter_kv },
+  { 'p', payload_keys },
+  { 'P', payload_values },
+  { 't', payload_take_items },
+  { 'T', payload_skip_items },
   {0,0},
 };
 
@@ -3,14 +3,29 @@
 #ifndef PAYLOAD_H_
 #define PAYLOAD_H_
 
+#include <stddef.h>
+
 #include "../tgl.h"
 #include "../strings.h"
+#include "../json.h"
 
 struct interpreter;
 
 /* Special values for payload delimiters. */
 #define PAYLOAD_WS_DELIM ((string)1)
 #define PAYLOAD_LINE_DELIM ((string)2)
+#define PAYLOAD_CSV_DELIM ((string)3)
+#define PAYLOAD_TSV_DELIM ((string)4)
+/* The separator character for PAYLOAD_CSV_DELIM or PAYLOAD_TSV_DELIM. */
+#define PAYLOAD_SEPARATOR(delim) ((delim) == PAYLOAD_CSV_DELIM? ',' : '\t')
+
+/* Bits of payload_data.borrowed_delims. */
+#define PAYLOAD_BORROWED_START 1
+#define PAYLOAD_BORROWED_VALUE 2
+#define PAYLOAD_BORROWED_OUTPUT_KV 4
+#define PAYLOAD_BORROWED_OUTPUT_V 8
+#define PAYLOAD_BORROWED_OUTPUT_KVS 16
+#define PAYLOAD_BORROWED_ALL 31
 
 /* Per-interpreter data used to maintain the payload state. */
 typedef struct payload_data {
@@ -18,16 +33,88 @@ typedef struct payload_data {
    * not owned by this object.
    */
   string data, global_code;
-  /* The free()able base pointer for data. */
+  /* The free()able base pointer for data, unless data_map is non-NULL. */
   string data_base;
+  /* If non-NULL, data lies within this region of data_map_size bytes, created
+   * with mmap() by ,f, which must be unmapped instead of freeing data_base.
+   * The first page of the region is anonymous memory holding the string
+   * header; the file is mapped privately after it. Pages before
+   * data_map_released have been released, as data has advanced past them.
+   */
+  void* data_map;
+  size_t data_map_size;
+  byte* data_map_released;
   /* Properties.
    * Note that delimiters might not be valid pointers; see PAYLOAD_LINE_DELIM
    * and PAYLOAD_WS_DELIM.
    */
   string data_start_delim, value_delim, output_kv_delim, output_v_delim,
     output_kvs_delim;
+  /* The delimiters above which belong to an enclosing payload, whose state
+   * was saved by ,x, rather than to this one, and so must not be freed, as
+   * PAYLOAD_BORROWED_* bits. Subordinate payloads borrow all of them, so that
+   * entering one copies nothing.
+   */
+  unsigned borrowed_delims;
   int balance_paren, balance_brack, balance_brace, balance_angle;
   int trim_paren, trim_brack, trim_brace, trim_angle, trim_space;
+  /* Index of the item boundaries in data, built on demand by ,i and ,I.
+   * Each item has two entries in index, the offsets of its beginning and end
+   * relative to index_origin; index_end is the end of the data indexed. Since
+   * data only ever advances towards index_end by whole items, the index stays
+   * usable as data advances. index_valid is cleared whenever the data or the
+   * properties affecting item boundaries change.
+   */
+  unsigned* index;
+  unsigned num_indexed, index_cap;
+  byte* index_origin, * index_end;
+  int index_valid;
+  /* For CSV and TSV payloads, the fields of each item (record) in index. The
+   * fields of item n are entries row_fields[n] up to row_fields[n+1] of
+   * fields, each of which has two entries in fields, the offsets of the
+   * beginning and end of the raw field relative to index_origin.
+   */
+  unsigned* row_fields, * fields;
+  unsigned num_fields, fields_cap;
+  /* Hash table from trimmed key to the entry number in index of the first
+   * item with that key, among the key/value pairs beginning at entry kv_base,
+   * built on demand by ,k. Slots hold entry numbers plus one (zero is empty).
+   * kv_next links each key item to the next one with the same key, or holds
+   * num_indexed. The table is valid while kv_valid is set, which is cleared
+   * whenever the index is rebuilt or the trim properties change.
+   */
+  unsigned* kv_table, * kv_next;
+  unsigned kv_table_size, kv_base;
+  int kv_valid;
+  /* Table of matching brackets, built incrementally as delimiter searches
+   * meet opening brackets, so that bracketed regions are skipped without
+   * rescanning or recursion. It covers the string which began at
+   * bracket_origin and ends at bracket_end, scanned so far up to offset
+   * bracket_scanned. Opening bracket number n, counting in order of position,
+   * has three entries from brackets[3*(n-bracket_first)]: its offset from
+   * bracket_origin, the offset of its closing bracket (that of bracket_end if
+   * unmatched, or ~0u if not yet found), and the number of the first bracket
+   * after that. Brackets before bracket_first have been discarded, as the
+   * string has advanced past them. bracket_stack holds the number and closing
+   * character of each bracket open at bracket_scanned; bracket_hint is the
+   * bracket most likely to be looked up next. brackets_valid is cleared
+   * whenever the data or the balance properties change.
+   */
+  unsigned* brackets, * bracket_stack;
+  unsigned num_brackets, bracket_first, brackets_cap;
+  unsigned bracket_depth, bracket_stack_cap;
+  unsigned bracket_scanned, bracket_hint;
+  byte* bracket_origin, * bracket_end;
+  int brackets_valid;
+  /* The data parsed as a JSON document, built on demand by the JSON commands.
+   * It describes the json_len bytes at json_origin, and is valid while
+   * json_valid is set and the data still begins there with that length;
+   * json_valid is cleared whenever the data is replaced.
+   */
+  json_tape json;
+  byte* json_origin;
+  unsigned json_len;
+  int json_valid;
 } payload_data;
 
 /* Initialises the given payload data to defaults. */
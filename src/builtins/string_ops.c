@@ -21,6 +21,7 @@ int builtin_print(interpreter* interp) {
   if (!(str = stack_pop(interp))) UNDERFLOW;
 
   fwrite(string_data(str), str->len, 1, stdout);
+  total_bytes_written += str->len;
   if (ferror(stdout)) {
     free(str);
     print_error(strerror(errno));
@@ -0,0 +1,258 @@
+/* Implementation of the command result cache. See cmdcache.h. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "tgl.h"
+#include "strings.h"
+#include "cmdcache.h"
+
+char* command_cache_dir;
+unsigned long command_cache_size;
+int cache_all_commands;
+
+/* Each cache file begins with this magic, followed by the exit status, the key
+ * length and the output length, as 32-bit big-endian integers, then the key
+ * and the output.
+ */
+static const byte cache_magic[4] = { 'T', 'g', 'l', 'C' };
+#define HEADER_SIZE 16
+
+/* Cache file names are this many hex digits. */
+#define NAME_LEN 16
+
+/* Appends a 32-bit big-endian integer to the given string. */
+static string append_u32(string str, unsigned value) {
+  byte buf[4];
+  unsigned i;
+
+  for (i = 0; i < 4; ++i)
+    buf[i] = value >> (24 - 8*i);
+  return append_data(str, buf, buf+4);
+}
+
+/* Decodes a 32-bit big-endian integer. */
+static unsigned decode_u32(const byte* data) {
+  return ((unsigned)data[0] << 24) | ((unsigned)data[1] << 16) |
+         ((unsigned)data[2] << 8) | data[3];
+}
+
+/* Appends a length-prefixed string to the given string. */
+static string append_field(string str, void* data, unsigned len) {
+  str = append_u32(str, len);
+  return append_data(str, data, ((byte*)data) + len);
+}
+
+string cmdcache_key(char** argv, string tag, string input) {
+  string key = empty_string();
+  unsigned argc;
+
+  for (argc = 0; argv[argc]; ++argc);
+  key = append_u32(key, argc);
+  for (argc = 0; argv[argc]; ++argc)
+    key = append_field(key, argv[argc], strlen(argv[argc]));
+  key = append_field(key, string_data(tag), tag->len);
+  if (input)
+    key = append_field(key, string_data(input), input->len);
+  else
+    key = append_u32(key, 0);
+
+  return key;
+}
+
+/* Writes the path of the cache file for the given key into dst, which must be
+ * large enough. The name is two differently seeded FNV-1a hashes of the key.
+ */
+static void cache_path(char* dst, size_t size, string key) {
+  unsigned a = 2166136261u, b = 84696351u, i;
+  byte* data = string_data(key);
+
+  for (i = 0; i < key->len; ++i) {
+    a ^= data[i];
+    a *= 16777619u;
+    b ^= data[i];
+    b *= 16777619u;
+  }
+
+  snprintf(dst, size, "%s/%08x%08x", command_cache_dir, a, b);
+}
+
+int cmdcache_get(string key, string* output, int* status) {
+  char path[1024];
+  struct stat st;
+  byte* data;
+  unsigned status_raw, key_len, output_len, off;
+  ssize_t amt;
+  int fd, ok = 0;
+
+  cache_path(path, sizeof(path), key);
+  if (-1 == (fd = open(path, O_RDONLY)))
+    return 0;
+
+  if (fstat(fd, &st) || st.st_size < HEADER_SIZE + key->len) {
+    close(fd);
+    return 0;
+  }
+
+  data = tmalloc(st.st_size);
+  for (off = 0; off < st.st_size; off += amt) {
+    amt = read(fd, data+off, st.st_size - off);
+    if (amt == -1 && errno == EINTR) amt = 0;
+    else if (amt <= 0) goto done;
+  }
+  total_bytes_read += st.st_size;
+
+  status_raw = decode_u32(data+4);
+  key_len = decode_u32(data+8);
+  output_len = decode_u32(data+12);
+  if (memcmp(data, cache_magic, sizeof(cache_magic)) ||
+      key_len != key->len ||
+      HEADER_SIZE + (unsigned long)key_len + output_len !=
+        (unsigned long)st.st_size ||
+      memcmp(data+HEADER_SIZE, string_data(key), key_len))
+    goto done;
+
+  *output = create_string(data+HEADER_SIZE+key_len,
+                          data+HEADER_SIZE+key_len+output_len);
+  *status = (int)status_raw;
+  ok = 1;
+
+  /* Mark the result as recently used. */
+  utime(path, NULL);
+
+  done:
+  free(data);
+  close(fd);
+  return ok;
+}
+
+/* A file in the cache directory, for eviction. */
+typedef struct cache_file {
+  char name[NAME_LEN+1];
+  time_t mtime;
+  unsigned long size;
+} cache_file;
+
+static int compare_cache_files(const void* va, const void* vb) {
+  const cache_file* a = va, * b = vb;
+
+  return (a->mtime > b->mtime) - (a->mtime < b->mtime);
+}
+
+/* The size of the cache directory as of the last scan, plus the sizes of the
+ * results written since, if size_scanned is non-zero. Results written
+ * by other processes or replacing older ones are not accounted for, so this is
+ * only an estimate, used to avoid scanning the directory on every store.
+ */
+static unsigned long estimated_size;
+static int size_scanned;
+
+/* Deletes the least recently used results until the cache is down to three
+ * quarters of its limit, if it is over the limit. Updates estimated_size with
+ * the resulting size.
+ */
+static void evict(void) {
+  DIR* dir;
+  struct dirent* ent;
+  struct stat st;
+  char path[1024];
+  cache_file* files = NULL;
+  unsigned num_files = 0, cap = 0, i;
+  unsigned long total = 0;
+
+  if (!(dir = opendir(command_cache_dir)))
+    return;
+
+  while ((ent = readdir(dir))) {
+    if (strlen(ent->d_name) != NAME_LEN ||
+        strspn(ent->d_name, "0123456789abcdef") != NAME_LEN)
+      continue;
+
+    snprintf(path, sizeof(path), "%s/%s", command_cache_dir, ent->d_name);
+    if (stat(path, &st) || !S_ISREG(st.st_mode))
+      continue;
+
+    if (num_files == cap) {
+      cap = cap? cap*2 : 64;
+      files = trealloc(files, sizeof(cache_file) * cap);
+    }
+    strcpy(files[num_files].name, ent->d_name);
+    files[num_files].mtime = st.st_mtime;
+    files[num_files].size = st.st_size;
+    total += st.st_size;
+    ++num_files;
+  }
+  closedir(dir);
+
+  if (total > command_cache_size) {
+    qsort(files, num_files, sizeof(cache_file), compare_cache_files);
+    for (i = 0; i < num_files && total > command_cache_size / 4 * 3; ++i) {
+      snprintf(path, sizeof(path), "%s/%s", command_cache_dir, files[i].name);
+      if (!unlink(path))
+        total -= files[i].size;
+    }
+  }
+
+  if (files) free(files);
+  estimated_size = total;
+  size_scanned = 1;
+}
+
+void cmdcache_put(string key, string output, int status) {
+  char path[1024], temp[1056];
+  string contents;
+  int fd, ok;
+
+  if (mkdir(command_cache_dir, 0777) && errno != EEXIST) {
+    fprintf(stderr, "tgl: warning: could not create %s: %s\n",
+            command_cache_dir, strerror(errno));
+    return;
+  }
+
+  contents = tmalloc(sizeof(struct string) + HEADER_SIZE);
+  memcpy(string_data(contents), cache_magic, sizeof(cache_magic));
+  contents->len = sizeof(cache_magic);
+  contents = append_u32(contents, (unsigned)status);
+  contents = append_u32(contents, key->len);
+  contents = append_u32(contents, output->len);
+  contents = append_string(contents, key);
+  contents = append_string(contents, output);
+
+  /* Write to a temporary file first so that readers never see a partial
+   * result.
+   */
+  cache_path(path, sizeof(path), key);
+  snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid());
+  fd = open(temp, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  ok = (-1 != fd &&
+        contents->len == write(fd, string_data(contents), contents->len));
+  if (-1 != fd && close(fd)) ok = 0;
+  if (ok && rename(temp, path)) ok = 0;
+
+  if (ok) {
+    total_bytes_written += contents->len;
+  } else {
+    fprintf(stderr, "tgl: warning: could not write %s: %s\n",
+            path, strerror(errno));
+    if (-1 != fd)
+      unlink(temp);
+  }
+
+  /* Only scan the directory once the cache may have outgrown its limit. */
+  if (!size_scanned || (ok && (estimated_size += contents->len) >
+                                 command_cache_size))
+    evict();
+  free(contents);
+}
@@ -0,0 +1,42 @@
+/* Contains functions for caching the results of external commands on disk.
+ *
+ * Each cached result is keyed by the argument vector of the command, its
+ * input and a user-supplied version tag. Results are stored one per file in
+ * the cache directory (by default ~/.tgl_cache), named by a hash of the key;
+ * each file also holds the full key, so that hash collisions only cause
+ * misses. Whenever a result is added and the total size of the directory
+ * may exceed command_cache_size, the directory is scanned and the least
+ * recently used results are deleted until it no longer does.
+ */
+#ifndef CMDCACHE_H_
+#define CMDCACHE_H_
+
+#include "strings.h"
+
+/* The directory in which results are cached. */
+extern char* command_cache_dir;
+/* The size in bytes to which the cache directory is limited. */
+extern unsigned long command_cache_size;
+/* If non-zero, all external commands are cached, not just those requesting
+ * it.
+ */
+extern int cache_all_commands;
+
+/* Returns a new string holding the cache key for the given NULL-terminated
+ * argument vector, tag and input (which may be NULL).
+ */
+string cmdcache_key(char** argv, string tag, string input);
+
+/* Looks the given key up in the cache.
+ *
+ * Returns 1 on a hit, in which case the output and exit status of the command
+ * are stored in *output and *status. Returns 0 on a miss.
+ */
+int cmdcache_get(string key, string* output, int* status);
+
+/* Stores the given output and exit status under the given key, then evicts old
+ * results if the cache has grown too large. Errors are reported as warnings.
+ */
+void cmdcache_put(string key, string output, int status);
+
+#endif /* CMDCACHE_H_ */
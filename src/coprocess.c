@@ -0,0 +1,329 @@
+/* Implementation of helper processes. See coprocess.h. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include "tgl.h"
+#include "strings.h"
+#include "process.h"
+#include "coprocess.h"
+#include "timing.h"
+
+/* The number of times a helper may fail before it is no longer restarted. */
+#define MAX_HELPER_FAILURES 3
+
+/* Driver for perl, run with -e. tgl_run() is defined before anything else so
+ * that the script cannot see the driver's lexicals.
+ */
+static char perl_driver[] =
+  "sub tgl_run { @_ = (); eval $TGL::code }\n"
+  "open(my $req, '<&', \\*STDIN) or die $!;\n"
+  "open(my $resp, '>&', \\*STDOUT) or die $!;\n"
+  "open(STDIN, '<', '/dev/null');\n"
+  "open(STDOUT, '>&', \\*STDERR);\n"
+  "binmode $req; binmode $resp;\n"
+  "select((select($resp), $| = 1)[0]);\n"
+  "*CORE::GLOBAL::exit = sub { die bless [@_? $_[0] : 0], 'TGL::Exit' };\n"
+  "sub readn {\n"
+  "  my ($n, $buf) = (shift, '');\n"
+  "  while (length($buf) < $n) {\n"
+  "    my $r = read($req, $buf, $n - length($buf), length($buf));\n"
+  "    exit 0 unless $r;\n"
+  "  }\n"
+  "  $buf\n"
+  "}\n"
+  "my $count = 0;\n"
+  "while (1) {\n"
+  "  my ($slen, $ilen) = unpack('NN', readn(8));\n"
+  "  $TGL::code = 'package TGL::Script' . ++$count\n"
+  "    . \"; use feature ':5.10'; no strict;\\n#line 1 \\\"-e\\\"\\n\"\n"
+  "    . readn($slen) . \"\\n;1\";\n"
+  "  my $input = readn($ilen);\n"
+  "  my ($output, $status) = ('', 0);\n"
+  "  {\n"
+  "    local ($/, $,, $\\, $0) = (\"\\n\", undef, undef, '-e');\n"
+  "    open(local *STDIN, '<', \\$input) or die $!;\n"
+  "    open(local *STDOUT, '>', \\$output) or die $!;\n"
+  "    my $old = select STDOUT;\n"
+  "    if (!tgl_run()) {\n"
+  "      if (ref($@) eq 'TGL::Exit') { $status = $@->[0] }\n"
+  "      else { print STDERR $@; $status = 255 }\n"
+  "    }\n"
+  "    select $old;\n"
+  "    close STDOUT;\n"
+  "  }\n"
+  "  print $resp pack('NN', $status & 0xFFFFFFFF, length($output)), $output;\n"
+  "}\n";
+
+/* Driver for tclsh, read from PROCESS_SCRIPT_FD. The prelude is evaluated in
+ * every child interpreter before the script.
+ */
+static char tcl_driver[] =
+  "fconfigure stdin -translation binary\n"
+  "fconfigure stdout -translation binary\n"
+  "set tgl_prelude {\n"
+  "  foreach tgl_cmd {puts read gets eof exit} {\n"
+  "    rename $tgl_cmd tgl_real_$tgl_cmd\n"
+  "  }\n"
+  "  proc puts {args} {\n"
+  "    set nonl [expr {[lindex $args 0] eq {-nonewline}}]\n"
+  "    set rest [lrange $args $nonl end]\n"
+  "    if {[llength $rest] == 2 && [lindex $rest 0] ne {stdout}} {\n"
+  "      return [tgl_real_puts {*}$args]\n"
+  "    }\n"
+  "    if {[llength $rest] < 1 || [llength $rest] > 2} {\n"
+  "      return -code error {wrong # args: should be\n"
+  "        \"puts ?-nonewline? ?channelId? string\"}\n"
+  "    }\n"
+  "    append ::tgl_out [lindex $rest end]\n"
+  "    if {!$nonl} { append ::tgl_out \\n }\n"
+  "  }\n"
+  "  proc read {args} {\n"
+  "    set nonl [expr {[lindex $args 0] eq {-nonewline}}]\n"
+  "    set rest [lrange $args $nonl end]\n"
+  "    if {[lindex $rest 0] ne {stdin}} {\n"
+  "      return [tgl_real_read {*}$args]\n"
+  "    }\n"
+  "    set data [string range $::tgl_in $::tgl_inpos end]\n"
+  "    if {[llength $rest] == 2} {\n"
+  "      set data [string range $data 0 [expr {[lindex $rest 1] - 1}]]\n"
+  "    }\n"
+  "    incr ::tgl_inpos [string length $data]\n"
+  "    if {$nonl && [string index $data end] eq \"\\n\"} {\n"
+  "      set data [string range $data 0 end-1]\n"
+  "    }\n"
+  "    return $data\n"
+  "  }\n"
+  "  proc gets {chan args} {\n"
+  "    if {$chan ne {stdin}} {\n"
+  "      if {[llength $args]} { upvar 1 [lindex $args 0] line }\n"
+  "      return [tgl_real_gets $chan {*}[expr {[llength $args]? {line}:{}}]]\n"
+  "    }\n"
+  "    if {$::tgl_inpos >= [string length $::tgl_in]} {\n"
+  "      set line {}\n"
+  "      set len -1\n"
+  "    } else {\n"
+  "      set nl [string first \\n $::tgl_in $::tgl_inpos]\n"
+  "      if {$nl < 0} { set nl [string length $::tgl_in] }\n"
+  "      set line [string range $::tgl_in $::tgl_inpos [expr {$nl - 1}]]\n"
+  "      set ::tgl_inpos [expr {$nl + 1}]\n"
+  "      set len [string length $line]\n"
+  "    }\n"
+  "    if {[llength $args]} {\n"
+  "      upvar 1 [lindex $args 0] var\n"
+  "      set var $line\n"
+  "      return $len\n"
+  "    }\n"
+  "    return $line\n"
+  "  }\n"
+  "  proc eof {chan} {\n"
+  "    if {$chan ne {stdin}} { return [tgl_real_eof $chan] }\n"
+  "    expr {$::tgl_inpos >= [string length $::tgl_in]}\n"
+  "  }\n"
+  "  proc exit {{code 0}} {\n"
+  "    return -code error -errorcode [list TGL_EXIT $code] exit\n"
+  "  }\n"
+  "  set argv {}\n"
+  "  set argc 0\n"
+  "  set argv0 tclsh\n"
+  "}\n"
+  "proc tgl_readn {n} {\n"
+  "  set data [read stdin $n]\n"
+  "  if {[string length $data] != $n} { exit 0 }\n"
+  "  return $data\n"
+  "}\n"
+  "while 1 {\n"
+  "  binary scan [tgl_readn 8] II slen ilen\n"
+  "  set script [encoding convertfrom [encoding system] [tgl_readn $slen]]\n"
+  "  set input [encoding convertfrom [encoding system] [tgl_readn $ilen]]\n"
+  "  set slave [interp create]\n"
+  "  $slave eval $tgl_prelude\n"
+  "  $slave eval [list set ::tgl_in [string map {\\r\\n \\n} $input]]\n"
+  "  $slave eval {set ::tgl_inpos 0; set ::tgl_out {}}\n"
+  "  set status 0\n"
+  "  if {[catch {$slave eval $script} msg opts]} {\n"
+  "    set code [dict get $opts -errorcode]\n"
+  "    if {[lindex $code 0] eq {TGL_EXIT}} {\n"
+  "      set status [lindex $code 1]\n"
+  "    } else {\n"
+  "      puts stderr [dict get $opts -errorinfo]\n"
+  "      set status 1\n"
+  "    }\n"
+  "  }\n"
+  "  set out [$slave eval {set ::tgl_out}]\n"
+  "  set out [encoding convertto [encoding system] $out]\n"
+  "  interp delete $slave\n"
+  "  puts -nonewline [binary format II $status [string length $out]]$out\n"
+  "  flush stdout\n"
+  "}\n";
+
+/* The state of the helper for each language. */
+static process helpers[NUM_COPROCESS_LANGUAGES];
+static int helper_running[NUM_COPROCESS_LANGUAGES];
+static unsigned helper_failures[NUM_COPROCESS_LANGUAGES];
+
+/* Writes exactly len bytes to the given file descriptor.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int write_fully(int fd, const void* data, unsigned len) {
+  ssize_t amt;
+
+  total_bytes_written += len;
+  while (len) {
+    amt = write(fd, data, len);
+    if (amt == -1 && errno == EINTR) continue;
+    if (amt <= 0) return 0;
+    data = ((const byte*)data) + amt;
+    len -= amt;
+  }
+  return 1;
+}
+
+/* Reads exactly len bytes from the given file descriptor.
+ *
+ * Returns 1 on success, 0 on error or EOF.
+ */
+static int read_fully(int fd, void* data, unsigned len) {
+  ssize_t amt;
+
+  total_bytes_read += len;
+  while (len) {
+    amt = read(fd, data, len);
+    if (amt == -1 && errno == EINTR) continue;
+    if (amt <= 0) return 0;
+    data = ((byte*)data) + amt;
+    len -= amt;
+  }
+  return 1;
+}
+
+/* Encodes two 32-bit integers big-endian into the given buffer. */
+static void encode_header(byte header[8], unsigned a, unsigned b) {
+  unsigned i;
+
+  for (i = 0; i < 4; ++i) {
+    header[i]   = a >> (24 - 8*i);
+    header[4+i] = b >> (24 - 8*i);
+  }
+}
+
+/* Decodes two 32-bit integers big-endian from the given buffer. */
+static void decode_header(const byte header[8], unsigned* a, unsigned* b) {
+  unsigned i;
+
+  *a = *b = 0;
+  for (i = 0; i < 4; ++i) {
+    *a = (*a << 8) | header[i];
+    *b = (*b << 8) | header[4+i];
+  }
+}
+
+/* Starts the helper for the given language.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int start_helper(coprocess_language lang, const char* argv0) {
+  char* argv[4];
+
+  argv[0] = (char*)argv0;
+  switch (lang) {
+  case COPROCESS_PERL:
+    argv[1] = "-e";
+    argv[2] = perl_driver;
+    argv[3] = NULL;
+    if (!process_spawn(&helpers[lang], argv, 0))
+      return 0;
+    break;
+
+  case COPROCESS_TCL:
+    if (access("/dev/fd", X_OK))
+      return 0;
+    argv[1] = "/dev/fd/3";
+    argv[2] = NULL;
+    if (!process_spawn(&helpers[lang], argv, 1))
+      return 0;
+    if (!write_fully(helpers[lang].script_fd, tcl_driver,
+                     sizeof(tcl_driver)-1)) {
+      process_abandon(&helpers[lang]);
+      return 0;
+    }
+    close(helpers[lang].script_fd);
+    helpers[lang].script_fd = -1;
+    break;
+
+  default: return 0;
+  }
+
+  helper_running[lang] = 1;
+  return 1;
+}
+
+int coprocess_eval(coprocess_language lang, const char* argv0,
+                   string script, string input,
+                   string* output, int* status) {
+  byte header[8];
+  unsigned raw_status, len;
+  process* helper = &helpers[lang];
+  struct timespec begin;
+  double spawn = 0;
+  char name[256];
+
+  if (!getenv("TGL_COPROCESS") || !*getenv("TGL_COPROCESS") ||
+      helper_failures[lang] >= MAX_HELPER_FAILURES)
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  if (!helper_running[lang]) {
+    if (!start_helper(lang, argv0))
+      goto failed;
+    spawn = helper->spawn_time;
+  }
+
+  encode_header(header, script->len, input->len);
+  if (!write_fully(helper->input_fd, header, sizeof(header)) ||
+      !write_fully(helper->input_fd, string_data(script), script->len) ||
+      !write_fully(helper->input_fd, string_data(input), input->len) ||
+      !read_fully(helper->output_fd, header, sizeof(header)))
+    goto failed;
+
+  decode_header(header, &raw_status, &len);
+  *output = tmalloc(sizeof(struct string) + len);
+  (*output)->len = len;
+  if (!read_fully(helper->output_fd, string_data(*output), len)) {
+    free(*output);
+    goto failed;
+  }
+
+  *status = (int)raw_status;
+  snprintf(name, sizeof(name), "%s (helper)", argv0);
+  timing_process(name, spawn, timing_since(&begin), timing_since(&begin),
+                 script->len + input->len, len);
+  return 1;
+
+  failed:
+  fprintf(stderr, "tgl: warning: %s helper failed; running script directly\n",
+          argv0);
+  if (helper_running[lang])
+    process_abandon(helper);
+  helper_running[lang] = 0;
+  ++helper_failures[lang];
+  return 0;
+}
+
+void coprocess_forget(void) {
+  unsigned lang;
+
+  for (lang = 0; lang < NUM_COPROCESS_LANGUAGES; ++lang) {
+    if (helper_running[lang])
+      process_forget(&helpers[lang]);
+    helper_running[lang] = 0;
+  }
+}
@@ -0,0 +1,53 @@
+/* Contains functions for evaluating scripts in long-lived helper processes.
+ *
+ * When the environment variable TGL_COPROCESS is set to a non-empty value, the
+ * perl and tcl builtins do not start a new interpreter for every call.
+ * Instead, one helper per language is started on first use, running a small
+ * driver script built into TGL, and each call is sent to it as a request.
+ *
+ * Requests and responses are framed as follows, all integers being 32-bit and
+ * big-endian:
+ *   Request:  script length, input length, script, input
+ *   Response: exit status (-1 for abnormal termination), output length, output
+ *
+ * The perl driver compiles each script into a package of its own, with STDIN
+ * and STDOUT bound to the request and exit redirected so that it does not end
+ * the helper. The tcl driver evaluates each script in a fresh child
+ * interpreter in which puts, read, gets and eof on the standard channels, and
+ * exit, are redirected likewise. In both cases, child processes of the script
+ * see /dev/null as standard input and write their standard output to TGL's
+ * standard error.
+ *
+ * If a helper cannot be started or dies, the call is reported as not handled
+ * so that the caller can fall back to starting a process for it; the helper is
+ * restarted on the next call, unless it has failed too many times.
+ */
+#ifndef COPROCESS_H_
+#define COPROCESS_H_
+
+#include "strings.h"
+
+/* The languages for which helpers are supported. */
+typedef enum coprocess_language {
+  COPROCESS_PERL = 0,
+  COPROCESS_TCL,
+  NUM_COPROCESS_LANGUAGES
+} coprocess_language;
+
+/* Evaluates the given script with the given input in the helper for the given
+ * language, whose program is named by argv0.
+ *
+ * Returns 1 if the script was evaluated, in which case its output and exit
+ * status are stored in *output and *status. Returns 0 if helpers are disabled
+ * or the helper failed, in which case the caller should run the script itself.
+ */
+int coprocess_eval(coprocess_language, const char* argv0,
+                   string script, string input,
+                   string* output, int* status);
+
+/* Forgets the helpers inherited by a forked copy of TGL, without disturbing
+ * them, so that the copy starts its own if it needs any.
+ */
+void coprocess_forget(void);
+
+#endif /* COPROCESS_H_ */
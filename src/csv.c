@@ -0,0 +1,106 @@
+/* Implementation of CSV parsing. See csv.h. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "tgl.h"
+#include "strings.h"
+#include "scan.h"
+#include "csv.h"
+
+int csv_scan_record(const byte* data, unsigned len, unsigned off, byte sep,
+                    unsigned* end, unsigned* next,
+                    unsigned** fields, unsigned* num, unsigned* cap) {
+  /* The bytes which end an unquoted field, for the last separator used. */
+  static scan_set stops;
+  static int stops_sep = -1;
+  const byte* quote;
+  unsigned pos = off, begin;
+
+  if (stops_sep != sep) {
+    scan_set_init(&stops);
+    scan_set_add(&stops, sep);
+    scan_set_add(&stops, '\n');
+    scan_set_add(&stops, '\r');
+    stops_sep = sep;
+  }
+
+  for (;;) {
+    begin = pos;
+    if (pos < len && data[pos] == '"') {
+      /* Find the closing quote, passing over doubled ones. */
+      for (++pos; pos < len; pos += 2) {
+        if (!(quote = memchr(data+pos, '"', len-pos))) {
+          pos = len;
+          break;
+        }
+        pos = quote - data;
+        if (pos+1 >= len || data[pos+1] != '"') {
+          ++pos;
+          break;
+        }
+      }
+    }
+
+    /* The rest of the field */
+    pos += scan_for(&stops, data+pos, len-pos);
+    if (fields) {
+      if (*num == *cap) {
+        *cap = *cap? *cap*2 : 64;
+        *fields = trealloc(*fields, 2 * sizeof(unsigned) * *cap);
+      }
+      (*fields)[2 * *num] = begin;
+      (*fields)[2 * *num + 1] = pos;
+      ++*num;
+    }
+
+    if (pos == len) {
+      *end = *next = len;
+      return 0;
+    }
+    if (data[pos] != sep)
+      break;
+    ++pos;
+  }
+
+  /* Line break */
+  *end = pos;
+  *next = pos + (data[pos] == '\r' && pos+1 < len && data[pos+1] == '\n'?
+                 2 : 1);
+  return 1;
+}
+
+string csv_field_value(const byte* begin, const byte* end) {
+  string value;
+  const byte* in;
+  byte* out;
+
+  if (begin == end || *begin != '"')
+    return create_string((void*)begin, (void*)end);
+
+  value = tmalloc(sizeof(struct string) + (end - begin));
+  out = string_data(value);
+  for (in = begin+1; in < end; ++in) {
+    if (*in == '"') {
+      if (in+1 < end && in[1] == '"') {
+        *out++ = '"';
+        ++in;
+        continue;
+      }
+
+      /* Closing quote; keep anything after it. */
+      ++in;
+      memcpy(out, in, end - in);
+      out += end - in;
+      break;
+    }
+
+    *out++ = *in;
+  }
+
+  value->len = out - string_data(value);
+  return value;
+}
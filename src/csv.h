@@ -0,0 +1,35 @@
+/* Contains functions for parsing comma- and tab-separated values.
+ *
+ * Records follow RFC 4180: fields are separated by the separator character,
+ * and records by line breaks (LF, CR LF or a lone CR). A field beginning with a
+ * double quote extends to the matching closing quote, and may contain
+ * separators, line breaks and doubled quotes, which stand for one quote. This
+ * parser is lenient: anything between a closing quote and the next separator
+ * is kept as part of the field, and quotes within unquoted fields are literal.
+ */
+#ifndef CSV_H_
+#define CSV_H_
+
+#include "tgl.h"
+#include "strings.h"
+
+/* Finds the end of the record beginning at offset off of data, of length len,
+ * whose fields are separated by sep.
+ *
+ * If fields is non-NULL, the offsets of the beginning and end of each raw
+ * field of the record are appended as pairs to *fields, which holds *num
+ * pairs and has room for *cap, reallocating it as needed.
+ *
+ * Stores the offset of the end of the record in *end, and of the beginning of
+ * the next one in *next. Returns whether the record ends with a line break.
+ */
+int csv_scan_record(const byte* data, unsigned len, unsigned off, byte sep,
+                    unsigned* end, unsigned* next,
+                    unsigned** fields, unsigned* num, unsigned* cap);
+
+/* Returns a new string holding the value of the raw field between begin and
+ * end, with any quoting removed.
+ */
+string csv_field_value(const byte* begin, const byte* end);
+
+#endif /* CSV_H_ */
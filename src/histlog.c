@@ -0,0 +1,354 @@
+/* Implementation of the history log. See histlog.h. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "tgl.h"
+#include "strings.h"
+#include "interp.h"
+#include "histlog.h"
+
+char* history_log_file;
+unsigned history_depth;
+
+/* Magic bytes at the beginning of the history index file. */
+static const byte history_index_magic[8] = {
+  'T', 'g', 'l', 'H', sizeof(unsigned), 0, 0, 0,
+};
+
+/* The format of the history index file is as follows:
+ *   8 bytes: TglH<size of unsigned> 0 0 0
+ *   unsigned[]: The offset of the end of each entry in the log, oldest first.
+ *     Each entry begins where the previous one ended; the first begins at
+ *     offset 0.
+ */
+
+/* The mapped log and index, once loaded by histlog_get(). */
+static int history_loaded;
+static const byte* log_data;
+static unsigned log_length;
+static const unsigned* entry_ends;
+static unsigned entry_count;
+
+/* Returns a newly-allocated string holding the filename of the history index.
+ */
+static char* index_filename(void) {
+  char* filename = tmalloc(strlen(history_log_file) + sizeof(".idx"));
+  strcpy(filename, history_log_file);
+  strcat(filename, ".idx");
+  return filename;
+}
+
+/* Maps the given file for reading, storing its length in *length.
+ *
+ * Returns the mapped data, or NULL if the file is empty or does not exist. On
+ * other errors, a diagnostic is printed and NULL is returned.
+ */
+static const void* map_file(const char* filename, unsigned* length) {
+  struct stat st;
+  void* map;
+  int fd;
+
+  *length = 0;
+  fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    if (errno != ENOENT)
+      fprintf(stderr, "tgl: error opening %s: %s\n",
+              filename, strerror(errno));
+    return NULL;
+  }
+
+  if (fstat(fd, &st)) {
+    fprintf(stderr, "tgl: error: stat %s: %s\n", filename, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  if (!st.st_size || st.st_size != (unsigned)st.st_size) {
+    if (st.st_size)
+      fprintf(stderr, "tgl: %s is too large\n", filename);
+    close(fd);
+    return NULL;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "tgl: error: mmap %s: %s\n", filename, strerror(errno));
+    return NULL;
+  }
+
+  *length = st.st_size;
+  return map;
+}
+
+/* Maps the history log and its index, if not done already. */
+static void load_history(void) {
+  const byte* index;
+  unsigned index_length;
+  char* filename;
+
+  if (history_loaded) return;
+  history_loaded = 1;
+
+  filename = index_filename();
+  index = map_file(filename, &index_length);
+  if (index && (index_length < sizeof(history_index_magic) ||
+                memcmp(index, history_index_magic,
+                       sizeof(history_index_magic)))) {
+    fprintf(stderr, "tgl: history index %s is incompatible\n", filename);
+    index = NULL;
+  }
+  free(filename);
+  if (!index) return;
+
+  entry_ends = (const unsigned*)(index + sizeof(history_index_magic));
+  entry_count = (index_length - sizeof(history_index_magic)) /
+                sizeof(unsigned);
+  log_data = map_file(history_log_file, &log_length);
+}
+
+string histlog_get(unsigned offset) {
+  unsigned i, begin, end;
+
+  load_history();
+  if (offset >= entry_count) return NULL;
+
+  i = entry_count - 1 - offset;
+  begin = i? entry_ends[i-1] : 0;
+  end = entry_ends[i];
+  if (begin > end || end > log_length) {
+    fprintf(stderr, "tgl: history log %s is inconsistent with its index\n",
+            history_log_file);
+    return NULL;
+  }
+
+  total_bytes_read += end - begin;
+  return create_string((byte*)log_data + begin, (byte*)log_data + end);
+}
+
+/* Writes all of the given data to the given file descriptor at the given
+ * offset.
+ *
+ * Returns 1 on success, 0 on error (with errno set).
+ */
+static int write_all(int fd, const void* data, unsigned len, off_t offset) {
+  ssize_t amt;
+
+  total_bytes_written += len;
+  while (len) {
+    amt = pwrite(fd, data, len, offset);
+    if (amt <= 0) {
+      if (!amt) errno = EIO;
+      return 0;
+    }
+    data = ((const byte*)data) + amt;
+    len -= amt;
+    offset += amt;
+  }
+
+  return 1;
+}
+
+/* Reads exactly len bytes from the given file descriptor at the given offset.
+ *
+ * Returns 1 on success, 0 on error (with errno set).
+ */
+static int read_all(int fd, void* data, unsigned len, off_t offset) {
+  ssize_t amt;
+
+  total_bytes_read += len;
+  while (len) {
+    amt = pread(fd, data, len, offset);
+    if (amt <= 0) {
+      if (!amt) errno = EIO;
+      return 0;
+    }
+    data = ((byte*)data) + amt;
+    len -= amt;
+    offset += amt;
+  }
+
+  return 1;
+}
+
+/* Rewrites the history log and index so that they contain only the most
+ * recent history_depth-1 of the count existing entries, followed by the given
+ * new entry.
+ *
+ * Returns 1 on success, 0 on error (with errno set).
+ */
+static int compact_history(int log_fd, int index_fd, unsigned count,
+                           string entry) {
+  unsigned first, begin, end, i, * ends = NULL;
+  byte* data = NULL;
+  char* index_name, * new_log_name, * new_index_name;
+  int new_log = -1, new_index = -1, ok = 0;
+
+  first = count > history_depth - 1? count - (history_depth - 1) : 0;
+  ends = tmalloc((count - first + 1) * sizeof(unsigned) + 1);
+  if (!read_all(index_fd, ends, (count - first) * sizeof(unsigned),
+                sizeof(history_index_magic) + first * sizeof(unsigned)))
+    goto done;
+  begin = 0;
+  if (first && !read_all(index_fd, &begin, sizeof(unsigned),
+                         sizeof(history_index_magic) +
+                         (first-1) * sizeof(unsigned)))
+    goto done;
+  end = count > first? ends[count - first - 1] : begin;
+
+  data = tmalloc(end - begin + 1);
+  if (!read_all(log_fd, data, end - begin, begin))
+    goto done;
+
+  for (i = 0; i < count - first; ++i)
+    ends[i] -= begin;
+  ends[count - first] = end - begin + entry->len;
+
+  index_name = index_filename();
+  new_log_name = tmalloc(strlen(history_log_file) + sizeof(".new"));
+  strcpy(new_log_name, history_log_file);
+  strcat(new_log_name, ".new");
+  new_index_name = tmalloc(strlen(index_name) + sizeof(".new"));
+  strcpy(new_index_name, index_name);
+  strcat(new_index_name, ".new");
+
+  new_log = open(new_log_name, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  new_index = open(new_index_name, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  /* Rename the log first; if interrupted before the index is renamed, the old
+   * index extends past the end of the new log, which is detected and causes
+   * the history to be reset.
+   */
+  ok = new_log != -1 && new_index != -1 &&
+       write_all(new_log, data, end - begin, 0) &&
+       write_all(new_log, string_data(entry), entry->len, end - begin) &&
+       write_all(new_index, history_index_magic,
+                 sizeof(history_index_magic), 0) &&
+       write_all(new_index, ends, (count - first + 1) * sizeof(unsigned),
+                 sizeof(history_index_magic));
+  if (new_log != -1 && close(new_log)) ok = 0;
+  if (new_index != -1 && close(new_index)) ok = 0;
+  ok = ok &&
+       !rename(new_log_name, history_log_file) &&
+       !rename(new_index_name, index_name);
+  if (!ok) {
+    unlink(new_log_name);
+    unlink(new_index_name);
+  }
+
+  free(index_name);
+  free(new_log_name);
+  free(new_index_name);
+
+  done:
+  free(ends);
+  free(data);
+  return ok;
+}
+
+int histlog_append(string entry) {
+  byte magic[sizeof(history_index_magic)];
+  struct stat log_stat, index_stat;
+  unsigned count, end, new_end;
+  char* index_name;
+  int log_fd = -1, index_fd = -1, ok = 0;
+
+  if (!history_depth) return 1;
+
+  index_name = index_filename();
+  log_fd = open(history_log_file, O_RDWR|O_CREAT, 0666);
+  index_fd = open(index_name, O_RDWR|O_CREAT, 0666);
+  if (log_fd == -1 || index_fd == -1 ||
+      fstat(log_fd, &log_stat) || fstat(index_fd, &index_stat))
+    goto error;
+
+  /* Establish the number of entries and the end of the last one, starting
+   * afresh if the index is new or does not match the log.
+   */
+  count = end = 0;
+  if (index_stat.st_size >= (off_t)sizeof(magic)) {
+    if (!read_all(index_fd, magic, sizeof(magic), 0))
+      goto error;
+    if (memcmp(magic, history_index_magic, sizeof(magic))) {
+      fprintf(stderr, "tgl: history index %s is incompatible\n", index_name);
+      goto done;
+    }
+
+    count = (index_stat.st_size - sizeof(magic)) / sizeof(unsigned);
+    if (count && !read_all(index_fd, &end, sizeof(end),
+                           sizeof(magic) + (count-1) * sizeof(unsigned)))
+      goto error;
+    if (end > log_stat.st_size) {
+      fprintf(stderr, "tgl: history log %s is inconsistent with its index; "
+              "discarding history\n", history_log_file);
+      count = end = 0;
+    }
+  }
+
+  /* Anything after the last indexed entry was left by an interrupted append.
+   */
+  if ((log_stat.st_size != end && ftruncate(log_fd, end)) ||
+      (index_stat.st_size != (off_t)(sizeof(magic) + count*sizeof(unsigned)) &&
+       ftruncate(index_fd, sizeof(magic) + count*sizeof(unsigned))))
+    goto error;
+  if (!count && !write_all(index_fd, history_index_magic, sizeof(magic), 0))
+    goto error;
+
+  new_end = end + entry->len;
+  if (count+1 > 2*history_depth || new_end < end) {
+    if (!compact_history(log_fd, index_fd, count, entry))
+      goto error;
+  } else {
+    /* Write the entry before the index, so that an interrupted append leaves
+     * only unindexed garbage at the end of the log.
+     */
+    if (!write_all(log_fd, string_data(entry), entry->len, end) ||
+        !write_all(index_fd, &new_end, sizeof(new_end),
+                   sizeof(magic) + count*sizeof(unsigned)))
+      goto error;
+  }
+
+  ok = 1;
+  goto done;
+
+  error:
+  fprintf(stderr, "tgl: error writing history log: %s\n", strerror(errno));
+
+  done:
+  if (log_fd != -1) close(log_fd);
+  if (index_fd != -1) close(index_fd);
+  free(index_name);
+  return ok;
+}
+
+void histlog_migrate(interpreter* interp) {
+  unsigned i;
+
+  if (!history_depth || !access(history_log_file, F_OK) || errno != ENOENT)
+    return;
+
+  for (i = 0; i < 0x20 && !interp->registers[i]->len; ++i);
+  if (i == 0x20) return;
+
+  /* Oldest first */
+  for (i = 0x20; i > 0; --i)
+    if (interp->registers[i-1]->len)
+      if (!histlog_append(interp->registers[i-1]))
+        return;
+
+  for (i = 0; i < 0x20; ++i) {
+    free(interp->registers[i]);
+    interp->registers[i] = empty_string();
+  }
+}
@@ -0,0 +1,45 @@
+/* Contains functions for maintaining the command history.
+ *
+ * History is kept in an append-only log file (by default ~/.tgl_history),
+ * which simply contains each command sequence run, oldest first, with nothing
+ * between them. Next to it is an index file (the log filename with ".idx"
+ * appended), which records the offset of the end of each entry. Entries are
+ * read by mapping both files, so only the entries actually accessed are ever
+ * read, and adding an entry only requires writing that entry and its offset.
+ *
+ * Once the log holds twice history_depth entries, it is rewritten to hold
+ * only the most recent history_depth.
+ */
+#ifndef HISTLOG_H_
+#define HISTLOG_H_
+
+#include "strings.h"
+
+struct interpreter;
+
+/* The name of the history log file. */
+extern char* history_log_file;
+/* The number of history entries which are accessible. */
+extern unsigned history_depth;
+
+/* Returns a new string containing the history entry at the given offset, where
+ * offset 0 is the most recent entry, or NULL if there is no such entry.
+ *
+ * Errors reading the log are reported, and treated as if there were no
+ * history.
+ */
+string histlog_get(unsigned offset);
+
+/* Appends the given command sequence to the history log.
+ *
+ * Returns 1 on success, 0 on error (in which case a diagnostic is printed).
+ */
+int histlog_append(string);
+
+/* Moves history stored in registers 0x00..0x1F by earlier versions of TGL
+ * into the history log, if the log does not exist yet. The registers are
+ * cleared once their contents have been logged.
+ */
+void histlog_migrate(struct interpreter*);
+
+#endif /* HISTLOG_H_ */
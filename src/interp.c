@@ -12,6 +12,7 @@
 #include "tgl.h"
 #include "strings.h"
 #include "interp.h"
+#include "library.h"
 
 void stack_push(interpreter* interp, string val) {
   stack_elt* s = tmalloc(sizeof(stack_elt));
@@ -202,10 +203,7 @@ int exec_one_command(interpreter* interp) {
   }
 
   /* Execute the command. */
-  if (interp->commands[command].is_native)
-    success = interp->commands[command].cmd.native(interp);
-  else
-    success = exec_code(interp, interp->commands[command].cmd.user);
+  success = exec_command(interp, &interp->commands[command]);
 
   /* Move to next command if successful, then return. */
   if (success)
@@ -220,6 +218,16 @@ int exec_one_command(interpreter* interp) {
   return success;
 }
 
+int exec_command(interpreter* interp, command* cmd) {
+  if (cmd->is_native == COMMAND_LAZY && !library_resolve(cmd))
+    return 0;
+
+  if (cmd->is_native)
+    return cmd->cmd.native(interp);
+  else
+    return exec_code(interp, cmd->cmd.user);
+}
+
 int exec_code(interpreter* interp, string code) {
   string old_code;
   unsigned old_ip;
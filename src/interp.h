@@ -25,6 +25,8 @@ typedef struct pstack_elt {
 
 /* Defined later. */
 struct interpreter;
+/* Defined in library.h */
+struct library_entry;
 
 /* Defines the function pointer type for native commands.
  *
@@ -40,16 +42,25 @@ struct interpreter;
  */
 typedef int (*native_command)(struct interpreter*);
 
+/* Value of command::is_native for user commands whose body has not yet been
+ * read from the user library. See library.h.
+ */
+#define COMMAND_LAZY 2
+
 /* Defines any type of command, either native or user-defined. */
 typedef struct command {
-  /* Whether the command is native. 1=native, 0=user. */
+  /* Whether the command is native. 1=native, 0=user, COMMAND_LAZY=user, but
+   * not yet loaded.
+   */
   int is_native;
-  /* Pointer to either a native_command to call or a string to interpret.
+  /* Pointer to either a native_command to call, a string to interpret, or the
+   * library entry from which to load the string.
    * A non-existent command is indicated by the pointers below being NULL.
    */
   union {
     native_command native;
     string user;
+    struct library_entry* lazy;
   } cmd;
 } command;
 
@@ -195,6 +206,13 @@ int secondary_arg_as_int(string, signed* dst, int allow_negative);
  */
 int secondary_arg_as_reg(string, byte* dst);
 
+/* Returns whether the given glob matches the current context.
+ *
+ * Since the current context does not change, the result for each distinct glob
+ * is only computed once.
+ */
+int context_matches(const byte* glob, unsigned len);
+
 /* Prints an error message to the user. */
 void print_error(char*);
 
@@ -222,6 +240,13 @@ void diagnostic(interpreter*, char*);
  */
 int exec_one_command(interpreter*);
 
+/* Executes the given command within the given interpreter, loading its body
+ * from the user library first if it is lazy.
+ *
+ * Returns whether the command was successful.
+ */
+int exec_command(interpreter*, command*);
+
 /* Executes the given code in the given interpreter.
  *
  * This will temprorarily alter the code and ip fields of the interpreter, but
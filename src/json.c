@@ -0,0 +1,516 @@
+/* Implementation of JSON parsing. See json.h. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "tgl.h"
+#include "strings.h"
+#include "json.h"
+
+/* What the parser expects next. */
+typedef enum json_expect {
+  /* Any value */
+  EXPECT_VALUE = 0,
+  /* A value, or the end of the array just opened */
+  EXPECT_FIRST_ELEMENT,
+  /* A member name */
+  EXPECT_KEY,
+  /* A member name, or the end of the object just opened */
+  EXPECT_FIRST_KEY,
+  /* A comma or the end of the enclosing container, or the end of the document
+   * at the top level.
+   */
+  EXPECT_SEPARATOR
+} json_expect;
+
+/* Appends a value of the given type beginning at the given offset to the
+ * tape, returning its position.
+ */
+static unsigned push_value(json_tape* tape, byte type, unsigned begin) {
+  json_value* value;
+
+  if (tape->num_values == tape->cap) {
+    tape->cap = tape->cap? tape->cap*2 : 256;
+    tape->values = trealloc(tape->values, tape->cap * sizeof(json_value));
+  }
+
+  value = tape->values + tape->num_values;
+  value->type = type;
+  value->begin = value->end = begin;
+  value->next = tape->num_values + 1;
+  return tape->num_values++;
+}
+
+static int is_digit(byte ch) {
+  return ch >= '0' && ch <= '9';
+}
+
+static int hex_value(byte ch) {
+  if (ch >= '0' && ch <= '9') return ch - '0';
+  if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+  return -1;
+}
+
+static unsigned skip_space(const byte* data, unsigned len, unsigned pos) {
+  while (pos < len && (data[pos] == ' ' || data[pos] == '\n' ||
+                       data[pos] == '\r' || data[pos] == '\t'))
+    ++pos;
+  return pos;
+}
+
+/* Finds the end of the string beginning at pos (its opening quote).
+ *
+ * Returns the offset after the closing quote, or 0 with *error set if the
+ * string is malformed, in which case *pos is updated to the problem.
+ */
+static unsigned scan_string(const byte* data, unsigned len, unsigned* pos,
+                            const char** error) {
+  unsigned i = *pos + 1, k;
+  byte ch;
+
+  for (;;) {
+    /* Pass over the plain part quickly. */
+    while (i < len && (ch = data[i]) != '"' && ch != '\\' && ch >= 0x20)
+      ++i;
+
+    if (i >= len) {
+      *error = "Unterminated string";
+      return 0;
+    }
+
+    switch (data[i]) {
+    case '"':
+      return i+1;
+
+    case '\\':
+      if (i+1 >= len) {
+        *pos = i;
+        *error = "Unterminated string";
+        return 0;
+      }
+      switch (data[i+1]) {
+      case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r':
+      case 't':
+        i += 2;
+        break;
+
+      case 'u':
+        for (k = 2; k < 6; ++k) {
+          if (i+k >= len || hex_value(data[i+k]) == -1) {
+            *pos = i;
+            *error = "Invalid \\u escape";
+            return 0;
+          }
+        }
+        i += 6;
+        break;
+
+      default:
+        *pos = i;
+        *error = "Invalid escape sequence";
+        return 0;
+      }
+      break;
+
+    default:
+      *pos = i;
+      *error = "Control character in string";
+      return 0;
+    }
+  }
+}
+
+/* Finds the end of the number beginning at pos.
+ *
+ * Returns the offset after the number, or 0 with *error set if it is
+ * malformed, in which case *pos is updated to the problem.
+ */
+static unsigned scan_number(const byte* data, unsigned len, unsigned* pos,
+                            const char** error) {
+  unsigned i = *pos;
+
+  if (i < len && data[i] == '-') ++i;
+  if (i < len && data[i] == '0') {
+    ++i;
+  } else if (i < len && is_digit(data[i])) {
+    while (i < len && is_digit(data[i])) ++i;
+  } else {
+    goto error;
+  }
+
+  if (i < len && data[i] == '.') {
+    ++i;
+    if (i >= len || !is_digit(data[i])) goto error;
+    while (i < len && is_digit(data[i])) ++i;
+  }
+
+  if (i < len && (data[i] == 'e' || data[i] == 'E')) {
+    ++i;
+    if (i < len && (data[i] == '+' || data[i] == '-')) ++i;
+    if (i >= len || !is_digit(data[i])) goto error;
+    while (i < len && is_digit(data[i])) ++i;
+  }
+
+  return i;
+
+  error:
+  *pos = i;
+  *error = "Malformed number";
+  return 0;
+}
+
+int json_parse(json_tape* tape, const byte* data, unsigned len,
+               const char** error, unsigned* error_at) {
+  /* The positions on the tape of the open containers. */
+  unsigned* open = NULL;
+  unsigned depth = 0, open_cap = 0;
+  unsigned pos, end, item, container;
+  json_expect expect = EXPECT_VALUE;
+  byte ch;
+
+  tape->num_values = 0;
+  pos = skip_space(data, len, 0);
+
+  for (;;) {
+    if (pos >= len) {
+      if (expect == EXPECT_SEPARATOR && !depth)
+        break;
+      *error = "Unexpected end of document";
+      goto error;
+    }
+    ch = data[pos];
+
+    switch (expect) {
+    case EXPECT_FIRST_ELEMENT:
+    case EXPECT_FIRST_KEY:
+      if (ch == (expect == EXPECT_FIRST_KEY? '}' : ']'))
+        goto close;
+      if (expect == EXPECT_FIRST_ELEMENT)
+        goto value;
+      /* fall through */
+
+    case EXPECT_KEY:
+      if (ch != '"') {
+        *error = "Expected member name";
+        goto error;
+      }
+      item = push_value(tape, JSON_STRING, pos);
+      if (!(end = scan_string(data, len, &pos, error))) goto error;
+      tape->values[item].end = end;
+
+      pos = skip_space(data, len, end);
+      if (pos >= len || data[pos] != ':') {
+        *error = "Expected ':'";
+        goto error;
+      }
+      pos = skip_space(data, len, pos+1);
+      expect = EXPECT_VALUE;
+      break;
+
+    case EXPECT_VALUE:
+    value:
+      switch (ch) {
+      case '{':
+      case '[':
+        if (depth == open_cap) {
+          open_cap = open_cap? open_cap*2 : 32;
+          open = trealloc(open, open_cap * sizeof(unsigned));
+        }
+        open[depth++] = push_value(tape, ch == '{'? JSON_OBJECT : JSON_ARRAY,
+                                   pos);
+        expect = ch == '{'? EXPECT_FIRST_KEY : EXPECT_FIRST_ELEMENT;
+        pos = skip_space(data, len, pos+1);
+        continue;
+
+      case '"':
+        item = push_value(tape, JSON_STRING, pos);
+        if (!(end = scan_string(data, len, &pos, error))) goto error;
+        tape->values[item].end = end;
+        break;
+
+      case 't':
+      case 'f':
+      case 'n':
+        {
+          const char* word = ch == 't'? "true" : ch == 'f'? "false" : "null";
+          unsigned word_len = strlen(word);
+
+          if (len - pos < word_len || memcmp(data+pos, word, word_len)) {
+            *error = "Invalid literal";
+            goto error;
+          }
+          end = pos + word_len;
+          item = push_value(tape, ch == 't'? JSON_TRUE :
+                            ch == 'f'? JSON_FALSE : JSON_NULL, pos);
+          tape->values[item].end = end;
+        }
+        break;
+
+      default:
+        if (ch != '-' && !is_digit(ch)) {
+          *error = "Unexpected character";
+          goto error;
+        }
+        item = push_value(tape, JSON_NUMBER, pos);
+        if (!(end = scan_number(data, len, &pos, error))) goto error;
+        tape->values[item].end = end;
+        break;
+      }
+
+      pos = skip_space(data, len, end);
+      expect = EXPECT_SEPARATOR;
+      break;
+
+    case EXPECT_SEPARATOR:
+      if (!depth) {
+        *error = "Trailing data after document";
+        goto error;
+      }
+      container = open[depth-1];
+      if (ch == ',') {
+        pos = skip_space(data, len, pos+1);
+        expect = tape->values[container].type == JSON_OBJECT?
+          EXPECT_KEY : EXPECT_VALUE;
+        break;
+      }
+      if (ch != (tape->values[container].type == JSON_OBJECT? '}' : ']')) {
+        *error = "Expected ',' or end of container";
+        goto error;
+      }
+
+    close:
+      container = open[--depth];
+      tape->values[container].end = pos+1;
+      tape->values[container].next = tape->num_values;
+      pos = skip_space(data, len, pos+1);
+      expect = EXPECT_SEPARATOR;
+      break;
+    }
+  }
+
+  free(open);
+  return 1;
+
+  error:
+  *error_at = pos;
+  free(open);
+  return 0;
+}
+
+void json_extract(json_tape* dst, const json_tape* src, unsigned value) {
+  unsigned i, n = src->values[value].next - value;
+  unsigned base = src->values[value].begin;
+
+  if (dst->cap < n) {
+    dst->cap = n;
+    dst->values = trealloc(dst->values, n * sizeof(json_value));
+  }
+
+  for (i = 0; i < n; ++i) {
+    dst->values[i] = src->values[value+i];
+    dst->values[i].begin -= base;
+    dst->values[i].end -= base;
+    dst->values[i].next -= value;
+  }
+  dst->num_values = n;
+}
+
+/* Writes the given code point as UTF-8 to out, returning the new end. */
+static byte* put_utf8(byte* out, unsigned long cp) {
+  if (cp < 0x80) {
+    *out++ = cp;
+  } else if (cp < 0x800) {
+    *out++ = 0xC0 | (cp >> 6);
+    *out++ = 0x80 | (cp & 0x3F);
+  } else if (cp < 0x10000) {
+    *out++ = 0xE0 | (cp >> 12);
+    *out++ = 0x80 | ((cp >> 6) & 0x3F);
+    *out++ = 0x80 | (cp & 0x3F);
+  } else {
+    *out++ = 0xF0 | (cp >> 18);
+    *out++ = 0x80 | ((cp >> 12) & 0x3F);
+    *out++ = 0x80 | ((cp >> 6) & 0x3F);
+    *out++ = 0x80 | (cp & 0x3F);
+  }
+
+  return out;
+}
+
+/* Returns the code point of the \u escape at in (which must be valid). */
+static unsigned long unicode_escape(const byte* in) {
+  return (hex_value(in[2]) << 12) | (hex_value(in[3]) << 8) |
+         (hex_value(in[4]) << 4) | hex_value(in[5]);
+}
+
+string json_string_value(const byte* data, const json_value* value) {
+  const byte* in = data + value->begin + 1, * end = data + value->end - 1;
+  const byte* escape;
+  unsigned long cp, low;
+  string result;
+  byte* out;
+
+  /* Decoding never lengthens the contents. */
+  result = tmalloc(sizeof(struct string) + (end - in));
+  out = string_data(result);
+  while (in < end) {
+    if (!(escape = memchr(in, '\\', end - in)))
+      escape = end;
+    memcpy(out, in, escape - in);
+    out += escape - in;
+    in = escape;
+    if (in == end) break;
+
+    switch (in[1]) {
+    case 'b': *out++ = '\b'; break;
+    case 'f': *out++ = '\f'; break;
+    case 'n': *out++ = '\n'; break;
+    case 'r': *out++ = '\r'; break;
+    case 't': *out++ = '\t'; break;
+    case 'u':
+      cp = unicode_escape(in);
+      in += 4;
+      /* Combine surrogate pairs; lone surrogates are encoded as they are. */
+      if (cp >= 0xD800 && cp < 0xDC00 && end - in >= 8 &&
+          in[2] == '\\' && in[3] == 'u' &&
+          (low = unicode_escape(in+2)) >= 0xDC00 && low < 0xE000) {
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        in += 6;
+      }
+      out = put_utf8(out, cp);
+      break;
+    default: *out++ = in[1]; break;
+    }
+    in += 2;
+  }
+
+  result->len = out - string_data(result);
+  return result;
+}
+
+string json_value_string(const byte* data, const json_value* value) {
+  if (value->type == JSON_STRING)
+    return json_string_value(data, value);
+  else
+    return create_string((void*)(data + value->begin),
+                         (void*)(data + value->end));
+}
+
+/* Returns whether the name of the member whose key is at the given position
+ * on the tape equals the given name.
+ */
+static int key_equals(const json_tape* tape, const byte* data, unsigned key,
+                      const byte* name, unsigned name_len) {
+  const json_value* value = tape->values + key;
+  const byte* raw = data + value->begin + 1;
+  unsigned raw_len = value->end - value->begin - 2;
+  string decoded;
+  int equal;
+
+  /* Keys without escapes can be compared in place. */
+  if (!memchr(raw, '\\', raw_len))
+    return raw_len == name_len && !memcmp(raw, name, name_len);
+
+  decoded = json_string_value(data, value);
+  equal = decoded->len == name_len &&
+    !memcmp(string_data(decoded), name, name_len);
+  free(decoded);
+  return equal;
+}
+
+int json_resolve(const json_tape* tape, const byte* data, unsigned root,
+                 const byte* path, unsigned path_len,
+                 unsigned* result, const char** error) {
+  const json_value* values = tape->values;
+  unsigned i = 0, child, count, name_len;
+  signed long index;
+  int negative;
+  byte* name = NULL;
+
+  while (i < path_len) {
+    if (path[i] == '[') {
+      /* Array index */
+      negative = 0;
+      index = 0;
+      if (++i < path_len && path[i] == '-') {
+        negative = 1;
+        ++i;
+      }
+      if (i >= path_len || !is_digit(path[i])) {
+        *error = "Malformed array index in path";
+        goto error;
+      }
+      /* No array can have anywhere near this many elements. */
+      for (; i < path_len && is_digit(path[i]); ++i)
+        index = index < 0x7FFFFFF? index*10 + path[i] - '0' : 0x7FFFFFFF;
+      if (i >= path_len || path[i] != ']') {
+        *error = "Malformed array index in path";
+        goto error;
+      }
+      ++i;
+
+      if (values[root].type != JSON_ARRAY) {
+        *error = "Path indexes a non-array";
+        goto error;
+      }
+
+      if (negative) {
+        count = 0;
+        for (child = root+1; child < values[root].next;
+             child = values[child].next)
+          ++count;
+        index = count - index;
+      }
+
+      for (child = root+1; child < values[root].next && index > 0;
+           child = values[child].next)
+        --index;
+      if (index < 0 || child >= values[root].next) {
+        *error = "Array index out of range";
+        goto error;
+      }
+      root = child;
+    } else {
+      /* Member name, which is preceded by a dot unless it begins the path */
+      if (path[i] == '.') {
+        ++i;
+      } else if (i) {
+        *error = "Expected '.' or '[' in path";
+        goto error;
+      }
+
+      if (!name) name = tmalloc(path_len);
+      for (name_len = 0; i < path_len && path[i] != '.' && path[i] != '[';
+           ++i) {
+        if (path[i] == '\\' && i+1 < path_len) ++i;
+        name[name_len++] = path[i];
+      }
+
+      if (values[root].type != JSON_OBJECT) {
+        *error = "Path names a member of a non-object";
+        goto error;
+      }
+
+      for (child = root+1; child < values[root].next;
+           child = values[child+1].next)
+        if (key_equals(tape, data, child, name, name_len))
+          break;
+      if (child >= values[root].next) {
+        *error = "No such member";
+        goto error;
+      }
+      root = child+1;
+    }
+  }
+
+  if (name) free(name);
+  *result = root;
+  return 1;
+
+  error:
+  if (name) free(name);
+  return 0;
+}
@@ -0,0 +1,90 @@
+/* Contains functions for parsing JSON documents into a tape, an array
+ * describing every value of the document in order, from which values can be
+ * found by path without parsing the document again.
+ *
+ * The tape holds the values in document order: a container is followed by its
+ * contents, and each member of an object is represented by its key (a string)
+ * followed by its value. Every value records where the next value after it
+ * (and after its contents) lies on the tape, so that whole containers can be
+ * skipped in constant time.
+ */
+#ifndef JSON_H_
+#define JSON_H_
+
+#include "tgl.h"
+#include "strings.h"
+
+/* The types of JSON values. */
+typedef enum json_type {
+  JSON_NULL = 0,
+  JSON_FALSE,
+  JSON_TRUE,
+  JSON_NUMBER,
+  JSON_STRING,
+  JSON_ARRAY,
+  JSON_OBJECT
+} json_type;
+
+/* One value on a tape. */
+typedef struct json_value {
+  /* The offsets of the beginning and end of the text of the value, including
+   * quotes or brackets.
+   */
+  unsigned begin, end;
+  /* The position on the tape of the next value after this one and its
+   * contents.
+   */
+  unsigned next;
+  /* The json_type of the value. */
+  byte type;
+} json_value;
+
+/* A parsed document. */
+typedef struct json_tape {
+  json_value* values;
+  unsigned num_values, cap;
+} json_tape;
+
+/* Parses the given document, of the given length, onto the given tape,
+ * replacing its contents.
+ *
+ * Returns 1 on success. If the document is not valid JSON, returns 0, and
+ * stores a description of the problem in *error and its offset in *error_at.
+ */
+int json_parse(json_tape*, const byte* data, unsigned len,
+               const char** error, unsigned* error_at);
+
+/* Copies the given value, with its contents, from one tape to another, such
+ * that it becomes the document, its text being moved to offset zero. The
+ * destination tape's contents are replaced.
+ */
+void json_extract(json_tape* dst, const json_tape* src, unsigned value);
+
+/* Returns a new string holding the contents of the given string value of the
+ * given document, with escape sequences decoded (\u escapes into UTF-8).
+ */
+string json_string_value(const byte* data, const json_value*);
+
+/* Returns a new string representing the given value of the given document:
+ * the decoded contents for a string, or the text of the value otherwise.
+ */
+string json_value_string(const byte* data, const json_value*);
+
+/* Finds the value at the given path, of the given length, starting from the
+ * value at position root on the tape of the given document.
+ *
+ * A path is a sequence of steps, each of which is either a member name, the
+ * first of which may be preceded by a dot and the rest of which must be, or an
+ * array index in square brackets, which counts from the end if negative.
+ * Within member names, a backslash causes the next character to be taken
+ * literally. An empty path refers to root itself.
+ *
+ * Returns 1 and stores the position on the tape of the value in *result if
+ * found. Otherwise returns 0 and stores a description of the problem in
+ * *error.
+ */
+int json_resolve(const json_tape*, const byte* data, unsigned root,
+                 const byte* path, unsigned path_len,
+                 unsigned* result, const char** error);
+
+#endif /* JSON_H_ */
@@ -0,0 +1,583 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "tgl.h"
+#include "strings.h"
+#include "interp.h"
+#include "library.h"
+
+/* The contents of the user library, as loaded by library_load(). This is
+ * retained for the life of the process so that lazy commands can be resolved
+ * at any time.
+ */
+static byte* library_data;
+static unsigned library_length;
+/* The entries of the library index. Lazy commands point into this array. */
+static library_entry* library_entries;
+
+/* Magic bytes at the beginning of the library index file. */
+static byte library_index_magic[8] = {
+  'T', 'g', 'l', 'L', sizeof(library_entry), 0, 0, 0,
+};
+
+/* Follows the magic bytes in the library index file. */
+typedef struct library_index_header {
+  /* The length of the user library covered by this index. */
+  unsigned library_length;
+} library_index_header;
+
+/* The format of the library index file is as follows:
+ *   8 bytes: TglL<size of library_entry> 0 0 0
+ *   struct library_index_header
+ *   Any number of times:
+ *     struct library_entry
+ *       Describes one block appended to the library by v or V, in ascending
+ *       order of block_begin.
+ *
+ * The index is only considered valid if library_length matches the actual
+ * length of the library, and the index is at least as new as the library.
+ */
+
+/* The text which starts every block written by v or V. */
+static const char block_header[] = "\n(Added by ";
+#define BLOCK_HEADER_LEN (sizeof(block_header)-1)
+
+/* Returns the name of the library index file, which must be freed by the
+ * caller.
+ */
+static char* index_filename(void) {
+  char* filename = tmalloc(strlen(user_library_file) + sizeof(".idx"));
+  strcpy(filename, user_library_file);
+  strcat(filename, ".idx");
+  return filename;
+}
+
+/* Given that data[begin] is an opening parenthesis, returns the index of the
+ * matching closing parenthesis, using the same rules as the code command, or
+ * len if there is none.
+ */
+static unsigned match_paren(byte* data, unsigned len, unsigned begin) {
+  unsigned depth = 1, i;
+
+  for (i = begin+1; i < len; ++i) {
+    if (data[i] == '(') ++depth;
+    if (data[i] == ')' && !--depth) return i;
+  }
+
+  return len;
+}
+
+/* Tries to interpret the text at data[begin] as a block written by v or V. If
+ * it is exactly such a block, fills *e in and returns 1. Otherwise, returns 0
+ * and *e is unspecified.
+ *
+ * Blocks which would not behave identically when executed normally (such as
+ * ones whose guard would be rejected by the @ command) are not recognised.
+ */
+static int recognise_block(byte* data, unsigned len, unsigned begin,
+                           library_entry* e) {
+  unsigned i, close;
+
+  if (len - begin < BLOCK_HEADER_LEN ||
+      memcmp(data+begin, block_header, BLOCK_HEADER_LEN))
+    return 0;
+
+  /* Skip the comment and the ; which drops it */
+  close = match_paren(data, len, begin+1);
+  i = close+1;
+  if (close >= len || i+2 > len || data[i] != ';' || data[i+1] != '\n')
+    return 0;
+  i += 2;
+
+  /* Optional context guard (V only) */
+  e->guard_begin = e->guard_len = e->guard_bucket = 0;
+  if (i+2 <= len && data[i] == '@' && data[i+1] == '=') {
+    i += 2;
+    e->guard_begin = i;
+    while (i < len && !isspace(data[i])) ++i;
+    e->guard_len = i - e->guard_begin;
+    /* The @ command rejects empty and overlong globs. */
+    if (!e->guard_len || e->guard_len >= 256 || i >= len || data[i] != '\n')
+      return 0;
+    ++i;
+  }
+
+  /* Name */
+  if (i >= len || data[i] != '(') return 0;
+  close = match_paren(data, len, i);
+  if (close >= len || close == i+1) return 0;
+  e->name_begin = i+1;
+  e->name_len = close - e->name_begin;
+  i = close+1;
+
+  /* Body */
+  if (i >= len || data[i] != '(') return 0;
+  close = match_paren(data, len, i);
+  if (close >= len) return 0;
+  e->body_begin = i+1;
+  e->body_len = close - e->body_begin;
+  i = close+1;
+
+  /* Defun command and trailing newline. v always uses d without a guard, V
+   * always uses D with one.
+   */
+  if (i+2 > len || data[i+1] != '\n' ||
+      data[i] != (e->guard_len? 'D' : 'd'))
+    return 0;
+
+  e->defun = data[i];
+  e->block_begin = begin;
+  e->block_end = i+2;
+  return 1;
+}
+
+/* Returns whether the guards of the two given entries are the same glob, given
+ * the data of the library.
+ */
+static int same_guard(byte* data, library_entry* a, library_entry* b) {
+  return a->guard_len == b->guard_len &&
+         !memcmp(data + a->guard_begin, data + b->guard_begin, a->guard_len);
+}
+
+/* Sets the guard_bucket of entries[n] to the first of the preceding entries
+ * which has the same glob, or to n itself if there is none.
+ *
+ * buckets is an array of the indices of the entries which begin buckets, and
+ * is updated as needed.
+ */
+static void assign_bucket(byte* data, library_entry* entries, unsigned n,
+                          unsigned* buckets, unsigned* num_buckets) {
+  unsigned i;
+
+  if (!entries[n].guard_len) return;
+
+  for (i = 0; i < *num_buckets; ++i) {
+    if (same_guard(data, entries+n, entries+buckets[i])) {
+      entries[n].guard_bucket = buckets[i];
+      return;
+    }
+  }
+
+  entries[n].guard_bucket = n;
+  buckets[(*num_buckets)++] = n;
+}
+
+/* Scans the whole library for blocks written by v or V, returning a
+ * dynamically-allocated array of entries, whose length is written into
+ * *count.
+ */
+static library_entry* scan_library(unsigned* count) {
+  library_entry* entries, e;
+  unsigned i, capacity = 16, * buckets, num_buckets = 0;
+
+  entries = tmalloc(capacity * sizeof(library_entry));
+  buckets = tmalloc(capacity * sizeof(unsigned));
+  *count = 0;
+
+  for (i = 0; i + BLOCK_HEADER_LEN <= library_length; ++i) {
+    if (library_data[i] == '\n' &&
+        recognise_block(library_data, library_length, i, &e)) {
+      if (*count == capacity) {
+        capacity *= 2;
+        entries = trealloc(entries, capacity * sizeof(library_entry));
+        buckets = trealloc(buckets, capacity * sizeof(unsigned));
+      }
+      entries[*count] = e;
+      assign_bucket(library_data, entries, (*count)++, buckets, &num_buckets);
+      /* Continue with the newline that ends the block. */
+      i = e.block_end - 1;
+    }
+  }
+
+  free(buckets);
+  return entries;
+}
+
+/* Reads the library index, if it exists and is up-to-date with respect to the
+ * given stat of the user library.
+ *
+ * Returns a dynamically-allocated array of entries, whose length is written
+ * into *count, or NULL if the index is missing, stale, or corrupt.
+ */
+static library_entry* read_index(struct stat* library_stat, unsigned* count) {
+  byte magic[sizeof(library_index_magic)];
+  library_index_header header;
+  library_entry* entries = NULL;
+  struct stat index_stat;
+  char* filename;
+  FILE* file;
+  unsigned i, n;
+  off_t size;
+
+  filename = index_filename();
+  file = fopen(filename, "rb");
+  free(filename);
+  if (!file) return NULL;
+
+  if (fstat(fileno(file), &index_stat) ||
+      index_stat.st_mtime < library_stat->st_mtime)
+    goto stale;
+
+  size = index_stat.st_size - sizeof(magic) - sizeof(header);
+  if (size < 0 || size % sizeof(library_entry))
+    goto stale;
+  n = size / sizeof(library_entry);
+
+  if (!fread(magic, sizeof(magic), 1, file) ||
+      memcmp(magic, library_index_magic, sizeof(magic)) ||
+      !fread(&header, sizeof(header), 1, file) ||
+      header.library_length != library_length)
+    goto stale;
+
+  entries = tmalloc(n? n * sizeof(library_entry) : 1);
+  if (n && n != fread(entries, sizeof(library_entry), n, file))
+    goto stale;
+  total_bytes_read += index_stat.st_size;
+
+  /* Make sure the entries are sane, so that we never index outside the
+   * library.
+   */
+  for (i = 0; i < n; ++i) {
+    if ((i && entries[i].block_begin < entries[i-1].block_end) ||
+        entries[i].block_begin >= entries[i].block_end ||
+        entries[i].block_end > library_length ||
+        entries[i].name_begin < entries[i].block_begin ||
+        entries[i].name_begin + entries[i].name_len > entries[i].block_end ||
+        entries[i].body_begin < entries[i].block_begin ||
+        entries[i].body_begin + entries[i].body_len > entries[i].block_end ||
+        (entries[i].guard_len &&
+         (entries[i].guard_begin < entries[i].block_begin ||
+          entries[i].guard_begin + entries[i].guard_len >
+          entries[i].block_end ||
+          entries[i].guard_bucket > i ||
+          !same_guard(library_data, entries+i,
+                      entries + entries[i].guard_bucket))) ||
+        memcmp(library_data + entries[i].block_begin,
+               block_header, BLOCK_HEADER_LEN))
+      goto stale;
+  }
+
+  fclose(file);
+  *count = n;
+  return entries;
+
+  stale:
+  if (entries) free(entries);
+  fclose(file);
+  return NULL;
+}
+
+/* Writes the given entries out as the new library index.
+ *
+ * Failure is silently ignored, since the index will simply be rebuilt the next
+ * time.
+ */
+static void write_index(library_entry* entries, unsigned count) {
+  library_index_header header;
+  char* filename, * tmpname;
+  FILE* file;
+
+  filename = index_filename();
+  tmpname = tmalloc(strlen(filename) + sizeof(".new"));
+  strcpy(tmpname, filename);
+  strcat(tmpname, ".new");
+
+  memset(&header, 0, sizeof(header));
+  header.library_length = library_length;
+
+  file = fopen(tmpname, "wb");
+  if (file) {
+    if (fwrite(library_index_magic, sizeof(library_index_magic), 1, file) &&
+        fwrite(&header, sizeof(header), 1, file) &&
+        count == fwrite(entries, sizeof(library_entry), count, file) &&
+        !fclose(file))
+      rename(tmpname, filename);
+    else
+      unlink(tmpname);
+  }
+
+  free(tmpname);
+  free(filename);
+}
+
+/* Executes the given region of the library as normal code. */
+static int exec_region(interpreter* interp, unsigned begin, unsigned end) {
+  string code;
+  int status;
+
+  if (begin == end) return 1;
+
+  code = create_string(library_data+begin, library_data+end);
+  status = exec_code(interp, code);
+  free(code);
+  return status;
+}
+
+/* Binds the command defined by library_entries[n] to a lazy command, if the
+ * entry's guard permits the definition.
+ *
+ * active holds, for each entry which begins a guard bucket, whether its glob
+ * matches; it is filled in the first time the bucket is encountered.
+ *
+ * Lazy long commands are inserted at *tail, which is then advanced, so that
+ * they keep the order they would have if executed normally. As then, defining
+ * a command which already exists is an error.
+ *
+ * Returns whether successful.
+ */
+static int bind_entry(interpreter* interp, unsigned n, signed char* active,
+                      long_command*** tail) {
+  library_entry* e = library_entries+n;
+  long_command* lc;
+  byte n1;
+
+  if (e->guard_len) {
+    if (e->guard_bucket == n)
+      active[n] = context_matches(library_data + e->guard_begin,
+                                  e->guard_len);
+    /* Executing the block would set the context active state as a side-effect,
+     * which may be relied upon by code which follows.
+     */
+    interp->context_active = active[e->guard_bucket];
+  }
+
+  if (e->defun == 'D' && !interp->context_active)
+    return 1;
+
+  if (e->name_len == 1) {
+    n1 = library_data[e->name_begin];
+    if (interp->commands[n1].cmd.native) {
+      print_error("Short command already exists");
+      return 0;
+    }
+
+    interp->commands[n1].is_native = COMMAND_LAZY;
+    interp->commands[n1].cmd.lazy = e;
+  } else {
+    for (lc = interp->long_commands; lc; lc = lc->next) {
+      if (lc->name->len == e->name_len &&
+          !memcmp(string_data(lc->name), library_data + e->name_begin,
+                  e->name_len)) {
+        print_error("Long command already exists");
+        return 0;
+      }
+    }
+
+    lc = tmalloc(sizeof(long_command));
+    lc->name = create_string(library_data + e->name_begin,
+                             library_data + e->name_begin + e->name_len);
+    lc->cmd.is_native = COMMAND_LAZY;
+    lc->cmd.cmd.lazy = e;
+    lc->next = **tail;
+    **tail = lc;
+    *tail = &lc->next;
+  }
+
+  return 1;
+}
+
+int library_load(interpreter* interp) {
+  struct stat library_stat;
+  unsigned count, i, pos;
+  long_command** tail;
+  signed char* active;
+  void* map;
+  int fd, status;
+  ssize_t amt;
+
+  fd = open(user_library_file, O_RDONLY);
+  if (fd == -1) {
+    /* If the file doesn't exist, ignore silently; otherwise, print a
+     * diagnostic.
+     */
+    if (errno != ENOENT)
+      fprintf(stderr, "tgl: unable to open user library: %s\n",
+              strerror(errno));
+    return 1;
+  }
+
+  if (fstat(fd, &library_stat)) {
+    fprintf(stderr, "tgl: unable to stat user library: %s\n",
+            strerror(errno));
+    close(fd);
+    return 0;
+  }
+
+  if (!library_stat.st_size) {
+    close(fd);
+    return 1;
+  }
+
+  if (library_stat.st_size != (unsigned)library_stat.st_size) {
+    fprintf(stderr, "tgl: user library too large\n");
+    close(fd);
+    return 0;
+  }
+
+  /* Map the library if possible, so that the bodies of commands which are
+   * never used are never read. Fall back to reading it in otherwise.
+   */
+  library_length = library_stat.st_size;
+  map = mmap(NULL, library_length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map != MAP_FAILED) {
+    library_data = map;
+  } else {
+    library_data = tmalloc(library_length);
+    for (pos = 0; pos < library_length; pos += amt) {
+      amt = read(fd, library_data + pos, library_length - pos);
+      if (amt <= 0) {
+        fprintf(stderr, "tgl: error reading user library: %s\n",
+                amt? strerror(errno) : "unexpected EOF");
+        close(fd);
+        free(library_data);
+        library_data = NULL;
+        return 0;
+      }
+    }
+    total_bytes_read += library_length;
+  }
+  close(fd);
+
+  library_entries = read_index(&library_stat, &count);
+  if (!library_entries) {
+    library_entries = scan_library(&count);
+    write_index(library_entries, count);
+  }
+
+  /* Execute everything between the indexed blocks, and bind the blocks
+   * themselves lazily.
+   */
+  tail = &interp->long_commands;
+  active = tmalloc(count+1);
+  status = 1;
+  pos = 0;
+  for (i = 0; i < count && status; ++i) {
+    status = exec_region(interp, pos, library_entries[i].block_begin) &&
+             bind_entry(interp, i, active, &tail);
+    pos = library_entries[i].block_end;
+  }
+
+  if (status)
+    status = exec_region(interp, pos, library_length);
+
+  free(active);
+  return status;
+}
+
+int library_resolve(command* cmd) {
+  library_entry* e = cmd->cmd.lazy;
+
+  cmd->cmd.user = create_string(library_data + e->body_begin,
+                                library_data + e->body_begin + e->body_len);
+  total_bytes_read += e->body_len;
+  cmd->is_native = 0;
+  return 1;
+}
+
+/* Returns the guard bucket for a new entry with the given glob, which is to be
+ * the nth entry in the given index file, by comparing it with the globs of the
+ * existing entries in the user library. The file must be positioned at the
+ * first entry.
+ */
+static unsigned find_bucket(FILE* index, unsigned n,
+                            const byte* glob, unsigned len) {
+  library_entry e;
+  byte other[256];
+  unsigned i, bucket = n;
+  FILE* library;
+
+  library = fopen(user_library_file, "rb");
+  if (!library) return n;
+
+  for (i = 0; i < n && bucket == n && fread(&e, sizeof(e), 1, index); ++i)
+    if (e.guard_len == len && e.guard_bucket == i &&
+        !fseek(library, e.guard_begin, SEEK_SET) &&
+        fread(other, len, 1, library) &&
+        !memcmp(other, glob, len))
+      bucket = i;
+
+  fclose(library);
+  return bucket;
+}
+
+void library_note_append(string code, unsigned offset) {
+  byte magic[sizeof(library_index_magic)];
+  library_index_header header;
+  library_entry e;
+  struct stat index_stat;
+  char* filename;
+  FILE* file;
+  unsigned n;
+  int recognised;
+
+  recognised = recognise_block(string_data(code), code->len, 0, &e) &&
+               e.block_end == code->len;
+  if (recognised) {
+    e.block_begin += offset;
+    e.block_end += offset;
+    e.name_begin += offset;
+    e.body_begin += offset;
+    if (e.guard_len)
+      e.guard_begin += offset;
+  }
+
+  filename = index_filename();
+  file = fopen(filename, "r+b");
+  if (!file && errno == ENOENT && !offset) {
+    /* The library was empty, so we can start a new index. */
+    file = fopen(filename, "w+b");
+    if (file) {
+      memset(&header, 0, sizeof(header));
+      if (!fwrite(library_index_magic, sizeof(library_index_magic), 1, file) ||
+          !fwrite(&header, sizeof(header), 1, file) ||
+          fseek(file, 0, SEEK_SET)) {
+        fclose(file);
+        file = NULL;
+      }
+    }
+  }
+  free(filename);
+  if (!file) return;
+
+  /* Only update the index if it covered the library exactly before the
+   * append; otherwise, it is stale anyway.
+   */
+  if (!fread(magic, sizeof(magic), 1, file) ||
+      memcmp(magic, library_index_magic, sizeof(magic)) ||
+      !fread(&header, sizeof(header), 1, file) ||
+      header.library_length != offset)
+    goto done;
+
+  if (recognised) {
+    if (fstat(fileno(file), &index_stat)) goto done;
+    n = (index_stat.st_size - sizeof(magic) - sizeof(header)) /
+        sizeof(library_entry);
+    if (e.guard_len)
+      e.guard_bucket = find_bucket(file, n,
+                                   string_data(code) + e.guard_begin - offset,
+                                   e.guard_len);
+    if (fseek(file, sizeof(magic) + sizeof(header) + n*sizeof(e), SEEK_SET) ||
+        !fwrite(&e, sizeof(e), 1, file))
+      goto done;
+  }
+
+  /* Only now that the entry is written can the header claim to cover it. */
+  header.library_length = offset + code->len;
+  if (fseek(file, sizeof(magic), SEEK_SET)) goto done;
+  fwrite(&header, sizeof(header), 1, file);
+
+  done:
+  fclose(file);
+}
@@ -0,0 +1,69 @@
+/* Contains functions for loading the user library.
+ *
+ * Definitions appended to the user library by v and V are recorded in an
+ * index file next to the library (the library filename with ".idx" appended),
+ * which gives the byte ranges of each such block. When the library is loaded,
+ * indexed blocks are not executed; instead, their names are bound to lazy
+ * commands whose bodies are only read from the library when first invoked.
+ * Anything else in the library is executed as normal.
+ *
+ * Guarded blocks (those written by V) are bucketed by their glob, so that each
+ * distinct glob is only matched once, and blocks for other contexts are
+ * skipped entirely.
+ */
+#ifndef LIBRARY_H_
+#define LIBRARY_H_
+
+#include "strings.h"
+
+struct interpreter;
+struct command;
+
+/* Describes a single block appended to the user library by v or V, of the
+ * form
+ *   \n(Added by ...);\n[@=glob\n](name)(body)d\n
+ * All offsets are byte offsets into the user library.
+ */
+typedef struct library_entry {
+  /* The extent of the whole block, including the leading and trailing
+   * newlines.
+   */
+  unsigned block_begin, block_end;
+  /* The name of the command being defined. */
+  unsigned name_begin, name_len;
+  /* The body of the command being defined. */
+  unsigned body_begin, body_len;
+  /* The context glob guarding the definition, if guard_len is non-zero. */
+  unsigned guard_begin, guard_len;
+  /* The index of the first entry with the same glob, if guard_len is
+   * non-zero.
+   */
+  unsigned guard_bucket;
+  /* The command used to define the command, either 'd' or 'D'. */
+  unsigned defun;
+} library_entry;
+
+/* Loads the user library into the given interpreter, using the index if it is
+ * up-to-date, and rebuilding it otherwise.
+ *
+ * It is not an error if the library does not exist.
+ *
+ * Returns 1 on success, 0 if any error occurred.
+ */
+int library_load(struct interpreter*);
+
+/* Reads the body of the given lazy command from the user library, converting
+ * it into a normal user command.
+ *
+ * Returns 1 on success, 0 on error (in which case a diagnostic is printed).
+ */
+int library_resolve(struct command*);
+
+/* Notes that the given code was appended to the user library at the given
+ * offset, updating the index accordingly. If the index did not cover exactly
+ * the first offset bytes of the library, it is left alone so that it is
+ * rebuilt on the next load.
+ */
+void library_note_append(string code, unsigned offset);
+
+#endif /* LIBRARY_H_ */
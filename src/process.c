@@ -0,0 +1,428 @@
+/* Implementation of external processes. See process.h. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "tgl.h"
+#include "strings.h"
+#include "process.h"
+#include "timing.h"
+
+extern char** environ;
+
+/* The amount by which to grow the output buffer when it fills up, at least. */
+#define MIN_OUTPUT_CHUNK 4096
+
+/* Creates a pipe whose ends are both above PROCESS_SCRIPT_FD and
+ * close-on-exec, so that the child never inherits them by accident and
+ * posix_spawn_file_actions_adddup2() always actually duplicates them.
+ *
+ * Returns 1 on success, 0 on error (with errno set).
+ */
+static int make_pipe(int fds[2]) {
+  int i, fd;
+
+  if (pipe(fds)) return 0;
+
+  for (i = 0; i < 2; ++i) {
+    if (fds[i] <= PROCESS_SCRIPT_FD) {
+      fd = fcntl(fds[i], F_DUPFD, PROCESS_SCRIPT_FD+1);
+      if (fd == -1) goto error;
+      close(fds[i]);
+      fds[i] = fd;
+    }
+    if (-1 == fcntl(fds[i], F_SETFD, FD_CLOEXEC)) goto error;
+  }
+
+  return 1;
+
+  error:
+  close(fds[0]);
+  close(fds[1]);
+  return 0;
+}
+
+/* Closes the given file descriptor, if open, and marks it closed. */
+static void close_fd(int* fd) {
+  if (*fd != -1) {
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+/* Implements process_spawn(), additionally leaving the child's standard
+ * output connected to TGL's if capture_output is zero.
+ */
+static int spawn(process* proc, char** argv, int with_script,
+                 int capture_output) {
+  int input_pipe[2] = { -1, -1 }, script_pipe[2] = { -1, -1 },
+      output_pipe[2] = { -1, -1 };
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t sigdefault;
+  int err;
+
+  memset(proc, 0, sizeof(process));
+  proc->pid = -1;
+  proc->name = argv[0];
+  proc->input_fd = proc->script_fd = proc->output_fd = -1;
+
+  /* Writing to a child which has stopped reading must produce an error, not
+   * kill us.
+   */
+  signal(SIGPIPE, SIG_IGN);
+
+  if (!make_pipe(input_pipe) ||
+      (capture_output && !make_pipe(output_pipe)) ||
+      (with_script && !make_pipe(script_pipe))) {
+    fprintf(stderr, "tgl: error: pipe: %s\n", strerror(errno));
+    goto error;
+  }
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, input_pipe[0], STDIN_FILENO);
+  if (capture_output)
+    posix_spawn_file_actions_adddup2(&actions, output_pipe[1], STDOUT_FILENO);
+  if (with_script)
+    posix_spawn_file_actions_adddup2(&actions, script_pipe[0],
+                                     PROCESS_SCRIPT_FD);
+  /* The child must not inherit our disposition of SIGPIPE. */
+  posix_spawnattr_init(&attr);
+  sigemptyset(&sigdefault);
+  sigaddset(&sigdefault, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &sigdefault);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+  clock_gettime(CLOCK_MONOTONIC, &proc->start_time);
+  err = posix_spawnp(&proc->pid, argv[0], &actions, &attr, argv, environ);
+  proc->spawn_time = timing_since(&proc->start_time);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (err) {
+    proc->pid = -1;
+    fprintf(stderr, "tgl: error: executing %s: %s\n", argv[0], strerror(err));
+    goto error;
+  }
+
+  /* Keep only our own ends. */
+  close_fd(&input_pipe[0]);
+  close_fd(&output_pipe[1]);
+  close_fd(&script_pipe[0]);
+  proc->input_fd = input_pipe[1];
+  proc->script_fd = script_pipe[1];
+  proc->output_fd = output_pipe[0];
+  return 1;
+
+  error:
+  close_fd(&input_pipe[0]);
+  close_fd(&input_pipe[1]);
+  close_fd(&script_pipe[0]);
+  close_fd(&script_pipe[1]);
+  close_fd(&output_pipe[0]);
+  close_fd(&output_pipe[1]);
+  return 0;
+}
+
+int process_spawn(process* proc, char** argv, int with_script) {
+  return spawn(proc, argv, with_script, 1);
+}
+
+/* Implements process_start() and process_start_passthrough(). */
+static int start(process* proc, char** argv, string input, string script,
+                 int capture_output) {
+  if (!spawn(proc, argv, script != NULL, capture_output))
+    return 0;
+
+  proc->input = input;
+  proc->script = script;
+
+  /* Input which is empty is finished immediately. */
+  if (!input || !input->len)
+    close_fd(&proc->input_fd);
+  if (!script || !script->len)
+    close_fd(&proc->script_fd);
+
+  if ((proc->input_fd != -1 &&
+       -1 == fcntl(proc->input_fd, F_SETFL, O_NONBLOCK)) ||
+      (proc->script_fd != -1 &&
+       -1 == fcntl(proc->script_fd, F_SETFL, O_NONBLOCK))) {
+    fprintf(stderr, "tgl: error: fcntl: %s\n", strerror(errno));
+    process_abandon(proc);
+    return 0;
+  }
+
+  proc->output_cap = MIN_OUTPUT_CHUNK;
+  proc->output = tmalloc(sizeof(struct string) + proc->output_cap);
+  proc->output->len = 0;
+  return 1;
+}
+
+int process_start(process* proc, char** argv, string input, string script) {
+  return start(proc, argv, input, script, 1);
+}
+
+int process_start_passthrough(process* proc, char** argv, string input) {
+  /* Anything we've written so far must come before the child's output. */
+  fflush(stdout);
+  return start(proc, argv, input, NULL, 0);
+}
+
+int process_fork(process* proc, const char* name) {
+  int output_pipe[2];
+  pid_t pid;
+
+  memset(proc, 0, sizeof(process));
+  proc->pid = -1;
+  proc->name = name;
+  proc->input_fd = proc->script_fd = proc->output_fd = -1;
+  signal(SIGPIPE, SIG_IGN);
+
+  if (!make_pipe(output_pipe)) {
+    fprintf(stderr, "tgl: error: pipe: %s\n", strerror(errno));
+    return -1;
+  }
+
+  /* Anything buffered must be written once, by us. */
+  fflush(stdout);
+  clock_gettime(CLOCK_MONOTONIC, &proc->start_time);
+  pid = fork();
+  if (pid == -1) {
+    fprintf(stderr, "tgl: error: fork: %s\n", strerror(errno));
+    close(output_pipe[0]);
+    close(output_pipe[1]);
+    return -1;
+  }
+
+  if (!pid) {
+    close(output_pipe[0]);
+    if (-1 == dup2(output_pipe[1], STDOUT_FILENO)) {
+      fprintf(stderr, "tgl: error: dup2: %s\n", strerror(errno));
+      _exit(255);
+    }
+    close(output_pipe[1]);
+    return 0;
+  }
+
+  proc->pid = pid;
+  proc->spawn_time = timing_since(&proc->start_time);
+  close(output_pipe[1]);
+  proc->output_fd = output_pipe[0];
+  proc->output_cap = MIN_OUTPUT_CHUNK;
+  proc->output = tmalloc(sizeof(struct string) + proc->output_cap);
+  proc->output->len = 0;
+  return 1;
+}
+
+/* Writes as much of data as the given non-blocking descriptor will accept,
+ * starting at *off. Closes the descriptor once everything has been written, or
+ * if the reader has gone away.
+ *
+ * Returns 1 on success, 0 on error (in which case a diagnostic is printed).
+ */
+static int pump_write(process* proc, int* fd, string data, unsigned* off) {
+  ssize_t amt;
+
+  amt = write(*fd, string_data(data) + *off, data->len - *off);
+  if (amt == -1) {
+    if (errno == EAGAIN || errno == EINTR) return 1;
+    /* The child is not interested in the rest of its input; this is its own
+     * business.
+     */
+    if (errno == EPIPE) {
+      close_fd(fd);
+      return 1;
+    }
+    fprintf(stderr, "tgl: error: writing input to %s: %s\n",
+            proc->name, strerror(errno));
+    return 0;
+  }
+
+  *off += amt;
+  total_bytes_written += amt;
+  if (*off == data->len)
+    close_fd(fd);
+  return 1;
+}
+
+/* Reads whatever output is available from the given process, growing the
+ * output buffer as necessary. Closes the descriptor at EOF.
+ *
+ * Returns 1 on success, 0 on error (in which case a diagnostic is printed).
+ */
+static int pump_read(process* proc) {
+  ssize_t amt;
+
+  if (proc->output->len == proc->output_cap) {
+    proc->output_cap *= 2;
+    proc->output = trealloc(proc->output,
+                            sizeof(struct string) + proc->output_cap);
+  }
+
+  amt = read(proc->output_fd, string_data(proc->output) + proc->output->len,
+             proc->output_cap - proc->output->len);
+  if (amt == -1) {
+    if (errno == EAGAIN || errno == EINTR) return 1;
+    fprintf(stderr, "tgl: error: reading output of %s: %s\n",
+            proc->name, strerror(errno));
+    return 0;
+  }
+
+  if (!amt)
+    close_fd(&proc->output_fd);
+  proc->output->len += amt;
+  total_bytes_read += amt;
+  return 1;
+}
+
+int process_pump(process*const* procs, unsigned count, int timeout) {
+  struct pollfd* fds;
+  unsigned i, n, outstanding;
+
+  fds = tmalloc(sizeof(struct pollfd) * 3 * (count? count : 1));
+  outstanding = 0;
+  for (i = n = 0; i < count; ++i) {
+    fds[n].fd = procs[i]->input_fd;
+    fds[n++].events = POLLOUT;
+    fds[n].fd = procs[i]->script_fd;
+    fds[n++].events = POLLOUT;
+    fds[n].fd = procs[i]->output_fd;
+    fds[n++].events = POLLIN;
+    if (procs[i]->input_fd != -1 || procs[i]->script_fd != -1 ||
+        procs[i]->output_fd != -1)
+      ++outstanding;
+  }
+
+  /* Don't wait forever on nothing. */
+  if (!outstanding) {
+    free(fds);
+    return 0;
+  }
+
+  /* poll() ignores negative descriptors, so closed ones need no special
+   * treatment.
+   */
+  if (-1 == poll(fds, n, timeout)) {
+    /* The revents are not set, so nothing is known to be ready; the caller
+     * will simply poll again.
+     */
+    if (errno == EINTR) {
+      free(fds);
+      return outstanding;
+    }
+    fprintf(stderr, "tgl: error: poll: %s\n", strerror(errno));
+    free(fds);
+    return -1;
+  }
+
+  outstanding = 0;
+  for (i = 0; i < count; ++i) {
+    /* Errors and hangups are discovered by the write() or read() itself. */
+    if (fds[3*i].revents &&
+        !pump_write(procs[i], &procs[i]->input_fd, procs[i]->input,
+                    &procs[i]->input_off))
+      goto error;
+    if (fds[3*i+1].revents &&
+        !pump_write(procs[i], &procs[i]->script_fd, procs[i]->script,
+                    &procs[i]->script_off))
+      goto error;
+    if (fds[3*i+2].revents && !pump_read(procs[i]))
+      goto error;
+
+    if (procs[i]->input_fd != -1 || procs[i]->script_fd != -1 ||
+        procs[i]->output_fd != -1)
+      ++outstanding;
+  }
+
+  free(fds);
+  return outstanding;
+
+  error:
+  free(fds);
+  return -1;
+}
+
+string process_finish(process* proc, int* return_status) {
+  int child_status, ret;
+  string output;
+  struct timespec begin;
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  while ((ret = process_pump(&proc, 1, -1)) > 0);
+  if (ret == -1) {
+    process_abandon(proc);
+    return NULL;
+  }
+
+  while (-1 == waitpid(proc->pid, &child_status, 0)) {
+    if (errno != EINTR) {
+      fprintf(stderr, "tgl: error: waitpid: %s\n", strerror(errno));
+      process_abandon(proc);
+      return NULL;
+    }
+  }
+  proc->pid = -1;
+  timing_process(proc->name, proc->spawn_time,
+                 timing_since(&proc->start_time), timing_since(&begin),
+                 proc->input_off + proc->script_off,
+                 proc->output? proc->output->len : 0);
+
+  /* Did the child exit successfully? */
+  if (!WIFEXITED(child_status)) {
+    fprintf(stderr, "tgl: error: child process %s terminated abnormally\n",
+            proc->name);
+    process_abandon(proc);
+    return NULL;
+  }
+  if (return_status) {
+    *return_status = WEXITSTATUS(child_status);
+  } else if (WEXITSTATUS(child_status)) {
+    fprintf(stderr, "tgl: error: child process %s exited with code %d\n",
+            proc->name, (int)WEXITSTATUS(child_status));
+    process_abandon(proc);
+    return NULL;
+  }
+
+  /* Give back the slack in the output buffer. */
+  output = trealloc(proc->output, sizeof(struct string) + proc->output->len);
+  proc->output = NULL;
+  return output;
+}
+
+void process_abandon(process* proc) {
+  close_fd(&proc->input_fd);
+  close_fd(&proc->script_fd);
+  close_fd(&proc->output_fd);
+  if (proc->pid != -1) {
+    kill(proc->pid, SIGTERM);
+    while (-1 == waitpid(proc->pid, NULL, 0) && errno == EINTR);
+    proc->pid = -1;
+  }
+  if (proc->output) {
+    free(proc->output);
+    proc->output = NULL;
+  }
+}
+
+void process_forget(process* proc) {
+  close_fd(&proc->input_fd);
+  close_fd(&proc->script_fd);
+  close_fd(&proc->output_fd);
+  proc->pid = -1;
+  if (proc->output) {
+    free(proc->output);
+    proc->output = NULL;
+  }
+}
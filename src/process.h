@@ -0,0 +1,115 @@
+/* Contains functions for running external processes.
+ *
+ * Processes are started with posix_spawn(), and communicate with TGL entirely
+ * through pipes: input is fed to the process's standard input (and optionally
+ * a script to file descriptor 3) while its standard output is drained into an
+ * in-memory buffer, so that neither side blocks the other.
+ */
+#ifndef PROCESS_H_
+#define PROCESS_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "strings.h"
+
+/* The file descriptor on which the child receives the script, if any. */
+#define PROCESS_SCRIPT_FD 3
+
+/* Tracks a running external process. */
+typedef struct process {
+  /* The child process, or -1 once it has been reaped. */
+  pid_t pid;
+  /* The name of the program, for diagnostics. Not owned. */
+  const char* name;
+  /* Parent ends of the pipes connected to the child's standard input, the
+   * script descriptor and standard output, or -1 if closed.
+   */
+  int input_fd, script_fd, output_fd;
+  /* Data still to be written to the child, and how much has been written.
+   * Not owned.
+   */
+  string input, script;
+  unsigned input_off, script_off;
+  /* Output accumulated so far, and the capacity allocated for it. */
+  string output;
+  unsigned output_cap;
+  /* When the process was started, and how long that took in nanoseconds, for
+   * timing_process().
+   */
+  struct timespec start_time;
+  double spawn_time;
+} process;
+
+/* Starts the given command (argv[0] being searched for in PATH) as a new
+ * process, connecting pipes to its standard input and output and, if
+ * with_script is non-zero, to PROCESS_SCRIPT_FD. The parent ends of these
+ * pipes are left in blocking mode, and no output buffer is allocated; this is
+ * for callers which wish to talk to the process themselves.
+ *
+ * Returns 1 on success, 0 on error (in which case a diagnostic is printed).
+ */
+int process_spawn(process*, char** argv, int with_script);
+
+/* Starts the given command (argv[0] being searched for in PATH) as a new
+ * process.
+ *
+ * input, if non-NULL, is fed to the child's standard input; otherwise, the
+ * child's standard input is at EOF. script, if non-NULL, is fed to the child
+ * on file descriptor PROCESS_SCRIPT_FD. Both strings must remain valid until
+ * the process has finished. Standard error is inherited from TGL.
+ *
+ * Returns 1 on success, 0 on error (in which case a diagnostic is printed).
+ */
+int process_start(process*, char** argv, string input, string script);
+
+/* Like process_start(), but the child writes directly to TGL's standard
+ * output instead of having its output captured, so the output of the process
+ * is always empty. Standard output is flushed first.
+ */
+int process_start_passthrough(process*, char** argv, string input);
+
+/* Forks TGL itself, connecting the standard output of the child to a pipe
+ * whose output is captured as with process_start(). Standard output is
+ * flushed first. The child inherits everything else, and must leave with
+ * _exit().
+ *
+ * Returns 1 in the parent and 0 in the child on success; returns -1 on error
+ * (in which case a diagnostic is printed).
+ */
+int process_fork(process*, const char* name);
+
+/* Waits at most timeout milliseconds (or indefinitely if negative) for any of
+ * the given processes to become ready for I/O, then performs whatever I/O is
+ * possible without blocking.
+ *
+ * Returns the number of processes whose I/O is still outstanding, or -1 on
+ * error (in which case a diagnostic is printed).
+ */
+int process_pump(process*const*, unsigned count, int timeout);
+
+/* Completes all I/O with the given process and reaps it. The run is recorded
+ * with timing_process().
+ *
+ * If return_status is non-NULL, the exit status of the child is written there
+ * instead of a non-zero exit status being considered an error. Abnormal
+ * termination still constitutes an error.
+ *
+ * On success, the standard output of the process is returned. On error, a
+ * message is printed to standard error and NULL is returned. Either way, all
+ * resources associated with the process are released.
+ */
+string process_finish(process*, int* return_status);
+
+/* Releases all resources associated with the given process, killing it if it
+ * is still running.
+ */
+void process_abandon(process*);
+
+/* Releases all resources associated with the given process without signalling
+ * or waiting for it. This is for a forked copy of TGL which has inherited a
+ * process belonging to its parent.
+ */
+void process_forget(process*);
+
+#endif /* PROCESS_H_ */
@@ -0,0 +1,249 @@
+/* Implementation of fast scanning. See scan.h. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <ctype.h>
+
+#include "tgl.h"
+#include "scan.h"
+
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SCAN_SSE2 1
+#include <emmintrin.h>
+#if __GNUC__ >= 5 || defined(__clang__)
+#define SCAN_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+void scan_set_init(scan_set* set) {
+  set->count = 0;
+  memset(set->member, 0, sizeof(set->member));
+}
+
+void scan_set_add(scan_set* set, byte b) {
+  if (set->member[b]) return;
+
+  set->member[b] = 1;
+  if (set->count < SCAN_SET_VECTOR)
+    set->bytes[set->count] = b;
+  ++set->count;
+}
+
+void scan_set_add_space(scan_set* set) {
+  unsigned b;
+
+  for (b = 0; b < 256; ++b)
+    if (isspace(b))
+      scan_set_add(set, b);
+}
+
+/* Scans byte by byte for the first byte whose membership is want. */
+static unsigned scan_table(const scan_set* set, const byte* data,
+                           unsigned len, int want) {
+  unsigned i;
+
+  for (i = 0; i < len && (set->member[data[i]] != 0) != want; ++i);
+  return i;
+}
+
+#ifdef SCAN_SSE2
+/* Like scan_table(), but 16 bytes at a time. */
+static unsigned scan_sse2(const scan_set* set, const byte* data,
+                          unsigned len, int want) {
+  __m128i needles[SCAN_SET_VECTOR], chunk, hits;
+  unsigned i, k, mask;
+
+  for (k = 0; k < set->count; ++k)
+    needles[k] = _mm_set1_epi8((char)set->bytes[k]);
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    chunk = _mm_loadu_si128((const __m128i*)(data+i));
+    hits = _mm_cmpeq_epi8(chunk, needles[0]);
+    for (k = 1; k < set->count; ++k)
+      hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, needles[k]));
+    mask = _mm_movemask_epi8(hits);
+    if (!want) mask ^= 0xFFFF;
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+
+  return i + scan_table(set, data+i, len-i, want);
+}
+#endif
+
+#ifdef SCAN_AVX2
+/* Like scan_table(), but 32 bytes at a time. */
+__attribute__((target("avx2")))
+static unsigned scan_avx2(const scan_set* set, const byte* data,
+                          unsigned len, int want) {
+  __m256i needles[SCAN_SET_VECTOR], chunk, hits;
+  unsigned i, k, mask;
+
+  for (k = 0; k < set->count; ++k)
+    needles[k] = _mm256_set1_epi8((char)set->bytes[k]);
+
+  for (i = 0; i + 32 <= len; i += 32) {
+    chunk = _mm256_loadu_si256((const __m256i*)(data+i));
+    hits = _mm256_cmpeq_epi8(chunk, needles[0]);
+    for (k = 1; k < set->count; ++k)
+      hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(chunk, needles[k]));
+    mask = (unsigned)_mm256_movemask_epi8(hits);
+    if (!want) mask = ~mask;
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+
+  return i + scan_sse2(set, data+i, len-i, want);
+}
+
+/* Whether the processor supports AVX2; -1 until determined. */
+static int have_avx2 = -1;
+#endif
+
+/* Implements scan_for() and scan_past(). */
+static unsigned scan(const scan_set* set, const byte* data, unsigned len,
+                     int want) {
+  if (!set->count)
+    return want? len : 0;
+
+#ifdef SCAN_SSE2
+  if (set->count <= SCAN_SET_VECTOR && len >= 16) {
+#ifdef SCAN_AVX2
+    if (have_avx2 == -1) {
+      __builtin_cpu_init();
+      have_avx2 = !!__builtin_cpu_supports("avx2");
+    }
+    if (have_avx2 && len >= 32)
+      return scan_avx2(set, data, len, want);
+#endif
+    return scan_sse2(set, data, len, want);
+  }
+#endif
+
+  return scan_table(set, data, len, want);
+}
+
+unsigned scan_for(const scan_set* set, const byte* data, unsigned len) {
+  return scan(set, data, len, 1);
+}
+
+unsigned scan_past(const scan_set* set, const byte* data, unsigned len) {
+  return scan(set, data, len, 0);
+}
+
+/* Computes the maximal suffix of x, of length m, with respect to the byte
+ * ordering if reverse is zero or its reverse otherwise, storing its period in
+ * *period.
+ *
+ * Returns the index of the byte before the suffix (so possibly -1).
+ */
+static long max_suffix(const byte* x, long m, long* period, int reverse) {
+  long ms = -1, j = 0, k = 1;
+  byte a, b;
+
+  *period = 1;
+  while (j + k < m) {
+    a = x[j+k];
+    b = x[ms+k];
+    if (a == b) {
+      if (k != *period) {
+        ++k;
+      } else {
+        j += *period;
+        k = 1;
+      }
+    } else if ((a < b) != !!reverse) {
+      j += k;
+      k = 1;
+      *period = j - ms;
+    } else {
+      ms = j;
+      j = ms+1;
+      k = *period = 1;
+    }
+  }
+
+  return ms;
+}
+
+void scan_needle_init(scan_needle* needle, const byte* data, unsigned len) {
+  long m = len, i, j, p, q;
+
+  needle->data = data;
+  needle->len = len;
+  if (!len) {
+    needle->split = -1;
+    needle->period = 1;
+    needle->periodic = 0;
+    return;
+  }
+
+  i = max_suffix(data, m, &p, 0);
+  j = max_suffix(data, m, &q, 1);
+  if (i > j) {
+    needle->split = i;
+    needle->period = p;
+  } else {
+    needle->split = j;
+    needle->period = q;
+  }
+
+  needle->periodic =
+    !memcmp(data, data + needle->period, needle->split+1);
+  if (!needle->periodic)
+    needle->period = (needle->split+1 > m - needle->split - 1?
+                      needle->split+1 : m - needle->split - 1) + 1;
+}
+
+int scan_needle_find(const scan_needle* needle, const byte* y,
+                     unsigned n, unsigned* at) {
+  const byte* x = needle->data;
+  long m = needle->len, ell = needle->split, per = needle->period;
+  const byte* next;
+  long i, memory = -1;
+  unsigned j = 0;
+
+  if (!m) {
+    *at = 0;
+    return 1;
+  }
+  if ((unsigned)m > n) return 0;
+
+  while (j <= n - m) {
+    /* No match can begin before the next place the first byte of the right
+     * half appears, which memchr() finds fastest.
+     */
+    if (memory == -1) {
+      next = memchr(y + j + ell+1, x[ell+1], n - m - j + 1);
+      if (!next) return 0;
+      j = next - (y + ell+1);
+    }
+
+    /* Match the right half left to right... */
+    i = (ell > memory? ell : memory) + 1;
+    while (i < m && x[i] == y[i+j]) ++i;
+    if (i < m) {
+      j += i - ell;
+      memory = -1;
+      continue;
+    }
+
+    /* ...then the left half right to left. */
+    i = ell;
+    while (i > memory && x[i] == y[i+j]) --i;
+    if (i <= memory) {
+      *at = j;
+      return 1;
+    }
+
+    j += per;
+    if (needle->periodic)
+      memory = m - per - 1;
+  }
+
+  return 0;
+}
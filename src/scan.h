@@ -0,0 +1,74 @@
+/* Contains functions for quickly scanning strings for bytes belonging to small
+ * sets, and for substrings.
+ *
+ * Sets of up to SCAN_SET_VECTOR bytes are searched for 16 bytes at a time
+ * with SSE2, or 32 at a time with AVX2 if the processor supports it (this
+ * being determined at run time); other sets, and other architectures, use a
+ * table lookup per byte. Substrings are found with the Two-Way algorithm, in
+ * linear time and constant space.
+ */
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include "tgl.h"
+
+/* The largest set which can be searched for with vector instructions. */
+#define SCAN_SET_VECTOR 12
+
+/* A set of bytes. */
+typedef struct scan_set {
+  /* The members of the set, if there are at most SCAN_SET_VECTOR. */
+  byte bytes[SCAN_SET_VECTOR];
+  /* The number of members. */
+  unsigned count;
+  /* Non-zero for each member. */
+  byte member[256];
+} scan_set;
+
+/* Initialises the given set to be empty. */
+void scan_set_init(scan_set*);
+
+/* Adds the given byte to the given set. */
+void scan_set_add(scan_set*, byte);
+
+/* Adds every byte for which isspace() is true to the given set. */
+void scan_set_add_space(scan_set*);
+
+/* Returns the offset of the first byte of data (of length len) which is in the
+ * given set, or len if there is none.
+ */
+unsigned scan_for(const scan_set*, const byte* data, unsigned len);
+
+/* Returns the offset of the first byte of data (of length len) which is not in
+ * the given set, or len if there is none.
+ */
+unsigned scan_past(const scan_set*, const byte* data, unsigned len);
+
+/* A string prepared for searching with scan_needle_find(). */
+typedef struct scan_needle {
+  /* The string itself; not owned. */
+  const byte* data;
+  unsigned len;
+  /* The critical factorisation of the string: the last index of its left
+   * half, and its period.
+   */
+  long split, period;
+  /* Whether the period applies to the whole string. */
+  int periodic;
+} scan_needle;
+
+/* Prepares the given string of the given length for searching. The string
+ * must remain valid while the needle is in use.
+ */
+void scan_needle_init(scan_needle*, const byte* data, unsigned len);
+
+/* Searches for the first occurrence of the given needle in the given string of
+ * the given length.
+ *
+ * Returns 1 and stores the offset of the occurrence in *at if found; returns 0
+ * otherwise.
+ */
+int scan_needle_find(const scan_needle*, const byte* haystack, unsigned len,
+                     unsigned* at);
+
+#endif /* SCAN_H_ */
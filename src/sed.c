@@ -0,0 +1,563 @@
+/* Implementation of the in-process sed subset. See sed.h. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <regex.h>
+
+#include "tgl.h"
+#include "strings.h"
+#include "sed.h"
+
+/* The maximum number of compiled scripts kept in the cache; when exceeded,
+ * the cache is emptied.
+ */
+#define MAX_CACHED_SCRIPTS 256
+
+/* Part of the replacement of an s command: either literal text, or a group
+ * of the match (0 being the whole match).
+ */
+typedef struct sed_part {
+  /* -1 for literal text, otherwise the group number. */
+  int group;
+  /* The literal text, as offsets into sed_command::literal. */
+  unsigned begin, len;
+} sed_part;
+
+/* A single compiled s or y command. */
+typedef struct sed_command {
+  byte type;
+  /* For s */
+  regex_t regex;
+  string literal;
+  sed_part* parts;
+  unsigned num_parts;
+  unsigned occurrence;
+  int global;
+  /* For y */
+  byte map[256];
+} sed_command;
+
+typedef struct sed_script {
+  sed_command* commands;
+  unsigned num_commands;
+} sed_script;
+
+/* Cache of compiled scripts. This is an open-addressed hash table keyed by the
+ * script text; a NULL compiled script indicates a script outside the supported
+ * subset.
+ */
+static struct cached_script {
+  char* text;
+  sed_script* script;
+}* script_cache;
+static unsigned script_cache_size, script_cache_count;
+
+/* FNV-1a hash of the given script. */
+static unsigned hash_script(const char* text) {
+  unsigned hash = 2166136261u;
+
+  for (; *text; ++text) {
+    hash ^= (byte)*text;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/* Frees the given compiled script. */
+static void free_script(sed_script* script) {
+  unsigned i;
+
+  if (!script) return;
+  for (i = 0; i < script->num_commands; ++i) {
+    if (script->commands[i].type == 's') {
+      regfree(&script->commands[i].regex);
+      free(script->commands[i].literal);
+      free(script->commands[i].parts);
+    }
+  }
+  free(script->commands);
+  free(script);
+}
+
+/* Returns whether the given character is special in extended regular
+ * expressions.
+ */
+static int is_regex_special(byte ch) {
+  return ch && strchr(".[]()*+?{}|^$\\", ch);
+}
+
+/* Reads a section of an s or y command, delimited by delim, starting at *p,
+ * and leaves *p after the closing delimiter. Backslash-escapes are kept, other
+ * than for the delimiter.
+ *
+ * Returns a new string holding the section, or NULL if the delimiter is not
+ * found or an escaped delimiter cannot be represented.
+ */
+static string read_section(const char** p, byte delim, int is_regex) {
+  string result = empty_string();
+  byte ch, esc[2];
+
+  for (; **p && (byte)**p != delim; ++*p) {
+    ch = **p;
+    if (ch == '\\') {
+      ++*p;
+      if (!**p) break;
+      if ((byte)**p == delim) {
+        /* An escaped delimiter is the delimiter itself, which would change
+         * meaning if it were special.
+         */
+        if (is_regex && is_regex_special(delim)) break;
+        esc[0] = delim;
+        result = append_data(result, esc, esc+1);
+        continue;
+      }
+      esc[0] = '\\';
+      esc[1] = **p;
+      result = append_data(result, esc, esc+2);
+      continue;
+    }
+    result = append_data(result, &ch, &ch+1);
+  }
+
+  if ((byte)**p != delim) {
+    free(result);
+    return NULL;
+  }
+
+  ++*p;
+  return result;
+}
+
+/* Converts the escapes in the given regex section which sed interprets itself
+ * into the characters they represent, leaving the rest for regcomp().
+ *
+ * Returns a new NUL-terminated string, or NULL if an unsupported escape is
+ * used.
+ */
+static char* convert_regex(string section) {
+  char* result = tmalloc(section->len + 1), * out = result;
+  byte* in = string_data(section), * end = in + section->len;
+
+  for (; in != end; ++in) {
+    if (*in == '\\' && in+1 != end) {
+      ++in;
+      if (*in == 'n')
+        *out++ = '\n';
+      else if (*in == 't')
+        *out++ = '\t';
+      else if (is_regex_special(*in) || strchr("wWsSbB<>/123456789", *in)) {
+        *out++ = '\\';
+        *out++ = *in;
+      } else {
+        free(result);
+        return NULL;
+      }
+    } else {
+      *out++ = *in;
+    }
+  }
+
+  *out = 0;
+  return result;
+}
+
+/* Parses the given replacement section into the given command.
+ *
+ * Returns 1 on success, 0 if unsupported.
+ */
+static int parse_replacement(sed_command* cmd, string section) {
+  byte* in = string_data(section), * end = in + section->len, ch;
+
+  cmd->literal = empty_string();
+  cmd->parts = tmalloc(sizeof(sed_part) * (section->len + 1));
+  cmd->num_parts = 0;
+
+#define PART(g) (cmd->parts[cmd->num_parts].group = (g),                \
+                 cmd->parts[cmd->num_parts].begin = cmd->literal->len,  \
+                 cmd->parts[cmd->num_parts++].len = 0)
+#define LITERAL(c) do {                                                 \
+    ch = (c);                                                           \
+    if (!cmd->num_parts || cmd->parts[cmd->num_parts-1].group != -1)    \
+      PART(-1);                                                         \
+    cmd->literal = append_data(cmd->literal, &ch, &ch+1);               \
+    ++cmd->parts[cmd->num_parts-1].len;                                 \
+  } while (0)
+
+  for (; in != end; ++in) {
+    if (*in == '&') {
+      PART(0);
+    } else if (*in == '\\' && in+1 != end) {
+      ++in;
+      if (*in >= '1' && *in <= '9') {
+        if ((size_t)(*in - '0') > cmd->regex.re_nsub) return 0;
+        PART(*in - '0');
+      } else if (*in == 'n') {
+        LITERAL('\n');
+      } else if (*in == 't') {
+        LITERAL('\t');
+      } else if (*in == '\\' || *in == '&' || *in == '\n' ||
+                 !isalnum(*in)) {
+        LITERAL(*in);
+      } else {
+        return 0;
+      }
+    } else {
+      LITERAL(*in);
+    }
+  }
+
+#undef LITERAL
+#undef PART
+  return 1;
+}
+
+/* Parses an s command beginning at *p (just after the s).
+ *
+ * Returns 1 on success, 0 if unsupported.
+ */
+static int parse_s(sed_command* cmd, const char** p) {
+  string regex_section = NULL, replacement_section = NULL;
+  char* regex = NULL;
+  int cflags = REG_EXTENDED, ok = 0;
+  byte delim = **p;
+
+  cmd->type = 's';
+  cmd->occurrence = 1;
+  cmd->global = 0;
+  cmd->literal = NULL;
+  cmd->parts = NULL;
+  if (!delim || delim == '\\' || delim == '\n') return 0;
+  ++*p;
+
+  if (!(regex_section = read_section(p, delim, 1)) ||
+      !(replacement_section = read_section(p, delim, 0)) ||
+      /* An empty regex means the last one used, which isn't supported. */
+      !regex_section->len ||
+      !(regex = convert_regex(regex_section)))
+    goto done;
+
+  /* Flags */
+  for (; **p && **p != ';' && !isspace(**p); ++*p) {
+    if (**p == 'g') {
+      cmd->global = 1;
+    } else if (**p == 'i' || **p == 'I') {
+      cflags |= REG_ICASE;
+    } else if (**p >= '1' && **p <= '9') {
+      cmd->occurrence = strtoul(*p, (char**)p, 10);
+      --*p;
+    } else {
+      goto done;
+    }
+  }
+
+  if (regcomp(&cmd->regex, regex, cflags))
+    goto done;
+  /* Type is only set to s once the regex needs freeing. */
+  cmd->type = 0;
+  if (!parse_replacement(cmd, replacement_section)) {
+    regfree(&cmd->regex);
+    free(cmd->literal);
+    free(cmd->parts);
+    goto done;
+  }
+  cmd->type = 's';
+  ok = 1;
+
+  done:
+  if (regex_section) free(regex_section);
+  if (replacement_section) free(replacement_section);
+  if (regex) free(regex);
+  return ok;
+}
+
+/* Converts the escapes in the given y section.
+ *
+ * Returns a new string, or NULL if unsupported.
+ */
+static string convert_y(string section) {
+  string result = empty_string();
+  byte* in = string_data(section), * end = in + section->len, ch;
+
+  for (; in != end; ++in) {
+    ch = *in;
+    if (ch == '\\' && in+1 != end) {
+      ++in;
+      if (*in == 'n') ch = '\n';
+      else if (*in == 't') ch = '\t';
+      else if (*in == '\\') ch = '\\';
+      else {
+        free(result);
+        return NULL;
+      }
+    }
+    result = append_data(result, &ch, &ch+1);
+  }
+
+  return result;
+}
+
+/* Parses a y command beginning at *p (just after the y).
+ *
+ * Returns 1 on success, 0 if unsupported.
+ */
+static int parse_y(sed_command* cmd, const char** p) {
+  string sections[2] = { NULL, NULL }, from = NULL, to = NULL;
+  unsigned i;
+  int ok = 0;
+  byte delim = **p;
+
+  cmd->type = 0;
+  if (!delim || delim == '\\' || delim == '\n') return 0;
+  ++*p;
+
+  if (!(sections[0] = read_section(p, delim, 0)) ||
+      !(sections[1] = read_section(p, delim, 0)) ||
+      !(from = convert_y(sections[0])) ||
+      !(to = convert_y(sections[1])) ||
+      from->len != to->len)
+    goto done;
+
+  for (i = 0; i < 256; ++i)
+    cmd->map[i] = i;
+  for (i = 0; i < from->len; ++i)
+    cmd->map[string_data(from)[i]] = string_data(to)[i];
+  cmd->type = 'y';
+  ok = 1;
+
+  done:
+  for (i = 0; i < 2; ++i)
+    if (sections[i]) free(sections[i]);
+  if (from) free(from);
+  if (to) free(to);
+  return ok;
+}
+
+/* Compiles the given script.
+ *
+ * Returns the compiled script, or NULL if it is unsupported.
+ */
+static sed_script* compile_script(const char* text) {
+  sed_script* script;
+  const char* p;
+
+  /* Only plain ASCII is supported, so that locale never matters. */
+  for (p = text; *p; ++p)
+    if ((byte)*p >= 0x80)
+      return NULL;
+
+  script = tmalloc(sizeof(sed_script));
+  script->commands = tmalloc(sizeof(sed_command) * (strlen(text)/3 + 1));
+  script->num_commands = 0;
+
+  p = text;
+  for (;;) {
+    while (isspace(*p) || *p == ';') ++p;
+    if (!*p) break;
+
+    if (*p == 's') {
+      ++p;
+      if (!parse_s(script->commands + script->num_commands, &p))
+        goto unsupported;
+    } else if (*p == 'y') {
+      ++p;
+      if (!parse_y(script->commands + script->num_commands, &p))
+        goto unsupported;
+    } else {
+      goto unsupported;
+    }
+    ++script->num_commands;
+
+    while (isspace(*p)) ++p;
+    if (*p && *p != ';') goto unsupported;
+  }
+
+  return script;
+
+  unsupported:
+  free_script(script);
+  return NULL;
+}
+
+/* Returns the cached compilation of the given script, compiling it if
+ * necessary. Returns NULL if the script is unsupported.
+ */
+static sed_script* get_script(const char* text) {
+  struct cached_script* slot, * old;
+  unsigned ix, old_size, i;
+
+  if (script_cache) {
+    ix = hash_script(text) & (script_cache_size-1);
+    while (script_cache[ix].text && strcmp(script_cache[ix].text, text))
+      ix = (ix+1) & (script_cache_size-1);
+    if (script_cache[ix].text) return script_cache[ix].script;
+  }
+
+  /* Keep the table at most half full, and bounded in size. */
+  if (script_cache_count >= MAX_CACHED_SCRIPTS) {
+    for (i = 0; i < script_cache_size; ++i) {
+      if (script_cache[i].text) {
+        free(script_cache[i].text);
+        free_script(script_cache[i].script);
+      }
+    }
+    memset(script_cache, 0, script_cache_size * sizeof(struct cached_script));
+    script_cache_count = 0;
+  }
+  if (2*(script_cache_count+1) > script_cache_size) {
+    old = script_cache;
+    old_size = script_cache_size;
+    script_cache_size = old_size? old_size*2 : 32;
+    script_cache = tmalloc(script_cache_size * sizeof(struct cached_script));
+    memset(script_cache, 0, script_cache_size * sizeof(struct cached_script));
+    for (i = 0; i < old_size; ++i) {
+      if (old[i].text) {
+        ix = hash_script(old[i].text) & (script_cache_size-1);
+        while (script_cache[ix].text)
+          ix = (ix+1) & (script_cache_size-1);
+        script_cache[ix] = old[i];
+      }
+    }
+    if (old) free(old);
+  }
+
+  ix = hash_script(text) & (script_cache_size-1);
+  while (script_cache[ix].text)
+    ix = (ix+1) & (script_cache_size-1);
+  slot = script_cache + ix;
+  slot->text = tmalloc(strlen(text)+1);
+  strcpy(slot->text, text);
+  slot->script = compile_script(text);
+  ++script_cache_count;
+  return slot->script;
+}
+
+/* Finds the next match of the given regex in the line [0,len), starting at
+ * offset start. Offsets in match are relative to the start of the line.
+ *
+ * Returns 1 if a match was found, 0 otherwise.
+ */
+static int find_match(regex_t* regex, const char* line, unsigned start,
+                      unsigned len, regmatch_t match[10]) {
+#ifdef REG_STARTEND
+  match[0].rm_so = start;
+  match[0].rm_eo = len;
+  return !regexec(regex, line, 10, match, REG_STARTEND);
+#else
+  unsigned i;
+
+  if (regexec(regex, line+start, 10, match, start? REG_NOTBOL : 0))
+    return 0;
+  for (i = 0; i < 10; ++i) {
+    if (match[i].rm_so != -1) {
+      match[i].rm_so += start;
+      match[i].rm_eo += start;
+    }
+  }
+  return 1;
+#endif
+}
+
+/* Applies the given s command to the given pattern space (which must be
+ * NUL-terminated), appending the result to out.
+ */
+static string apply_s(sed_command* cmd, const char* line, unsigned len,
+                      string out) {
+  regmatch_t match[10];
+  unsigned pos = 0, count = 0, i, begin, end;
+  signed prev_end = -1;
+  sed_part* part;
+
+  while (pos <= len && find_match(&cmd->regex, line, pos, len, match)) {
+    begin = match[0].rm_so;
+    end = match[0].rm_eo;
+
+    /* An empty match immediately after the previous match doesn't count. */
+    if (begin == end && (signed)begin == prev_end) {
+      if (begin >= len) break;
+      out = append_data(out, (char*)line+begin, (char*)line+begin+1);
+      pos = begin+1;
+      continue;
+    }
+
+    ++count;
+    out = append_data(out, (char*)line+pos, (char*)line+begin);
+    if (count >= cmd->occurrence) {
+      for (i = 0; i < cmd->num_parts; ++i) {
+        part = cmd->parts+i;
+        if (part->group == -1)
+          out = append_data(out, string_data(cmd->literal) + part->begin,
+                            string_data(cmd->literal) + part->begin +
+                            part->len);
+        else if (match[part->group].rm_so != -1)
+          out = append_data(out, (char*)line + match[part->group].rm_so,
+                            (char*)line + match[part->group].rm_eo);
+      }
+    } else {
+      out = append_data(out, (char*)line+begin, (char*)line+end);
+    }
+    prev_end = end;
+    pos = end;
+
+    if (!cmd->global && count >= cmd->occurrence) break;
+
+    if (begin == end) {
+      if (end >= len) break;
+      out = append_data(out, (char*)line+end, (char*)line+end+1);
+      pos = end+1;
+    }
+  }
+
+  if (pos < len)
+    out = append_data(out, (char*)line+pos, (char*)line+len);
+  return out;
+}
+
+int sed_run(const char* text, string input, string* output) {
+  sed_script* script;
+  string line, next;
+  unsigned begin, end, i, j;
+  byte* data = string_data(input);
+
+  for (i = 0; i < input->len; ++i)
+    if (data[i] >= 0x80 || !data[i])
+      return 0;
+
+  if (!(script = get_script(text)))
+    return 0;
+
+  *output = empty_string();
+  line = empty_string();
+  for (begin = 0; begin < input->len; begin = end+1) {
+    for (end = begin; end < input->len && data[end] != '\n'; ++end);
+
+    free(line);
+    line = create_string(data+begin, data+end);
+    for (i = 0; i < script->num_commands; ++i) {
+      if (script->commands[i].type == 'y') {
+        for (j = 0; j < line->len; ++j)
+          string_data(line)[j] = script->commands[i].map[string_data(line)[j]];
+      } else {
+        /* Terminate for regexec() */
+        line = append_data(line, "", ""+1);
+        --line->len;
+        next = apply_s(script->commands+i, (char*)string_data(line),
+                       line->len, empty_string());
+        free(line);
+        line = next;
+      }
+    }
+
+    *output = append_string(*output, line);
+    if (end < input->len)
+      *output = append_data(*output, "\n", "\n"+1);
+  }
+
+  free(line);
+  return 1;
+}
@@ -0,0 +1,30 @@
+/* Contains an in-process implementation of a subset of sed, used by the j
+ * builtin to avoid starting an external sed for simple scripts.
+ *
+ * The supported subset is any sequence of the following commands, separated by
+ * semicolons and optional whitespace:
+ *   s/regex/replacement/flags
+ *     With POSIX extended regular expression semantics, as for "sed -r". The
+ *     flags may be any combination of g, i (or I) and a positive occurrence
+ *     number. The replacement may contain &, \1 to \9, \n, \t, and escaped
+ *     backslashes, ampersands and delimiters.
+ *   y/source/dest/
+ * Any delimiter may be used in place of /. Scripts using anything else, and
+ * inputs which are not plain ASCII, are not supported.
+ *
+ * Compiled scripts are cached by their text.
+ */
+#ifndef SED_H_
+#define SED_H_
+
+#include "strings.h"
+
+/* Runs the given sed script on the given input.
+ *
+ * Returns 1 and stores the output in *output if the script and input are
+ * within the supported subset; returns 0 otherwise, in which case the caller
+ * must run an external sed instead.
+ */
+int sed_run(const char* script, string input, string* output);
+
+#endif /* SED_H_ */
@@ -71,15 +71,43 @@ int string_equals(string a, string b) {
 }
 
 int string_to_int(string s, signed* dst) {
+  return data_to_int(string_data(s), s->len, dst);
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/* Returns the value of the eight decimal digits at dat, or -1 if they are not
+ * all digits. The digits are handled all at once in a 64-bit word: each
+ * multiplication combines adjacent groups of digits into one group of twice
+ * the width.
+ */
+static long eight_digits(const byte* dat) {
+  unsigned long long v;
+
+  memcpy(&v, dat, sizeof(v));
+  if ((v & 0xF0F0F0F0F0F0F0F0ULL) != 0x3030303030303030ULL ||
+      ((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) !=
+      0x3030303030303030ULL)
+    return -1;
+
+  v = (v & 0x0F0F0F0F0F0F0F0FULL) * 2561 >> 8;
+  v = (v & 0x00FF00FF00FF00FFULL) * 6553601 >> 16;
+  v = (v & 0x0000FFFF0000FFFFULL) * 42949672960001ULL >> 32;
+  return (long)v;
+}
+#endif
+
+int data_to_int(const byte* dat, unsigned len, signed* dst) {
   int negative = 0;
-  signed result = 0;
+  unsigned result = 0;
   unsigned i = 0, base = 10, digit;
-  byte* dat = string_data(s);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  long digits;
+#endif
 
   /* Skip leading whitespace. */
-  while (i < s->len && isspace(dat[i])) ++i;
+  while (i < len && isspace(dat[i])) ++i;
   /* If no non-whitespace is present, not a valid integer. */
-  if (i >= s->len) return 0;
+  if (i >= len) return 0;
 
   /* Check for leading sign */
   if (dat[i] == '+') {
@@ -89,13 +117,13 @@ int string_to_int(string s, signed* dst) {
     negative = 1;
   }
 
-  if (i >= s->len) return 0;
+  if (i >= len) return 0;
 
   /* Possible leading base */
   if (dat[i] == '0') {
     ++i;
     /* Handle 0 by itself */
-    if (i == s->len) {
+    if (i == len) {
       *dst = 0;
       return 1;
     } else if (isspace(dat[i])) {
@@ -107,20 +135,29 @@ int string_to_int(string s, signed* dst) {
     if (dat[i] == 'x' || dat[i] == 'X') {
       base = 16;
       ++i;
-      if (i >= s->len) return 0;
+      if (i >= len) return 0;
     } else if (dat[i] == 'b' || dat[i] == 'B') {
       base = 2;
       ++i;
-      if (i >= s->len) return 0;
+      if (i >= len) return 0;
     } else if (dat[i] == 'o' || dat[i] == 'O') {
       base = 8;
       ++i;
-      if (i >= s->len) return 0;
+      if (i >= len) return 0;
     }
   }
 
-  /* Read the rest of the number */
-  for (; i < s->len; ++i) {
+  /* Read the rest of the number, eight decimal digits at a time where
+   * possible.
+   */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (base == 10)
+    while (len - i >= 8 && (digits = eight_digits(dat+i)) >= 0) {
+      result = result * 100000000u + (unsigned)digits;
+      i += 8;
+    }
+#endif
+  for (; i < len; ++i) {
     if (dat[i] >= '0' && dat[i] <= '9')
       digit = dat[i] - '0';
     else if (dat[i] >= 'a' && dat[i] <= 'f')
@@ -140,14 +177,14 @@ int string_to_int(string s, signed* dst) {
 
   trailing_space:
   /* Skip trailing whitespace */
-  while (i < s->len && isspace(dat[i])) ++i;
+  while (i < len && isspace(dat[i])) ++i;
 
   /* Must have hit the end of the string by this point. */
-  if (i < s->len) return 0;
+  if (i < len) return 0;
 
   /* Everything was OK */
   if (negative) result = -result;
-  *dst = result;
+  *dst = (signed)result;
   return 1;
 }
 
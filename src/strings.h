@@ -59,6 +59,11 @@ int string_equals(string, string);
  */
 int string_to_int(string, signed*);
 
+/* Like string_to_int(), but interprets the given memory region of the given
+ * length, so that integers within larger strings can be read in place.
+ */
+int data_to_int(const byte*, unsigned, signed*);
+
 /* Converts the given string to a boolean value. */
 int string_to_bool(string);
 
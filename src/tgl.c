@@ -11,6 +11,7 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <limits.h>
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -24,10 +25,15 @@
 #include "tgl.h"
 #include "strings.h"
 #include "interp.h"
+#include "library.h"
+#include "histlog.h"
+#include "cmdcache.h"
+#include "timing.h"
 #include "builtins/payload.h"
 
 char* user_library_file, * current_context;
 int suppress_unknown_alignment_warning;
+unsigned long total_allocations, total_bytes_read, total_bytes_written;
 
 /* BEGIN: Persistence */
 
@@ -142,6 +148,7 @@ static int read_persistent_registers(interpreter* interp, char* filename) {
         return 0;
       }
     }
+    total_bytes_read += sizeof(header) + s->len;
 
     /* Save the register */
     free(interp->registers[i]);
@@ -188,6 +195,7 @@ static int write_persistent_registers(interpreter* interp, char* filename) {
           fwrite(string_data(interp->registers[i]), 1,
                  interp->registers[i]->len, file))
         goto error;
+    total_bytes_written += sizeof(header) + interp->registers[i]->len;
   }
 
   /* Success */
@@ -232,11 +240,14 @@ static int exec_file(interpreter* interp, FILE* file,
 
   interp->enable_history = enable_history;
 
+  timing_begin(PHASE_READ_INPUT);
   input = empty_string();
   while (!feof(file) && !ferror(file)) {
     len = fread(buffer, 1, sizeof(buffer), file);
     input = append_data(input, buffer, buffer+len);
+    total_bytes_read += len;
   }
+  timing_end(PHASE_READ_INPUT);
 
   if (ferror(file)) {
     perror("fread");
@@ -252,19 +263,27 @@ static int exec_file(interpreter* interp, FILE* file,
                                                string_data(input)+i);
   }
 
-  if (prefix_payload)
+  if (prefix_payload) {
+    timing_begin(PHASE_EXTRACT_PREFIX);
     input = payload_extract_prefix(input, interp);
+    timing_end(PHASE_EXTRACT_PREFIX);
+  }
 
   if (set_global_code)
     interp->payload.global_code = input;
 
+  timing_begin(PHASE_EXECUTE);
   if (!exec_code(interp, input))
     status = EXIT_PROGRAM_ERROR;
+  /* Output is part of execution, even if it was buffered. */
+  fflush(stdout);
+  timing_end(PHASE_EXECUTE);
 
   if (set_global_code)
     interp->payload.global_code = NULL;
 
   /* Add to history if appropriate */
+  timing_begin(PHASE_HISTORY);
   if (enable_history && interp->enable_history && status == 0) {
     /* Exclude the command sequence "hX" from history. */
     for (i = 0; i < input->len && isspace(string_data(input)[i]); ++i);
@@ -276,39 +295,20 @@ static int exec_file(interpreter* interp, FILE* file,
       }
     }
 
-    if (enable_history) {
-      /* Shift registers 0..30 back */
-      free(interp->registers[0x1F]);
-      memmove(interp->registers+1, interp->registers, 0x1F*sizeof(string));
-      memmove(interp->reg_access+1, interp->reg_access, 0x1F*sizeof(time_t));
-      /* Log new history */
-      interp->registers[0] = dupe_string(input);
-      touch_reg(interp, 0);
-    }
+    if (enable_history)
+      histlog_append(input);
   }
+  timing_end(PHASE_HISTORY);
 
   free(input);
   return status;
 }
 
-/* Opens and executes the user library, then clears the stack. */
+/* Loads the user library, then clears the stack. */
 static void load_user_library(interpreter* interp) {
-  FILE* file;
   int status;
 
-  file = fopen(user_library_file, "r");
-  if (!file) {
-    /* If the file doesn't exist, ignore silently; otherwise, print a
-     * diagnostic.
-     */
-    if (errno != ENOENT)
-      fprintf(stderr, "tgl: unable to open user library: %s\n",
-              strerror(errno));
-    return;
-  }
-
-  status = exec_file(interp, file, 0, 0, 0, 0);
-  fclose(file);
+  status = library_load(interp);
 
   /* Clear the stack and reset history offset */
   while (interp->stack)
@@ -316,7 +316,7 @@ static void load_user_library(interpreter* interp) {
   interp->history_offset = 0;
 
   /* Print notice about error in the user library if any occurred */
-  if (status)
+  if (!status)
     fprintf(stderr, "tgl: error occurred in user library\n");
 }
 
@@ -330,6 +330,17 @@ static void print_usage(void) {
 "                                   ~/.tgl_registers) to preserve registers.\n"
 "  -c, --context name               Specify the current context.\n"
 "  -p, --prefix-payload             Look for payload at the beginning of code\n"
+"  -L, --history-log file           Use the given file (instead of\n"
+"                                   ~/.tgl_history) to store history.\n"
+"  -D, --history-depth n            Keep n entries of history (default 1024).\n"
+"  -T, --timing dest                Report time spent in each phase of the\n"
+"                                   run to dest (- for standard error).\n"
+"  -k, --cache-commands             Cache the results of all external\n"
+"                                   commands.\n"
+"  -K, --command-cache dir          Use the given directory (instead of\n"
+"                                   ~/.tgl_cache) to cache command results.\n"
+"  -S, --command-cache-size n       Limit cached command results to n\n"
+"                                   kilobytes (default 65536).\n"
 /* -A doesn't need to be shown here. */
 "  -h, --help                       This help message.\n"
     );
@@ -340,6 +351,14 @@ static void print_usage(void) {
 "           registers.\n"
 "  -c name  Specify the current context.\n"
 "  -p       Look for payload at beginning of code\n"
+"  -L file  Use the given file (instead of ~/.tgl_history) to store history.\n"
+"  -D n     Keep n entries of history (default 1024).\n"
+"  -T dest  Report time spent in each phase of the run to dest (- for\n"
+"           standard error).\n"
+"  -k       Cache the results of all external commands.\n"
+"  -K dir   Use the given directory (instead of ~/.tgl_cache) to cache\n"
+"           command results.\n"
+"  -S n     Limit cached command results to n kilobytes (default 65536).\n"
 /* -A doesn't need to be shown here. */
 "  -h       This help message.\n"
     );
@@ -350,10 +369,15 @@ int main(int argc, char** argv) {
   interpreter interp;
   char reg_persistence_file_default[256];
   char user_library_file_default[256];
+  char history_log_file_default[256];
+  char command_cache_dir_default[256];
   char* reg_persistence_file;
   int ret, cmdstat, prefix_payload = 0;
+  unsigned long cache_kb;
+  long depth;
+  char* end;
   FILE* input;
-  static char short_options[] = "l:r:c:Aph";
+  static char short_options[] = "l:r:c:ApL:D:T:kK:S:h";
 #ifdef _GNU_SOURCE
   static struct option long_options[] = {
    { "library", 1, NULL, 'l' },
@@ -361,6 +385,12 @@ int main(int argc, char** argv) {
    { "context", 1, NULL, 'c' },
    { "suppress-alignment-warning", 0, NULL, 'A' },
    { "prefix-payload", 0, NULL, 'p' },
+   { "history-log", 1, NULL, 'L' },
+   { "history-depth", 1, NULL, 'D' },
+   { "timing", 1, NULL, 'T' },
+   { "cache-commands", 0, NULL, 'k' },
+   { "command-cache", 1, NULL, 'K' },
+   { "command-cache-size", 1, NULL, 'S' },
    { "help", 0, NULL, 'h' },
    {0},
   };
@@ -375,10 +405,24 @@ int main(int argc, char** argv) {
            sizeof(user_library_file_default),
            "%s/.tgl",
            getenv("HOME"));
+  snprintf(history_log_file_default,
+           sizeof(history_log_file_default),
+           "%s/.tgl_history",
+           getenv("HOME"));
+  snprintf(command_cache_dir_default,
+           sizeof(command_cache_dir_default),
+           "%s/.tgl_cache",
+           getenv("HOME"));
   user_library_file = user_library_file_default;
+  history_log_file = history_log_file_default;
+  history_depth = 1024;
+  command_cache_dir = command_cache_dir_default;
+  command_cache_size = 65536 * 1024ul;
   reg_persistence_file = reg_persistence_file_default;
   current_context = "";
   input = stdin;
+  if (getenv("TGL_TIMING") && *getenv("TGL_TIMING"))
+    timing_enable(getenv("TGL_TIMING"));
 
   /* Parse command-line arguments */
   do {
@@ -413,6 +457,41 @@ int main(int argc, char** argv) {
     case 'p':
       prefix_payload = 1;
       break;
+
+    case 'L':
+      history_log_file = optarg;
+      break;
+
+    case 'D':
+      errno = 0;
+      depth = strtol(optarg, &end, 10);
+      if (!*optarg || *end || errno || depth < 0 || depth > UINT_MAX) {
+        fprintf(stderr, "tgl: invalid history depth: %s\n", optarg);
+        print_usage();
+        return EXIT_HELP;
+      }
+      history_depth = depth;
+      break;
+
+    case 'T':
+      timing_enable(optarg);
+      break;
+
+    case 'k':
+      cache_all_commands = 1;
+      break;
+
+    case 'K':
+      command_cache_dir = optarg;
+      break;
+
+    case 'S':
+      if (1 != sscanf(optarg, "%lu", &cache_kb)) {
+        fprintf(stderr, "tgl: invalid command cache size: %s\n", optarg);
+        return EXIT_HELP;
+      }
+      command_cache_size = cache_kb * 1024;
+      break;
     }
   } while (cmdstat != -1);
 
@@ -433,17 +512,27 @@ int main(int argc, char** argv) {
   }
 
   srand(time(NULL));
+  timing_begin(PHASE_INIT);
   interp_init(&interp);
+  timing_end(PHASE_INIT);
 
   /* Read persistent registers */
+  timing_begin(PHASE_READ_REGISTERS);
   read_persistent_registers(&interp, reg_persistence_file);
+  histlog_migrate(&interp);
+  timing_end(PHASE_READ_REGISTERS);
   /* Try to execute the user library */
+  timing_begin(PHASE_LOAD_LIBRARY);
   load_user_library(&interp);
+  timing_end(PHASE_LOAD_LIBRARY);
   /* Execute primary input */
   ret = exec_file(&interp, input, 1, 1, 1, prefix_payload);
   /* If successful, save registers */
+  timing_begin(PHASE_WRITE_REGISTERS);
   if (ret == 0)
     write_persistent_registers(&interp, reg_persistence_file);
+  timing_end(PHASE_WRITE_REGISTERS);
+  timing_report();
   /* Done, return status to the OS */
   interp_destroy(&interp);
   return ret;
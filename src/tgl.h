@@ -20,10 +20,15 @@ extern char* user_library_file;
 extern char* current_context;
 /* If set to true, don't emit a warning when architecture detection fails. */
 extern int suppress_unknown_alignment_warning;
+/* Running totals of allocations made through tmalloc() and trealloc(), and of
+ * bytes read and written on behalf of the program. See timing.h.
+ */
+extern unsigned long total_allocations, total_bytes_read, total_bytes_written;
 
 /* Versions of malloc and realloc that abort on memory exhaustion. */
 static inline void* tmalloc(size_t size) {
   void* result = malloc(size);
+  ++total_allocations;
   if (!result) {
     perror("malloc");
     exit(EXIT_OUT_OF_MEMORY);
@@ -32,6 +37,7 @@ static inline void* tmalloc(size_t size) {
 }
 static inline void* trealloc(void* ptr, size_t size) {
   void* result = realloc(ptr, size);
+  ++total_allocations;
   if (!result) {
     perror("realloc");
     exit(EXIT_OUT_OF_MEMORY);
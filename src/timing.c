@@ -0,0 +1,206 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "tgl.h"
+#include "timing.h"
+
+/* Accumulated measurements for one phase. */
+typedef struct phase_totals {
+  /* Wall-clock and CPU time, in nanoseconds. */
+  double wall, cpu;
+  unsigned long bytes_read, bytes_written, allocations;
+} phase_totals;
+
+/* Accumulated measurements for one external command. */
+typedef struct process_totals {
+  char* name;
+  unsigned long calls;
+  /* In nanoseconds */
+  double spawn, run, wait;
+  unsigned long bytes_in, bytes_out;
+} process_totals;
+
+static char* timing_destination;
+static phase_totals totals[NUM_TIMING_PHASES];
+/* State captured by timing_begin(), including the phase in progress, which is
+ * NUM_TIMING_PHASES if there is none.
+ */
+static timing_phase current_phase = NUM_TIMING_PHASES;
+static struct timespec begin_wall, begin_cpu;
+static unsigned long begin_read, begin_written, begin_allocations;
+/* Totals for each distinct command name, in order of first use. */
+static process_totals* processes;
+static unsigned num_processes;
+
+static const char* phase_names[NUM_TIMING_PHASES] = {
+  "interp_init",
+  "read_persistent_registers",
+  "load_user_library",
+  "read_input",
+  "payload_extract_prefix",
+  "execute",
+  "history",
+  "write_persistent_registers",
+};
+
+void timing_enable(char* destination) {
+  timing_destination = destination;
+}
+
+/* Returns the number of nanoseconds from a to b. */
+static double elapsed(struct timespec* a, struct timespec* b) {
+  return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+void timing_begin(timing_phase phase) {
+  if (!timing_destination) return;
+
+  if (current_phase != NUM_TIMING_PHASES)
+    fprintf(stderr, "tgl: warning: timing phase %s begun within %s\n",
+            phase_names[phase], phase_names[current_phase]);
+
+  current_phase = phase;
+  begin_read = total_bytes_read;
+  begin_written = total_bytes_written;
+  begin_allocations = total_allocations;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &begin_cpu);
+  clock_gettime(CLOCK_MONOTONIC, &begin_wall);
+}
+
+void timing_end(timing_phase phase) {
+  struct timespec wall, cpu;
+
+  if (!timing_destination) return;
+
+  /* Time is only attributed to the phase actually in progress. */
+  if (phase != current_phase) {
+    fprintf(stderr, "tgl: warning: timing phase %s ended, but %s is in "
+            "progress\n", phase_names[phase],
+            current_phase == NUM_TIMING_PHASES?
+            "no phase" : phase_names[current_phase]);
+    return;
+  }
+
+  current_phase = NUM_TIMING_PHASES;
+  clock_gettime(CLOCK_MONOTONIC, &wall);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+  totals[phase].wall += elapsed(&begin_wall, &wall);
+  totals[phase].cpu += elapsed(&begin_cpu, &cpu);
+  totals[phase].bytes_read += total_bytes_read - begin_read;
+  totals[phase].bytes_written += total_bytes_written - begin_written;
+  totals[phase].allocations += total_allocations - begin_allocations;
+}
+
+double timing_since(const struct timespec* begin) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return elapsed((struct timespec*)begin, &now);
+}
+
+void timing_process(const char* name, double spawn, double run, double wait,
+                    unsigned long bytes_in, unsigned long bytes_out) {
+  unsigned i;
+
+  if (!timing_destination) return;
+
+  for (i = 0; i < num_processes && strcmp(processes[i].name, name); ++i);
+  if (i == num_processes) {
+    processes = trealloc(processes, sizeof(process_totals) * ++num_processes);
+    memset(processes+i, 0, sizeof(process_totals));
+    processes[i].name = tmalloc(strlen(name)+1);
+    strcpy(processes[i].name, name);
+  }
+
+  ++processes[i].calls;
+  processes[i].spawn += spawn;
+  processes[i].run += run;
+  processes[i].wait += wait;
+  processes[i].bytes_in += bytes_in;
+  processes[i].bytes_out += bytes_out;
+}
+
+/* Writes the given string to the given file as the contents of a JSON string.
+ */
+static void write_json_string(FILE* out, const char* str) {
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\')
+      fprintf(out, "\\%c", *str);
+    else if ((unsigned char)*str < ' ')
+      fprintf(out, "\\u%04x", (unsigned char)*str);
+    else
+      fputc(*str, out);
+  }
+}
+
+void timing_report(void) {
+  FILE* out;
+  unsigned i;
+
+  if (!timing_destination) return;
+
+  if (!strcmp(timing_destination, "-")) {
+    fprintf(stderr, "tgl: %-26s %10s %10s %12s %12s %10s\n",
+            "phase", "wall (ms)", "cpu (ms)", "read (B)", "written (B)",
+            "allocs");
+    for (i = 0; i < NUM_TIMING_PHASES; ++i)
+      fprintf(stderr, "tgl: %-26s %10.3f %10.3f %12lu %12lu %10lu\n",
+              phase_names[i], totals[i].wall / 1e6, totals[i].cpu / 1e6,
+              totals[i].bytes_read, totals[i].bytes_written,
+              totals[i].allocations);
+
+    if (num_processes) {
+      fprintf(stderr, "tgl: %-26s %6s %10s %10s %10s %12s %12s\n",
+              "command", "calls", "spawn (ms)", "run (ms)", "wait (ms)",
+              "in (B)", "out (B)");
+      for (i = 0; i < num_processes; ++i)
+        fprintf(stderr, "tgl: %-26s %6lu %10.3f %10.3f %10.3f %12lu %12lu\n",
+                processes[i].name, processes[i].calls,
+                processes[i].spawn / 1e6, processes[i].run / 1e6,
+                processes[i].wait / 1e6, processes[i].bytes_in,
+                processes[i].bytes_out);
+    }
+    return;
+  }
+
+  out = fopen(timing_destination, "a");
+  if (!out) {
+    fprintf(stderr, "tgl: unable to open %s: %s\n",
+            timing_destination, strerror(errno));
+    return;
+  }
+
+  /* One JSON object per line, so that consecutive runs can be appended to the
+   * same file.
+   */
+  fprintf(out, "{\"context\":\"");
+  write_json_string(out, current_context);
+  fprintf(out, "\",\"phases\":{");
+  for (i = 0; i < NUM_TIMING_PHASES; ++i)
+    fprintf(out, "%s\"%s\":{\"wall_ns\":%.0f,\"cpu_ns\":%.0f,"
+            "\"bytes_read\":%lu,\"bytes_written\":%lu,\"allocations\":%lu}",
+            i? "," : "", phase_names[i], totals[i].wall, totals[i].cpu,
+            totals[i].bytes_read, totals[i].bytes_written,
+            totals[i].allocations);
+  fprintf(out, "},\"commands\":{");
+  for (i = 0; i < num_processes; ++i) {
+    fprintf(out, "%s\"", i? "," : "");
+    write_json_string(out, processes[i].name);
+    fprintf(out, "\":{\"calls\":%lu,\"spawn_ns\":%.0f,\"run_ns\":%.0f,"
+            "\"wait_ns\":%.0f,\"bytes_in\":%lu,\"bytes_out\":%lu}",
+            processes[i].calls, processes[i].spawn, processes[i].run,
+            processes[i].wait, processes[i].bytes_in, processes[i].bytes_out);
+  }
+  fprintf(out, "}}\n");
+
+  if (fclose(out))
+    fprintf(stderr, "tgl: error writing %s: %s\n",
+            timing_destination, strerror(errno));
+}
@@ -0,0 +1,60 @@
+/* Contains functions for measuring where time is spent during a run of TGL. */
+#ifndef TIMING_H_
+#define TIMING_H_
+
+#include <time.h>
+
+/* The phases of a run of TGL which are measured. */
+typedef enum timing_phase {
+  PHASE_INIT = 0,
+  PHASE_READ_REGISTERS,
+  PHASE_LOAD_LIBRARY,
+  PHASE_READ_INPUT,
+  PHASE_EXTRACT_PREFIX,
+  PHASE_EXECUTE,
+  PHASE_HISTORY,
+  PHASE_WRITE_REGISTERS,
+  NUM_TIMING_PHASES
+} timing_phase;
+
+/* Enables timing, reporting to the given destination when timing_report() is
+ * called. The destination "-" indicates a human-readable report on standard
+ * error; anything else is a file to which one line of JSON is appended.
+ *
+ * The destination string is not copied.
+ */
+void timing_enable(char* destination);
+
+/* Marks the beginning of the given phase. Phases must not be nested; a
+ * warning is printed if another phase is still in progress, which is then
+ * abandoned.
+ */
+void timing_begin(timing_phase);
+
+/* Marks the end of the given phase, which must be the one in progress.
+ * Time, I/O and allocations since the phase began are added to its totals. If
+ * another phase is in progress, a warning is printed and nothing is recorded.
+ */
+void timing_end(timing_phase);
+
+/* Returns the number of nanoseconds elapsed on the monotonic clock since the
+ * given time, which must have been obtained with
+ * clock_gettime(CLOCK_MONOTONIC).
+ */
+double timing_since(const struct timespec*);
+
+/* Records one run of an external command with the given name (which is
+ * copied), if timing is enabled. Runs are aggregated by name.
+ *
+ * spawn is the time taken to start the process; run is the time from starting
+ * it to reaping it; wait is the time TGL spent blocked waiting for its output
+ * and exit, all in nanoseconds. bytes_in and bytes_out are the amount of data
+ * written to and read from it.
+ */
+void timing_process(const char* name, double spawn, double run, double wait,
+                    unsigned long bytes_in, unsigned long bytes_out);
+
+/* Writes the timing report, if timing is enabled. */
+void timing_report(void);
+
+#endif /* TIMING_H_ */